@@ -0,0 +1,546 @@
+/*
+ * Microbenchmarks for the data structures the upgrade tool is built on:
+ * rbtree.c, list.h, hashtable.h and the INI parser. Every workload runs at 10^3 up to
+ * 10^max elements with sequential and random keys and reports ns/op,
+ * cache misses (perf_event_open, when the kernel allows it) and the heap
+ * bytes used per element.
+ *
+ *   upgrade-bench [-m max_exponent] [-w rbtree|list|hash|ini] [-s seed]
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "list.h"
+#include "rbtree.h"
+#include "hashtable.h"
+#include "iniparser.h"
+
+struct bench_counter {
+    int fd;
+    uint64_t start_ns;
+    uint64_t misses;
+    uint64_t elapsed_ns;
+};
+
+struct bench_rb_node {
+    struct rb_node rb;
+    uint64_t key;
+};
+
+struct bench_list_node {
+    struct list_head list;
+    uint64_t key;
+};
+
+struct bench_hash_node {
+    struct hash_node node;
+    char key[24];
+};
+
+static uint64_t bench_seed = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t bench_rand(void)
+{
+    /* splitmix64 */
+    uint64_t z;
+
+    z = (bench_seed += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static size_t bench_heap_used(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+static void bench_counter_start(struct bench_counter *c)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    c->fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (c->fd >= 0) {
+        ioctl(c->fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(c->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    c->start_ns = bench_now_ns();
+}
+
+static void bench_counter_stop(struct bench_counter *c)
+{
+    c->elapsed_ns = bench_now_ns() - c->start_ns;
+    c->misses = 0;
+    if (c->fd >= 0) {
+        ioctl(c->fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(c->fd, &c->misses, sizeof(c->misses)) != sizeof(c->misses)) {
+            c->misses = 0;
+        }
+        close(c->fd);
+    }
+}
+
+static void bench_report(const char *name, const char *order, size_t n,
+    const struct bench_counter *c, double bytes_per_elem)
+{
+    printf("%-20s %-6s %10zu %10.1f", name, order, n, (double)c->elapsed_ns / (double)n);
+    if (c->fd >= 0) {
+        printf(" %12.3f", (double)c->misses / (double)n);
+    } else {
+        printf(" %12s", "n/a");
+    }
+    if (bytes_per_elem > 0) {
+        printf(" %10.1f\n", bytes_per_elem);
+    } else {
+        printf(" %10s\n", "-");
+    }
+}
+
+static uint64_t *bench_keys(size_t n, int random)
+{
+    size_t i, j;
+    uint64_t tmp, *keys;
+
+    if ((keys = (uint64_t *)malloc(n * sizeof(*keys))) == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < n; ++i) {
+        keys[i] = i;
+    }
+
+    if (random) {
+        for (i = n - 1; i > 0; --i) {
+            j = bench_rand() % (i + 1);
+            tmp = keys[i];
+            keys[i] = keys[j];
+            keys[j] = tmp;
+        }
+    }
+
+    return keys;
+}
+
+static struct bench_rb_node *bench_rb_search(struct rb_root *root, uint64_t key)
+{
+    struct rb_node *node;
+    struct bench_rb_node *entry;
+
+    node = root->rb_node;
+    while (node) {
+        entry = rb_entry(node, struct bench_rb_node, rb);
+        if (key < entry->key) {
+            node = node->rb_left;
+        } else if (key > entry->key) {
+            node = node->rb_right;
+        } else {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static void bench_rb_insert(struct rb_root *root, struct bench_rb_node *entry)
+{
+    struct rb_node **link, *parent;
+
+    parent = NULL;
+    link = &root->rb_node;
+    while (*link) {
+        parent = *link;
+        if (entry->key < rb_entry(parent, struct bench_rb_node, rb)->key) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+        }
+    }
+
+    rb_link_node(&entry->rb, parent, link);
+    rb_insert_color(&entry->rb, root);
+}
+
+static int bench_rbtree(size_t n, int random)
+{
+    size_t i, heap;
+    uint64_t *keys, sum;
+    struct rb_root root;
+    struct rb_node **sorted;
+    struct bench_counter c;
+    struct bench_rb_node **nodes, *entry;
+    const char *order;
+
+    order = random ? "random" : "seq";
+    if ((keys = bench_keys(n, random)) == NULL) {
+        return -1;
+    }
+
+    if ((nodes = (struct bench_rb_node **)malloc(n * sizeof(*nodes))) == NULL) {
+        free(keys);
+        return -1;
+    }
+
+    heap = bench_heap_used();
+    for (i = 0; i < n; ++i) {
+        if ((nodes[i] = (struct bench_rb_node *)malloc(sizeof(**nodes))) == NULL) {
+            while (i-- > 0) {
+                free(nodes[i]);
+            }
+            free(nodes);
+            free(keys);
+            return -1;
+        }
+        nodes[i]->key = keys[i];
+    }
+    heap = bench_heap_used() - heap;
+
+    root = RB_ROOT;
+    bench_counter_start(&c);
+    for (i = 0; i < n; ++i) {
+        bench_rb_insert(&root, nodes[i]);
+    }
+    bench_counter_stop(&c);
+    bench_report("rb_insert_color", order, n, &c, heap ? (double)heap / n : sizeof(**nodes));
+
+    sum = 0;
+    bench_counter_start(&c);
+    for (i = 0; i < n; ++i) {
+        if ((entry = bench_rb_search(&root, keys[n - 1 - i])) != NULL) {
+            sum += entry->key;
+        }
+    }
+    bench_counter_stop(&c);
+    bench_report("rb_search", order, n, &c, 0);
+
+    bench_counter_start(&c);
+    for (i = 0; i < n; ++i) {
+        rb_erase(&nodes[i]->rb, &root);
+    }
+    bench_counter_stop(&c);
+    bench_report("rb_erase", order, n, &c, 0);
+
+    /* bulk construction from sorted input, for comparison with inserts */
+    if ((sorted = (struct rb_node **)malloc(n * sizeof(*sorted))) != NULL) {
+        for (i = 0; i < n; ++i) {
+            sorted[nodes[i]->key] = &nodes[i]->rb;
+        }
+        bench_counter_start(&c);
+        rb_build_sorted(&root, sorted, n);
+        bench_counter_stop(&c);
+        bench_report("rb_build_sorted", order, n, &c, 0);
+        free(sorted);
+    }
+
+    for (i = 0; i < n; ++i) {
+        free(nodes[i]);
+    }
+    free(nodes);
+    free(keys);
+
+    return sum == (uint64_t)n * (n - 1) / 2 ? 0 : -1;
+}
+
+static int bench_list(size_t n, int random)
+{
+    size_t i, heap;
+    uint64_t *keys, sum;
+    struct list_head head;
+    struct bench_counter c;
+    struct bench_list_node **nodes, *entry, *tmp;
+    const char *order;
+
+    /* random: nodes are linked in shuffled allocation order, so the walk jumps around memory */
+    order = random ? "random" : "seq";
+    if ((keys = bench_keys(n, random)) == NULL) {
+        return -1;
+    }
+
+    if ((nodes = (struct bench_list_node **)malloc(n * sizeof(*nodes))) == NULL) {
+        free(keys);
+        return -1;
+    }
+
+    heap = bench_heap_used();
+    for (i = 0; i < n; ++i) {
+        if ((nodes[i] = (struct bench_list_node *)malloc(sizeof(**nodes))) == NULL) {
+            while (i-- > 0) {
+                free(nodes[i]);
+            }
+            free(nodes);
+            free(keys);
+            return -1;
+        }
+        nodes[i]->key = i;
+    }
+    heap = bench_heap_used() - heap;
+
+    INIT_LIST_HEAD(&head);
+    bench_counter_start(&c);
+    for (i = 0; i < n; ++i) {
+        list_add_tail(&nodes[keys[i]]->list, &head);
+    }
+    bench_counter_stop(&c);
+    bench_report("list_add_tail", order, n, &c, heap ? (double)heap / n : sizeof(**nodes));
+
+    sum = 0;
+    bench_counter_start(&c);
+    list_for_each_entry(entry, &head, list) {
+        sum += entry->key;
+    }
+    bench_counter_stop(&c);
+    bench_report("list_for_each", order, n, &c, 0);
+
+    bench_counter_start(&c);
+    list_for_each_entry_safe(entry, tmp, &head, list) {
+        list_del(&entry->list);
+    }
+    bench_counter_stop(&c);
+    bench_report("list_del", order, n, &c, 0);
+
+    for (i = 0; i < n; ++i) {
+        free(nodes[i]);
+    }
+    free(nodes);
+    free(keys);
+
+    return sum == (uint64_t)n * (n - 1) / 2 ? 0 : -1;
+}
+
+static struct bench_hash_node *bench_hash_search(struct hash_table *table, const char *key)
+{
+    uint64_t hash;
+    struct hlist_node *pos;
+    struct bench_hash_node *entry;
+
+    hash = hash_table_hash(table, key, strlen(key));
+    hash_table_for_each_possible(table, entry, pos, hash, node) {
+        if (strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static int bench_hash(size_t n, int random)
+{
+    int ret;
+    size_t i, heap;
+    uint64_t *keys;
+    char key[24];
+    struct hash_table table;
+    struct bench_counter c;
+    struct bench_hash_node *nodes;
+    const char *order;
+
+    /* string keys, the table starts with one bucket and grows while adding */
+    order = random ? "random" : "seq";
+    if ((keys = bench_keys(n, random)) == NULL) {
+        return -1;
+    }
+
+    if ((nodes = (struct bench_hash_node *)malloc(n * sizeof(*nodes))) == NULL
+            || hash_table_init(&table, 0, hash_wyhash) < 0) {
+        free(nodes);
+        free(keys);
+        return -1;
+    }
+
+    for (i = 0; i < n; ++i) {
+        snprintf(nodes[i].key, sizeof(nodes[i].key), "key%08zu", (size_t)keys[i]);
+    }
+
+    heap = bench_heap_used();
+    bench_counter_start(&c);
+    for (i = 0; i < n; ++i) {
+        hash_table_add(&table, &nodes[i].node,
+            hash_table_hash(&table, nodes[i].key, strlen(nodes[i].key)));
+    }
+    bench_counter_stop(&c);
+    heap = bench_heap_used() - heap;
+    bench_report("hash_table_add", order, n, &c, sizeof(*nodes) + (heap ? (double)heap / n : 0));
+
+    ret = 0;
+    bench_counter_start(&c);
+    for (i = 0; i < n; ++i) {
+        snprintf(key, sizeof(key), "key%08zu", (size_t)keys[n - 1 - i]);
+        if (bench_hash_search(&table, key) == NULL) {
+            ret = -1;
+        }
+    }
+    bench_counter_stop(&c);
+    bench_report("hash_table lookup", order, n, &c, 0);
+
+    bench_counter_start(&c);
+    for (i = 0; i < n; ++i) {
+        hash_table_del(&table, &nodes[i].node);
+    }
+    bench_counter_stop(&c);
+    bench_report("hash_table_del", order, n, &c, 0);
+
+    hash_table_destroy(&table);
+    free(nodes);
+    free(keys);
+
+    return ret;
+}
+
+static int bench_ini(size_t n, int random)
+{
+    int ret;
+    size_t i, heap;
+    FILE *fp;
+    uint64_t *keys;
+    INI_CONFIG config;
+    struct bench_counter c;
+    char path[] = "/tmp/upgrade-bench-XXXXXX";
+    char section[32], key[32];
+    const char *order;
+
+    /* 100 keys per section; random shuffles the order they are written in */
+    order = random ? "random" : "seq";
+    if ((keys = bench_keys(n, random)) == NULL) {
+        return -1;
+    }
+
+    ret = mkstemp(path);
+    if (ret < 0 || (fp = fdopen(ret, "w")) == NULL) {
+        free(keys);
+        return -1;
+    }
+
+    /* a repeated header reopens its section, so random order still lands every key in keys[i] / 100 */
+    for (i = 0; i < n; ++i) {
+        if (i == 0 || keys[i] / 100 != keys[i - 1] / 100) {
+            fprintf(fp, "[section%08zu]\n", (size_t)(keys[i] / 100));
+        }
+        fprintf(fp, "key%08zu = value of key %zu\n", (size_t)keys[i], (size_t)keys[i]);
+    }
+    fclose(fp);
+
+    ret = -1;
+    heap = bench_heap_used();
+    bench_counter_start(&c);
+    config = ini_config_create(path);
+    bench_counter_stop(&c);
+    heap = bench_heap_used() - heap;
+    if (config == NULL) {
+        goto out;
+    }
+    bench_report("ini_config_create", order, n, &c, heap ? (double)heap / n : 0);
+
+    ret = 0;
+    bench_counter_start(&c);
+    for (i = 0; i < n; ++i) {
+        snprintf(section, sizeof(section), "section%08zu", (size_t)(keys[i] / 100));
+        snprintf(key, sizeof(key), "key%08zu", (size_t)keys[i]);
+        if (ini_config_get(config, section, key, NULL) == NULL) {
+            ret = -1;
+        }
+    }
+    bench_counter_stop(&c);
+    bench_report("ini_config_get hit", order, n, &c, 0);
+
+    bench_counter_start(&c);
+    for (i = 0; i < n; ++i) {
+        snprintf(section, sizeof(section), "section%08zu", (size_t)(keys[i] / 100));
+        snprintf(key, sizeof(key), "nokey%08zu", (size_t)keys[i]);
+        if (ini_config_get(config, section, key, NULL) != NULL) {
+            ret = -1;
+        }
+    }
+    bench_counter_stop(&c);
+    bench_report("ini_config_get miss", order, n, &c, 0);
+
+    ini_config_release(config);
+out:
+    unlink(path);
+    free(keys);
+
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-m max_exponent(3-7)] [-w rbtree|list|hash|ini] [-s seed]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, exp, max_exp, random, ret;
+    size_t n;
+    const char *workload;
+
+    max_exp = 6;
+    workload = NULL;
+    while ((opt = getopt(argc, argv, "m:w:s:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            max_exp = atoi(optarg);
+            break;
+        case 'w':
+            workload = optarg;
+            break;
+        case 's':
+            bench_seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (max_exp < 3 || max_exp > 7) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    ret = 0;
+    printf("%-20s %-6s %10s %10s %12s %10s\n", "benchmark", "order", "n", "ns/op",
+        "misses/op", "bytes/elem");
+    for (exp = 3, n = 1000; exp <= max_exp; ++exp, n *= 10) {
+        for (random = 0; random < 2; ++random) {
+            if ((workload == NULL || strcmp(workload, "rbtree") == 0) && bench_rbtree(n, random) != 0) {
+                ret = 1;
+            }
+            if ((workload == NULL || strcmp(workload, "list") == 0) && bench_list(n, random) != 0) {
+                ret = 1;
+            }
+            if ((workload == NULL || strcmp(workload, "hash") == 0) && bench_hash(n, random) != 0) {
+                ret = 1;
+            }
+            if ((workload == NULL || strcmp(workload, "ini") == 0) && bench_ini(n, random) != 0) {
+                ret = 1;
+            }
+        }
+    }
+
+    return ret;
+}
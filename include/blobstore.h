@@ -0,0 +1,63 @@
+#ifndef __UPGRADE_BLOBSTORE_H__
+#define __UPGRADE_BLOBSTORE_H__
+
+#include <stddef.h>
+
+/*
+ * 以内容标识(见os_blob_content_id, 如"sha256:<hex>")为键的本地镜像仓库:
+ *
+ *   installed.ini      每个分区(slot)当前写入的内容, 以及写入它的耗时
+ *   objects.ini        仓库中保存的解压后的镜像, 以及解压它的耗时
+ *   objects/<算法>/<hex>  解压后的镜像, 只在[upgrade] keep_objects开启时保存
+ *
+ * 耗时用于估算跳过或复用镜像节省的时间.
+ */
+#define BLOB_STORE_ROOT         "/var/lib/upgrade"
+#define BLOB_STORE_STATE        BLOB_STORE_ROOT "/installed.ini"
+#define BLOB_STORE_INDEX        BLOB_STORE_ROOT "/objects.ini"
+#define BLOB_STORE_OBJECTS      BLOB_STORE_ROOT "/objects"
+
+/**
+ * @brief blob_store_installed 判断分区中是否已经是指定的内容
+ * @param slot      分区名, 如"rootfs"
+ * @param content   内容标识
+ * @param cost_ms   已安装时返回上次解压和写入的总耗时, 可以为NULL
+ * @return  已安装返回1, 否则返回0
+ */
+extern int blob_store_installed(const char *slot, const char *content, long *cost_ms);
+
+/**
+ * @brief blob_store_set_installed 记录分区中写入的内容
+ * @param slot      分区名
+ * @param content   内容标识
+ * @param size      内容大小
+ * @param cost_ms   解压和写入的总耗时
+ * @return  成功返回0, 失败返回-1
+ * @note    写入分区前应先调用blob_store_clear_installed, 写入中途失败时分区不会被误认为已安装
+ */
+extern int blob_store_set_installed(const char *slot, const char *content, size_t size, long cost_ms);
+
+extern int blob_store_clear_installed(const char *slot);
+
+/**
+ * @brief blob_store_lookup 查找仓库中解压好的镜像
+ * @param content   内容标识
+ * @param size      期望的大小
+ * @param path      返回镜像的路径
+ * @param n         path的大小
+ * @param cost_ms   返回当初解压的耗时, 可以为NULL
+ * @return  找到返回1, 否则返回0
+ */
+extern int blob_store_lookup(const char *content, size_t size, char *path, size_t n, long *cost_ms);
+
+/**
+ * @brief blob_store_put 把解压好的镜像放进仓库
+ * @param content   内容标识
+ * @param fd        解压后的镜像, 由调用者关闭
+ * @param cost_ms   解压的耗时
+ * @return  成功返回0, 失败返回-1
+ * @note    O_TMPFILE创建的文件在同一个文件系统上时直接链接进仓库, 否则复制
+ */
+extern int blob_store_put(const char *content, int fd, long cost_ms);
+
+#endif /* __UPGRADE_BLOBSTORE_H__ */
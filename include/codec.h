@@ -0,0 +1,91 @@
+#ifndef __UPGRADE_CODEC_H__
+#define __UPGRADE_CODEC_H__
+
+#include <stddef.h>
+
+/*
+ * 镜像在升级包中的编码, 由清单中镜像的"codec"指定, 缺省为raw:
+ *
+ *   raw    包中的文件就是镜像, 适合squashfs等已经压缩过的镜像
+ *   zstd   包中的文件是zstd压缩的镜像
+ *   lz4    包中的文件是lz4 frame格式压缩的镜像, 解压比zstd快几倍, 适合性能弱的设备
+ *
+ * md5sum和分块哈希都是对解码后的镜像计算的. 编译时定义HAVE_ZSTD/HAVE_LZ4时在进程内
+ * 解码, 否则调用zstd/lz4命令.
+ *
+ * zstd编码的镜像可以引用本地已有的内容, 相邻版本的镜像大部分相同, 包可以小很多:
+ *
+ *   dictionary  zstd --train训练的字典, 用zstd -D编码
+ *   base        旧版本的镜像, 用zstd --patch-from编码
+ */
+typedef enum {
+    BLOB_CODEC_UNKNOWN = -1,
+    BLOB_CODEC_RAW,
+    BLOB_CODEC_ZSTD,
+    BLOB_CODEC_LZ4,
+} blob_codec_t;
+
+typedef enum {
+    BLOB_REF_UNKNOWN = -1,
+    BLOB_REF_NONE,
+    BLOB_REF_DICTIONARY,
+    BLOB_REF_BASE,
+} blob_ref_type_t;
+
+typedef struct blob_decoder blob_decoder_t;
+
+/* 解码后的内容写出前先交给它检查, 返回非0时停止解码, 用于边解码边逐块校验 */
+typedef int (*blob_check_t)(void *arg, const void *buf, size_t n);
+
+/* 名字为NULL时返回BLOB_CODEC_RAW, 不认识的名字返回BLOB_CODEC_UNKNOWN */
+extern blob_codec_t blob_codec_lookup(const char *name);
+
+extern const char *blob_codec_name(blob_codec_t codec);
+
+/* 名字为NULL时返回BLOB_REF_NONE, 不认识的名字返回BLOB_REF_UNKNOWN */
+extern blob_ref_type_t blob_ref_lookup(const char *name);
+
+extern const char *blob_ref_name(blob_ref_type_t ref);
+
+/**
+ * @brief blob_decoder_create 创建解码器, 解码后的内容写到out
+ * @param codec     编码
+ * @param ref       引用的内容的类型, 只有zstd可以引用
+ * @param ref_path  引用的内容所在的文件, 进程内解码时用mmap映射, ref为BLOB_REF_NONE时忽略
+ * @param out       输出的文件描述符, 由调用者关闭
+ * @param check     写出前检查解码后的内容, 可以为NULL
+ * @param arg       传给check的参数
+ * @return  失败返回NULL
+ * @note    有check时调用命令解码的输出也经过本进程, 不再直接写到out
+ */
+extern blob_decoder_t *blob_decoder_create(blob_codec_t codec, blob_ref_type_t ref, const char *ref_path,
+        int out, blob_check_t check, void *arg);
+
+/**
+ * @brief blob_decoder_write 输入一段编码后的数据
+ * @return  成功返回0, 数据损坏或者写入失败返回-1
+ */
+extern int blob_decoder_write(blob_decoder_t *decoder, const void *buf, size_t n);
+
+/**
+ * @brief blob_decoder_close 结束解码并释放解码器
+ * @return  输入是完整的并且全部写出返回0, 否则返回-1
+ */
+extern int blob_decoder_close(blob_decoder_t *decoder);
+
+/**
+ * @brief blob_decode_fd 把in中的内容解码后写到out, 直到in结束
+ * @param codec     编码
+ * @param ref       引用的内容的类型
+ * @param ref_path  引用的内容所在的文件
+ * @param in        输入
+ * @param out       输出
+ * @param check     写出前检查解码后的内容, 可以为NULL
+ * @param arg       传给check的参数
+ * @return  成功返回0, 失败或者check不通过返回-1
+ * @note    没有check时raw在内核中复制: 输入是管道时用splice, 两边都是普通文件时用copy_file_range
+ */
+extern int blob_decode_fd(blob_codec_t codec, blob_ref_type_t ref, const char *ref_path, int in, int out,
+        blob_check_t check, void *arg);
+
+#endif /* __UPGRADE_CODEC_H__ */
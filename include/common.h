@@ -3,11 +3,20 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 #define debug(fmt, ...)
 #define BUFF_SIZE           4096
 #define ARRAY_SIZE(array)   (sizeof(array) / sizeof(*array))
 
+typedef void (*progress_sink_t)(void *arg, const char *text, size_t len);
+
+/* 设置当前线程的进度输出, sink为NULL时恢复为stdout */
+extern void progress_set_sink(progress_sink_t sink, void *arg);
+
+/* 取得当前线程的进度输出, 交给工作线程时用 */
+extern void progress_get_sink(progress_sink_t *sink, void **arg);
+
 extern void progress_print(void *reserved, const char *fmt, ...);
 
 extern void progress_clearline(void);
@@ -30,4 +39,42 @@ extern ssize_t full_read(int fd, void *buf, size_t size);
 
 extern ssize_t full_write(int fd, const void *buf, size_t size);
 
+/**
+ * @brief file_drop_cache 丢弃文件[off, off + len)已读过的页缓存, 不影响其他服务的缓存
+ * @param len   为0时到文件末尾
+ * @note    对管道等不支持的文件什么都不做; 设置了page_cache_set_counter时统计移除的字节数
+ */
+extern void file_drop_cache(int fd, off_t off, off_t len);
+
+/**
+ * @brief file_writeback_drop 把写入的[off, off + len)写回磁盘后丢弃页缓存
+ * @return  成功返回0, 写回失败返回-1
+ * @note    只写回数据, 不代替fsync保证元数据落盘
+ */
+extern int file_writeback_drop(int fd, off_t off, off_t len);
+
+/**
+ * @brief scratch_file 创建没有路径的暂存文件, 关闭后内容随之释放, 进程崩溃也不会留下
+ * @param name      名字, 只在/proc/<pid>/fd中可见
+ * @param dir       不放在内存中时, 在这个目录所在的文件系统上用O_TMPFILE创建
+ * @param in_memory 为true时用memfd放在内存中
+ * @return  可读写的文件描述符, 失败返回-1
+ */
+extern int scratch_file(const char *name, const char *dir, bool in_memory);
+
+/* 封住memfd, 之后谁都不能再修改它的内容; 对其他文件什么都不做 */
+extern int scratch_seal(int fd);
+
+/* fd在/proc中的路径, 子进程也能用它打开同一个文件 */
+extern int fd_path(int fd, char *buf, size_t n);
+
+/**
+ * @brief page_cache_set_counter 设置当前线程的页缓存计数器
+ * @param counter   之后file_drop_cache真正从页缓存中移除的字节数原子地累加到这里,
+ *                  为NULL时不统计; 同一任务的线程设置同一个计数器
+ */
+extern void page_cache_set_counter(size_t *counter);
+
+extern size_t *page_cache_get_counter(void);
+
 #endif /* __UPGRADE_COMMON_H__ */
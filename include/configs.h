@@ -1,6 +1,51 @@
 ﻿#ifndef __UPGRADE_CONFIGS_H__
 #define __UPGRADE_CONFIGS_H__
 
+#include <stddef.h>
+#include <stdbool.h>
+
 #define SYSTEM_INFO_CONF        "/etc/system_info.conf"
+/* SYSTEM_INFO_CONF预编译的镜像, 配置文件没有变化时直接mmap, 启动时不用解析文本 */
+#define SYSTEM_INFO_CACHE       "/var/cache/upgrade/system_info.img"
+
+/* 环境变量, 格式为"upgrade.threads=4:upgrade.durability=data", 优先于配置文件 */
+#define SYSTEM_TUNABLES_ENV     "UPGRADE_TUNABLES"
+
+/* 升级流程用到的可调参数, 对应SYSTEM_INFO_CONF中[upgrade]节的同名字段 */
+typedef enum {
+    SYS_TUNABLE_THREADS,        /* threads, 工作线程数, 0表示按在线CPU个数 */
+    SYS_TUNABLE_IO_BUFFER_SIZE, /* io_buffer_size, 流式安装时单次读取的缓冲区大小 */
+    SYS_TUNABLE_MEMORY_BUDGET,  /* memory_budget, 升级过程可用的内存上限 */
+    SYS_TUNABLE_DURABILITY,     /* durability, 镜像放进本地仓库时的落盘策略, 见system_durability_t */
+    SYS_TUNABLE_KEEP_OBJECTS,   /* keep_objects, 是否在本地仓库中保留解压后的镜像 */
+    SYS_TUNABLE_MAX
+} system_tunable_t;
+
+typedef enum {
+    SYS_DURABILITY_NONE,        /* none, 不主动落盘 */
+    SYS_DURABILITY_DATA,        /* data, fdatasync */
+    SYS_DURABILITY_FULL,        /* full, fsync文件和所在目录 */
+} system_durability_t;
+
+/**
+ * @brief get_system_config 获取系统配置
+ * @return  SYSTEM_INFO_CONF不存在或无法解析时返回NULL, 否则返回INI_CONFIG
+ * @note    第一次调用时通过SYSTEM_INFO_CACHE加载, 之后所有线程共享同一份只读配置,
+ *          不能修改或释放
+ */
+extern void *get_system_config(void);
+
+/**
+ * @brief system_config_int 获取整型可调参数
+ * @param id    可调参数
+ * @return  参数值; 没有配置或配置不合法时为默认值
+ * @note    所有可调参数在加载配置时解析并检查范围, 调用本函数不再解析字符串,
+ *          system_config_bool/system_config_size同理
+ */
+extern long long system_config_int(system_tunable_t id);
+
+extern bool system_config_bool(system_tunable_t id);
+
+extern size_t system_config_size(system_tunable_t id);
 
 #endif /* __UPGRADE_CONFIGS_H__ */
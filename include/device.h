@@ -0,0 +1,39 @@
+#ifndef __UPGRADE_DEVICE_H__
+#define __UPGRADE_DEVICE_H__
+
+#include <stdint.h>
+
+/*
+ * 设备id的来源在SYSTEM_INFO_CONF的[device]节中配置:
+ *
+ *   [device]
+ *   id = 123                                   ; 来源"config"读取的值
+ *   id_sources = config, dt:/proc/device-tree/device-id, sysfs:/sys/bus/nvmem/devices/id/value
+ *   probe_timeout_ms = 500
+ *
+ * id_sources按优先级从高到低排列, 支持以下来源:
+ *   config         [device]节的id字段
+ *   sysfs:<path>   文本形式的数字, 支持0x前缀
+ *   dt:<path>      设备树属性, 4字节大端cell或者字符串
+ */
+#define DEVICE_ID_SOURCES_DEFAULT   "config, dt:/proc/device-tree/device-id"
+#define DEVICE_PROBE_TIMEOUT_MS     500
+#define DEVICE_ID_CACHE_DIR         "/run/upgrade"
+#define DEVICE_ID_CACHE             DEVICE_ID_CACHE_DIR "/device-id"
+
+/**
+ * @brief device_get_id 获取设备id
+ * @param id    保存设备id
+ * @return  成功返回0, 所有来源都失败或超时返回-1
+ * @note    结果缓存在进程内和DEVICE_ID_CACHE(tmpfs)中, 后者在来源配置或
+ *          SYSTEM_INFO_CONF变化时失效. 没有缓存时并行读取所有来源, 取已完成的
+ *          来源中优先级最高的一个, 等待时间不超过probe_timeout_ms.
+ */
+extern int device_get_id(uint32_t *id);
+
+/**
+ * @brief device_id_invalidate 丢弃进程内和tmpfs中缓存的设备id
+ */
+extern void device_id_invalidate(void);
+
+#endif /* __UPGRADE_DEVICE_H__ */
@@ -0,0 +1,160 @@
+#ifndef __UPGRADE_HASHTABLE_H__
+#define __UPGRADE_HASHTABLE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "list.h"
+
+/*
+ * 基于hlist的拉链哈希表, 可以扩容.
+ *
+ * 表项中嵌入struct hash_node, 它在hlist链接旁边保存完整的64位哈希值: 查找时先比较
+ * 保存的哈希值再比较键, 扩容时也不用重新计算哈希. 表只拥有桶数组, 表项由调用者分配
+ * 和释放.
+ *
+ * 用hash_table_for_each_possible查找, 它只给出哈希值相同的表项, 由调用者比较键:
+ *
+ *     h = hash_table_hash(&table, name, strlen(name));
+ *     hash_table_for_each_possible(&table, entry, pos, h, node) {
+ *         if (strcmp(entry->name, name) == 0)
+ *             return entry;
+ *     }
+ */
+typedef uint64_t (*hash_func_t)(const void *key, size_t len, uint64_t seed);
+
+struct hash_node {
+    struct hlist_node node;
+    uint64_t hash;
+};
+
+struct hash_table {
+    struct hlist_head *buckets;
+    unsigned int bits;
+    unsigned int flags;
+    size_t count;
+    hash_func_t hashfn;
+    uint64_t seed;
+};
+
+#define HASH_TABLE_STATIC       0x1     /* 桶数组不属于表 */
+#define HASH_TABLE_FIXED        0x2     /* 不自动扩容 */
+
+/*
+ * 有1 << bits个桶的静态表, 不用hash_table_init就可以使用:
+ *
+ *     static DEFINE_HASH_TABLE(name_table, 4, hash_wyhash);
+ *
+ * 仍然会按需扩容, 第一次扩容时桶数组移到堆上.
+ */
+#define DEFINE_HASH_TABLE(name, nbits, fn)                                  \
+    struct hash_table name = {                                              \
+        .buckets = (struct hlist_head [1 << (nbits)]){ { NULL } },          \
+        .bits = (nbits),                                                    \
+        .flags = HASH_TABLE_STATIC,                                         \
+        .count = 0,                                                         \
+        .hashfn = (fn),                                                     \
+        .seed = 0,                                                          \
+    }
+
+extern uint64_t hash_wyhash(const void *key, size_t len, uint64_t seed);
+extern uint64_t hash_fnv1a(const void *key, size_t len, uint64_t seed);
+
+/* hashfn为NULL时用hash_wyhash, bits是初始大小的提示 */
+extern int hash_table_init(struct hash_table *table, unsigned int bits, hash_func_t hashfn);
+extern void hash_table_destroy(struct hash_table *table);
+extern int hash_table_resize(struct hash_table *table, unsigned int bits);
+
+static inline uint64_t hash_table_hash(const struct hash_table *table, const void *key, size_t len)
+{
+    return table->hashfn(key, len, table->seed);
+}
+
+/* 64位整数键(如设备id)的哈希, 不经过hashfn */
+static inline uint64_t hash_u64(uint64_t val)
+{
+    val ^= val >> 33;
+    val *= 0xff51afd7ed558ccdULL;
+    val ^= val >> 33;
+    val *= 0xc4ceb9fe1a85ec53ULL;
+    return val ^ (val >> 33);
+}
+
+static inline struct hlist_head *hash_table_bucket(const struct hash_table *table, uint64_t hash)
+{
+    /* 上面的哈希函数高位混合得最充分, 用高位选桶 */
+    return &table->buckets[table->bits ? hash >> (64 - table->bits) : 0];
+}
+
+static inline size_t hash_table_size(const struct hash_table *table)
+{
+    return (size_t)1 << table->bits;
+}
+
+static inline int hash_table_empty(const struct hash_table *table)
+{
+    return table->count == 0;
+}
+
+static inline int hash_hashed(const struct hash_node *node)
+{
+    return !hlist_unhashed(&node->node);
+}
+
+static inline void hash_table_add(struct hash_table *table, struct hash_node *node, uint64_t hash)
+{
+    /* 负载因子为1, 扩容失败只是链长一些 */
+    if (table->count >= hash_table_size(table) && !(table->flags & HASH_TABLE_FIXED)) {
+        hash_table_resize(table, table->bits + 1);
+    }
+
+    node->hash = hash;
+    hlist_add_head(&node->node, hash_table_bucket(table, hash));
+    table->count++;
+}
+
+static inline void hash_table_del(struct hash_table *table, struct hash_node *node)
+{
+    hlist_del_init(&node->node);
+    table->count--;
+}
+
+/**
+ * hash_table_for_each_possible - 遍历保存的哈希值等于@key_hash的表项
+ * @table:    struct hash_table
+ * @tpos:     表项类型的指针, 作为循环变量
+ * @pos:      struct hlist_node指针, 作为循环变量
+ * @key_hash: 要查找的键的哈希值
+ * @member:   hash_node在表项中的成员名
+ */
+#define hash_table_for_each_possible(table, tpos, pos, key_hash, member)                \
+    hlist_for_each_entry(tpos, pos, hash_table_bucket(table, key_hash), member.node)    \
+        if ((tpos)->member.hash != (key_hash)) {} else
+
+/**
+ * hash_table_for_each - 遍历表中的所有表项
+ * @table:  struct hash_table
+ * @bkt:    size_t, 作为桶的循环变量
+ * @tpos:   表项类型的指针, 作为循环变量
+ * @pos:    struct hlist_node指针, 作为循环变量
+ * @member: hash_node在表项中的成员名
+ *
+ * 这是两层循环, break只会离开当前的桶.
+ */
+#define hash_table_for_each(table, bkt, tpos, pos, member)                              \
+    for ((bkt) = 0; (bkt) < hash_table_size(table); (bkt)++)                            \
+        hlist_for_each_entry(tpos, pos, &(table)->buckets[bkt], member.node)
+
+/**
+ * hash_table_for_each_safe - 遍历表中的所有表项, 可以在遍历时删除
+ * @table:  struct hash_table
+ * @bkt:    size_t, 作为桶的循环变量
+ * @tpos:   表项类型的指针, 作为循环变量
+ * @pos:    struct hlist_node指针, 作为循环变量
+ * @n:      另一个struct hlist_node指针, 用于临时保存
+ * @member: hash_node在表项中的成员名
+ */
+#define hash_table_for_each_safe(table, bkt, tpos, pos, n, member)                      \
+    for ((bkt) = 0; (bkt) < hash_table_size(table); (bkt)++)                            \
+        hlist_for_each_entry_safe(tpos, pos, n, &(table)->buckets[bkt], member.node)
+
+#endif /* __UPGRADE_HASHTABLE_H__ */
@@ -11,6 +11,25 @@ typedef void *INI_CONFIG;
  */
 extern INI_CONFIG ini_config_create(const char *const file);
 
+/**
+ * @brief ini_config_create_cached 读取ini配置, 优先使用预编译的二进制镜像
+ * @param file      ini配置文件
+ * @param cache     二进制镜像文件, 指定NULL时等同于ini_config_create
+ * @return  获取ini配置失败返回NULL, 否则返回一个保存ini配置的数据结构
+ * @note    镜像记录了配置文件的设备号/inode/大小/mtime和自身的校验和, 任何一项
+ *          不匹配都会重新解析文本并重写镜像; 镜像有效时直接mmap, 不解析文本.
+ *          第一次修改或保存配置时才把镜像展开成可修改的数据结构.
+ */
+extern INI_CONFIG ini_config_create_cached(const char *const file, const char *const cache);
+
+/**
+ * @brief ini_config_dup 复制一份ini配置
+ * @param config    ini配置
+ * @return  复制失败返回NULL, 否则返回新的ini配置, 关联的文件与原配置相同
+ * @note    不修改原配置, 可以在其他线程只读访问原配置时调用
+ */
+extern INI_CONFIG ini_config_dup(INI_CONFIG config);
+
 /**
  * @brief ini_config_get 获取指定字段的值
  * @param config    ini配置
@@ -34,6 +53,18 @@ extern const char *ini_config_get(INI_CONFIG config, const char *section,
 extern int ini_config_set(INI_CONFIG config, const char *section,
     const char *key, const char *value);
 
+/**
+ * @brief ini_config_diff 比较两份ini配置, 找出内容不同的节
+ * @param old       旧配置
+ * @param new       新配置
+ * @param changed   每个新增/删除/内容变化的节调用一次, 可以为NULL
+ * @param arg       传给changed的参数
+ * @return  返回内容不同的节的数量, 失败返回-1
+ * @note    不修改两份配置, 可以在其他线程只读访问它们时调用
+ */
+extern int ini_config_diff(INI_CONFIG old, INI_CONFIG new,
+    void (*changed)(const char *section, void *arg), void *arg);
+
 /**
  * @brief ini_config_clear_section 清空配置中指定的节
  * @param config    ini配置
@@ -80,6 +111,7 @@ extern int ini_config_save2filestream(INI_CONFIG config, FILE *fp);
  * @param config    ini配置
  * @param file      保存ini配置的文件名
  * @return  保存成功返回0, 失败返回-1
+ * @note    通过临时文件和rename原子替换, 失败时原文件保持不变
  */
 extern int ini_config_saveas(INI_CONFIG config, const char *file);
 
@@ -90,6 +122,31 @@ extern int ini_config_saveas(INI_CONFIG config, const char *file);
  */
 extern int ini_config_save(INI_CONFIG config);
 
+/**
+ * @brief ini_config_begin 开始一个事务
+ * @param config    ini配置
+ * @return  成功返回0, 失败返回-1
+ * @note    对配置文件加排他锁(<file>.lock), 并在锁内重新读取文件的最新内容,
+ *          之后的ini_config_set/ini_config_erase_*只修改内存, 直到提交或回滚
+ */
+extern int ini_config_begin(INI_CONFIG config);
+
+/**
+ * @brief ini_config_commit 提交事务
+ * @param config    ini配置
+ * @return  提交成功返回0, 失败返回-1
+ * @note    整个配置一次序列化到内存, 一次写入临时文件, fsync后rename覆盖原文件,
+ *          其他进程不会读到写了一半的文件; 无论成功与否都会释放事务锁
+ */
+extern int ini_config_commit(INI_CONFIG config);
+
+/**
+ * @brief ini_config_rollback 回滚事务, 丢弃内存中的修改并重新读取文件
+ * @param config    ini配置
+ * @return  回滚成功返回0, 失败返回-1
+ */
+extern int ini_config_rollback(INI_CONFIG config);
+
 /**
  * @brief ini_config_release 释放ini数据结构的内存
  * @param config    ini配置
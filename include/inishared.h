@@ -0,0 +1,123 @@
+#ifndef __INISHARED_H__
+#define __INISHARED_H__
+
+#include "iniparser.h"
+
+/*
+ * 多线程共享的ini配置(RCU风格):
+ *   读者通过ini_shared_acquire获取当前版本的引用, 不加锁, 版本在引用期间不会变化;
+ *   写者通过ini_shared_edit得到当前版本的副本, 修改后用ini_shared_publish原子发布;
+ *   旧版本在所有读者都调用ini_snapshot_release之后才释放.
+ */
+typedef void *INI_SHARED;
+typedef void *INI_SNAPSHOT;
+
+/**
+ * @brief ini_shared_create 创建共享配置
+ * @param config    初始版本, 之后由共享配置接管, 调用者不能再修改或释放
+ * @return  失败返回NULL
+ */
+extern INI_SHARED ini_shared_create(INI_CONFIG config);
+
+/**
+ * @brief ini_shared_destroy 销毁共享配置
+ * @param shared    共享配置
+ * @note    仍被读者持有的快照在最后一次ini_snapshot_release时释放
+ */
+extern void ini_shared_destroy(INI_SHARED shared);
+
+/**
+ * @brief ini_shared_acquire 获取当前版本的快照, 无锁
+ * @param shared    共享配置
+ * @return  当前版本的快照, 用完后必须调用ini_snapshot_release
+ */
+extern INI_SNAPSHOT ini_shared_acquire(INI_SHARED shared);
+
+/**
+ * @brief ini_snapshot_config 获取快照中的ini配置
+ * @param snapshot  快照
+ * @return  只读的ini配置, 只能用ini_config_get/ini_config_dup等不修改配置的函数访问
+ */
+extern INI_CONFIG ini_snapshot_config(INI_SNAPSHOT snapshot);
+
+/**
+ * @brief ini_snapshot_get 在快照中查询字段的值, 参数同ini_config_get
+ * @note    返回的字符串在ini_snapshot_release之前有效
+ */
+extern const char *ini_snapshot_get(INI_SNAPSHOT snapshot, const char *section,
+    const char *key, const char *default_value);
+
+/**
+ * @brief ini_snapshot_release 释放快照的引用
+ * @param snapshot  快照
+ */
+extern void ini_snapshot_release(INI_SNAPSHOT snapshot);
+
+/**
+ * @brief ini_shared_edit 开始修改共享配置
+ * @param shared    共享配置
+ * @return  当前版本的私有副本, 失败返回NULL
+ * @note    写者之间互斥, 必须以ini_shared_publish或ini_shared_abort结束
+ */
+extern INI_CONFIG ini_shared_edit(INI_SHARED shared);
+
+/**
+ * @brief ini_shared_publish 发布新版本
+ * @param shared    共享配置
+ * @param config    ini_shared_edit返回的副本, 之后由共享配置接管
+ * @return  成功返回0, 失败返回-1(副本被释放, 当前版本不变)
+ * @note    内容与当前版本相同时不发布, 副本被释放
+ */
+extern int ini_shared_publish(INI_SHARED shared, INI_CONFIG config);
+
+/**
+ * @brief ini_shared_abort 放弃修改
+ * @param shared    共享配置
+ * @param config    ini_shared_edit返回的副本
+ */
+extern void ini_shared_abort(INI_SHARED shared, INI_CONFIG config);
+
+/**
+ * @brief ini_shared_replace 用一份新配置整体替换当前版本
+ * @param shared    共享配置
+ * @param config    新配置, 之后由共享配置接管
+ * @return  成功返回0, 失败返回-1
+ */
+extern int ini_shared_replace(INI_SHARED shared, INI_CONFIG config);
+
+/**
+ * @brief ini_shared_set 修改一个字段并发布新版本, 参数同ini_config_set
+ * @return  成功返回0, 失败返回-1
+ */
+extern int ini_shared_set(INI_SHARED shared, const char *section,
+    const char *key, const char *value);
+
+/*
+ * 代数: 每次发布的新版本与当前版本内容不同时, 全局代数加1, 内容变化的节
+ * (包括新增和删除的节)的代数更新为新的全局代数; 内容相同时不发布新版本.
+ * 调用者保存上次看到的代数, 不相等时再重新读取关心的字段.
+ */
+
+/**
+ * @brief ini_shared_generation 获取当前的全局代数, 只是一次原子读
+ */
+extern unsigned long ini_shared_generation(INI_SHARED shared);
+
+/**
+ * @brief ini_shared_section_generation 获取当前版本中指定节的代数
+ * @return  节自创建以来没有变化过时返回0
+ */
+extern unsigned long ini_shared_section_generation(INI_SHARED shared, const char *section);
+
+/**
+ * @brief ini_snapshot_generation 获取快照的全局代数
+ */
+extern unsigned long ini_snapshot_generation(INI_SNAPSHOT snapshot);
+
+/**
+ * @brief ini_snapshot_section_generation 获取快照中指定节的代数
+ * @return  节自创建以来没有变化过时返回0
+ */
+extern unsigned long ini_snapshot_section_generation(INI_SNAPSHOT snapshot, const char *section);
+
+#endif /* __INISHARED_H__ */
@@ -0,0 +1,31 @@
+#ifndef __INIWATCH_H__
+#define __INIWATCH_H__
+
+#include "inishared.h"
+
+typedef void *INI_WATCH;
+
+/**
+ * @brief ini_watch_create 加载ini配置并在后台监视文件的变化
+ * @param file      ini配置文件
+ * @return  失败返回NULL
+ * @note    后台线程通过inotify监视配置文件所在的目录(rename替换文件也能发现),
+ *          文件变化时重新解析, 与当前版本比较后通过ini_shared_replace发布,
+ *          内容没有变化时代数不变
+ */
+extern INI_WATCH ini_watch_create(const char *file);
+
+/**
+ * @brief ini_watch_shared 获取被监视的共享配置, 用ini_shared_acquire等函数读取
+ * @param watch     监视句柄
+ * @return  共享配置, 在ini_watch_destroy之前有效
+ */
+extern INI_SHARED ini_watch_shared(INI_WATCH watch);
+
+/**
+ * @brief ini_watch_destroy 停止监视并释放共享配置
+ * @param watch     监视句柄
+ */
+extern void ini_watch_destroy(INI_WATCH watch);
+
+#endif /* __INIWATCH_H__ */
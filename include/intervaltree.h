@@ -0,0 +1,56 @@
+#ifndef _INTERVAL_TREE_H_
+#define _INTERVAL_TREE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "rbtree.h"
+
+/*
+ * Interval tree on top of the augmented rbtree: nodes are sorted by start
+ * and every node caches the largest 'last' of its subtree, so overlap
+ * queries cost O(log n + k). Intervals are closed: [start, last].
+ */
+struct interval_tree_node {
+    struct rb_node rb;
+    uint64_t start;
+    uint64_t last;
+    uint64_t subtree_last;
+};
+
+extern void interval_tree_insert(struct interval_tree_node *node, struct rb_root *root);
+extern void interval_tree_remove(struct interval_tree_node *node, struct rb_root *root);
+
+/* first/next interval overlapping [start, last], in order of start */
+extern struct interval_tree_node *interval_tree_iter_first(struct rb_root *root,
+        uint64_t start, uint64_t last);
+extern struct interval_tree_node *interval_tree_iter_next(struct interval_tree_node *node,
+        uint64_t start, uint64_t last);
+
+/*
+ * Set of byte extents, e.g. the written/verified/skipped parts of a
+ * partition. Overlapping and adjacent extents are merged on insertion, so
+ * the memory used depends on the fragmentation, not on the device size.
+ */
+struct extent_map {
+    struct rb_root root;
+    size_t   count;     /* number of disjoint extents */
+    uint64_t bytes;     /* total bytes covered */
+};
+
+#define EXTENT_MAP_INIT     (struct extent_map){RB_ROOT, 0, 0}
+
+extern int extent_map_add(struct extent_map *map, uint64_t offset, uint64_t len);
+extern int extent_map_remove(struct extent_map *map, uint64_t offset, uint64_t len);
+extern bool extent_map_contains(struct extent_map *map, uint64_t offset, uint64_t len);
+extern uint64_t extent_map_covered(struct extent_map *map, uint64_t offset, uint64_t len);
+extern void extent_map_clear(struct extent_map *map);
+
+#define extent_map_for_each(pos, map)                                               \
+    for (pos = (map)->root.rb_node ? rb_entry(rb_first(&(map)->root),              \
+                struct interval_tree_node, rb) : NULL;                              \
+         pos;                                                                       \
+         pos = rb_next(&pos->rb) ? rb_entry(rb_next(&pos->rb),                      \
+                struct interval_tree_node, rb) : NULL)
+
+#endif /* _INTERVAL_TREE_H_ */
@@ -0,0 +1,73 @@
+#ifndef __UPGRADE_MERKLE_H__
+#define __UPGRADE_MERKLE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sha256.h"
+
+#define MERKLE_HASH_SIZE        SHA256_DIGEST_SIZE
+
+/*
+ * 镜像按固定大小分块的哈希树, 用SHA-256, 叶子和内部节点按RFC 6962区分:
+ *
+ *   leaf[i] = SHA256(0x00 || chunk[i])
+ *   node    = SHA256(0x01 || left || right)
+ *
+ * 某一层的节点数是奇数时, 最后一个原样升到上一层. 除最后一块是1..chunk_size字节外,
+ * 每块都是chunk_size字节. 清单中带有所有叶子和根, merkle_tree_check_root把叶子和根
+ * 对应起来, 只要根是可信的就够了.
+ */
+struct merkle_tree {
+    size_t  chunk_size;
+    size_t  nchunks;
+    uint8_t root[MERKLE_HASH_SIZE];
+    uint8_t leaves[0][MERKLE_HASH_SIZE];
+};
+
+extern struct merkle_tree *merkle_tree_alloc(size_t chunk_size, size_t nchunks);
+
+extern void merkle_leaf_hash(const void *chunk, size_t len, uint8_t hash[MERKLE_HASH_SIZE]);
+
+/* 由叶子计算根, 与tree->root相同时返回0 */
+extern int merkle_tree_check_root(const struct merkle_tree *tree);
+
+extern void merkle_tree_root(const struct merkle_tree *tree, uint8_t root[MERKLE_HASH_SIZE]);
+
+/* hex必须正好是2 * MERKLE_HASH_SIZE个十六进制数字 */
+extern int merkle_hex2hash(const char *hex, uint8_t hash[MERKLE_HASH_SIZE]);
+
+/**
+ * @brief merkle_verify_fd 从fd读取镜像, 逐块与叶子比较
+ * @param fd        输入, 可以是管道
+ * @param tree      分块哈希
+ * @param threads   计算哈希的线程数
+ * @param budget    块缓冲区最多占用的字节数
+ * @param size      保存镜像的长度
+ * @return  整个镜像都正确返回0, 读取出错、有坏块或者长度不对返回-1
+ * @note    遇到第一个坏块就停止读取, 损坏的镜像最多多读几块就会被拒绝
+ */
+extern int merkle_verify_fd(int fd, const struct merkle_tree *tree, int threads,
+        size_t budget, uint64_t *size);
+
+/*
+ * 对分段到达的镜像逐块校验, 例如解码器的输出, 每段的长度任意. 一块的最后一个字节
+ * 到达时就校验这一块, 补全坏块的那次merkle_stream_update就会失败.
+ */
+struct merkle_stream {
+    const struct merkle_tree *tree;
+    struct sha256_ctx ctx;
+    size_t index;                       /* 正在计算的块 */
+    size_t fill;                        /* 这一块已经收到的字节数 */
+    uint64_t size;
+    int failed;
+};
+
+extern void merkle_stream_init(struct merkle_stream *ms, const struct merkle_tree *tree);
+
+/* 收完的块都正确时返回0, 有一块不对或者镜像比分块哈希长时返回-1 */
+extern int merkle_stream_update(struct merkle_stream *ms, const void *buf, size_t len);
+
+/* 校验可能不满一块的最后一块和块数, 通过时把镜像的长度保存到*size */
+extern int merkle_stream_final(struct merkle_stream *ms, uint64_t *size);
+
+#endif /* __UPGRADE_MERKLE_H__ */
@@ -2,9 +2,15 @@
 #define __UPGRADE_PACKAGE_H__
 
 #include <stdint.h>
+#include "codec.h"
 #include "list.h"
+#include "hashtable.h"
+#include "merkle.h"
+#include "pkgindex.h"
+#include "upgrade.h"
 
 #define PKG_FILE_NAME_SIZE      128
+#define OS_BLOB_CONTENT_SIZE    80
 
 typedef enum {
     PKG_UNKNOWN = -1,
@@ -25,22 +31,47 @@ typedef enum {
     OS_BLOB_OTHER = -1,
     OS_BLOB_BOOTLOADER,
     OS_BLOB_ROOTFS,
-    OS_BLOB_KERNEL
+    OS_BLOB_KERNEL,
+    OS_BLOB_DICTIONARY  /* 不写入分区, 放进本地仓库供其他镜像解码时引用 */
 } os_blob_type_t;
 
 typedef struct {
-    struct list_head node;
-    os_blob_type_t   type;
-    size_t           size;
-    char             md5sum[32];
-    char             name[PKG_FILE_NAME_SIZE];
+    struct list_head    node;
+    os_blob_type_t      type;
+    blob_codec_t        codec;      /* 包中文件的编码, size和校验都针对解码后的镜像 */
+    blob_ref_type_t     ref;        /* 解码时引用的本地内容, 用内容标识在本地仓库中查找 */
+    size_t              ref_size;
+    char                ref_content[OS_BLOB_CONTENT_SIZE];
+    size_t              size;
+    char                md5sum[32];
+    char                name[PKG_FILE_NAME_SIZE];
+    struct merkle_tree *merkle;     /* 可选的分块哈希, NULL时用md5sum校验 */
+    size_t              index;      /* 在清单中的序号 */
+    size_t              nafter;     /* 必须在这些镜像写完之后才能写入, 只能是清单中排在前面的 */
+    size_t             *after;
+    int                 parallel;   /* 清单给出了"after"(可以为空), 不必等前面其他分区的镜像写完 */
+    int                 fd;         /* 检查时解码并校验过的镜像, 写分区时直接使用; 没有时为-1 */
+    long                decode_ms;  /* 得到fd的解码耗时 */
+    size_t              kept;       /* fd占用memory_budget的字节数, 暂存在磁盘上时为0 */
 } os_blob_t;
 
+/* 解码时对镜像的校验, 有分块哈希时逐块进行 */
+typedef struct {
+    const os_blob_t     *blob;
+    struct merkle_stream merkle;
+} os_blob_check_t;
+
+typedef struct {
+    struct hash_node node;
+    uint32_t         id;
+} apply_id_t;
+
 typedef struct {
     struct list_head  blobs;
     package_version_t version;
+    struct hash_table apply_ids;    /* 以id为键索引apply_id[] */
     size_t            napply_id;
-    uint32_t          apply_id[0];
+    apply_id_t        apply_id[0];
 } os_package_t;
 
 typedef struct {
@@ -57,18 +88,109 @@ typedef struct {
 } multi_os_package_t;
 
 typedef struct {
-    package_type_t type;
-    char           path[PATH_MAX];
-    char           package[0];
+    package_type_t    type;
+    struct pkg_index *index;        /* mkupgrade生成的包带有索引, 可以只解压需要的文件 */
+    char              path[PATH_MAX];
+    char              package[0];
 } package_t;
 
-extern package_t *read_package(const char *pkg);
+/**
+ * @brief read_package 读取并校验升级包
+ * @param pkg   升级包路径
+ * @param job   所属的任务, 提供暂存文件和取消状态
+ * @return  失败或被取消返回NULL, 否则返回升级包, 需要使用release_package释放
+ */
+extern package_t *read_package(const char *pkg, const upgrade_job_t *job);
+
+/**
+ * @brief parse_package 解析清单, 不校验镜像
+ * @param manifest  清单内容, 以'\0'结尾
+ * @return  失败返回NULL, 否则返回升级包, 其中的path为空, 镜像的大小还不知道
+ * @note    流式安装时先得到清单, 镜像到达后再用os_blob_check_*逐个校验
+ */
+extern package_t *parse_package(const char *manifest);
+
+extern void release_package(package_t *package);
+
+extern void os_blob_check_init(os_blob_check_t *check, const os_blob_t *blob);
+
+/**
+ * @brief os_blob_check_update 作为blob_check_t交给解码器, 检查解码后的一段内容
+ * @param check os_blob_check_t
+ * @return  有分块哈希时写完的块都正确返回0, 发现第一个坏块就返回-1; 没有时总是返回0
+ */
+extern int os_blob_check_update(void *check, const void *buf, size_t n);
+
+/**
+ * @brief os_blob_check_final 结束校验
+ * @param check 解码时用的校验
+ * @param fd    解码后的镜像
+ * @param size  保存镜像的大小
+ * @return  校验通过返回0, 否则返回-1
+ * @note    没有分块哈希时在这里对fd计算md5sum; 校验通过后fd是memfd时被封住, 不能再修改
+ */
+extern int os_blob_check_final(os_blob_check_t *check, int fd, uint64_t *size);
+
+/* 解压后镜像的预计大小, 用来选择暂存位置; 不知道时返回0 */
+extern size_t os_blob_size_hint(const os_blob_t *blob);
+
+/**
+ * @brief os_package_match_id 判断系统包是否适用于指定的设备
+ * @param os    系统包
+ * @param id    设备id
+ * @return  适用返回1, 否则返回0
+ */
+extern int os_package_match_id(const os_package_t *os, uint32_t id);
+
+/**
+ * @brief os_blob_content_id 获取镜像的内容标识
+ * @param blob  镜像
+ * @param buf   保存内容标识, 有分块哈希时为"merkle:<root>", 否则为"md5:<md5sum>"
+ * @param n     buf的大小
+ * @return  成功返回0, buf不够大返回-1
+ */
+extern int os_blob_content_id(const os_blob_t *blob, char *buf, size_t n);
+
+/**
+ * @brief os_blob_reference 查找镜像解码时引用的内容
+ * @param blob  镜像
+ * @param path  保存引用的内容在本地仓库中的路径, 没有引用时为空字符串
+ * @param n     path的大小
+ * @return  没有引用或者找到返回0, 本地仓库中没有返回-1
+ */
+extern int os_blob_reference(const os_blob_t *blob, char *path, size_t n);
+
+/**
+ * @brief store_dictionary_blob 把校验过的字典放进本地仓库
+ * @param blob  字典
+ * @param fd    解压后的字典, 由调用者关闭
+ * @return  成功返回0, 失败返回-1
+ */
+extern int store_dictionary_blob(const os_blob_t *blob, int fd);
 
 extern const char *package_type2name(const package_type_t t);
 
 extern const char *os_blob_type2name(const os_blob_type_t t);
 
-extern int decompress_package(const char *dst, const char *pkg, const char *file);
+/**
+ * @brief extract_package_file 把升级包中的文件解压后写到fd
+ * @param package   read_package读取的升级包
+ * @param fd        输出, 通常是upgrade_job_scratch创建的暂存文件
+ * @param file      文件名
+ * @return  成功返回0, 否则返回非0
+ * @note    包带有索引时只读取并解压这个文件所在的帧, 否则解压整个包
+ */
+extern int extract_package_file(const package_t *package, int fd, const char *file);
+
+/**
+ * @brief extract_os_blob 把镜像解压并按它的编码解码后写到fd, 同时校验
+ * @param package   read_package读取的升级包
+ * @param blob      镜像
+ * @param fd        输出
+ * @return  成功并且校验通过返回0, 否则返回非0
+ * @note    有分块哈希时遇到第一个坏块就停止解码; 校验通过后fd被封住
+ */
+extern int extract_os_blob(const package_t *package, const os_blob_t *blob, int fd);
 
 extern int check_md5sum(const char *path, const char md5sum[32]);
 
@@ -0,0 +1,78 @@
+#ifndef __UPGRADE_PKGCACHE_H__
+#define __UPGRADE_PKGCACHE_H__
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "iniparser.h"
+#include "sha256.h"
+
+/*
+ * 已校验升级包的缓存. 每个升级包一个INI文件, 以设备号和inode命名:
+ *
+ *   [package]
+ *   path = /data/os.pkg
+ *   size = 123456789
+ *   mtime = 1700000000.123456789
+ *   ctime = 1700000000.123456789
+ *   manifest = <manifest.json的sha256>
+ *   verified = 1700000000
+ *
+ *   [blobs]
+ *   rootfs.img = 104857600     ; 校验时得到的文件大小
+ *
+ * 包的大小/mtime/ctime/清单任何一项变化, 缓存都不再匹配.
+ */
+#define PKG_CACHE_ROOT          "/var/cache/upgrade"
+#define PKG_CACHE_DIR           PKG_CACHE_ROOT "/verified"
+#define PKG_CACHE_MAX           64      /* 最多缓存的包数, 超过时删除最早校验的 */
+#define PKG_CACHE_SECTION       "package"
+#define PKG_CACHE_BLOBS         "blobs"
+
+struct pkg_cache_key {
+    dev_t    dev;
+    ino_t    ino;
+    char     path[PATH_MAX];
+    char     size[24];
+    char     mtime[32];
+    char     ctime[32];
+    char     manifest[SHA256_DIGEST_SIZE * 2 + 1];
+};
+
+/**
+ * @brief pkg_cache_key_init 生成升级包的缓存键
+ * @param key       缓存键
+ * @param pkg       升级包路径
+ * @param manifest  升级包中manifest.json的内容
+ * @param len       manifest的长度
+ * @return  成功返回0, 失败返回-1
+ */
+extern int pkg_cache_key_init(struct pkg_cache_key *key, const char *pkg,
+    const void *manifest, size_t len);
+
+/**
+ * @brief pkg_cache_lookup 查找已校验的记录
+ * @param key   缓存键
+ * @return  命中返回记录, 可以从PKG_CACHE_BLOBS节读取文件大小; 没有命中返回NULL
+ * @note    记录需要使用ini_config_release释放
+ */
+extern INI_CONFIG pkg_cache_lookup(const struct pkg_cache_key *key);
+
+/**
+ * @brief pkg_cache_prepare 创建一条新的记录, 已填好PKG_CACHE_SECTION节
+ * @param key   缓存键
+ * @return  失败返回NULL
+ * @note    调用者在PKG_CACHE_BLOBS节中补充文件大小后用pkg_cache_store保存
+ */
+extern INI_CONFIG pkg_cache_prepare(const struct pkg_cache_key *key);
+
+/**
+ * @brief pkg_cache_store 保存记录并释放它
+ * @param key   缓存键
+ * @param entry pkg_cache_prepare返回的记录
+ * @return  成功返回0, 失败返回-1; 缓存只是加速, 失败不影响升级
+ */
+extern int pkg_cache_store(const struct pkg_cache_key *key, INI_CONFIG entry);
+
+#endif /* __UPGRADE_PKGCACHE_H__ */
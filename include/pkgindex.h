@@ -0,0 +1,54 @@
+#ifndef __UPGRADE_PKGINDEX_H__
+#define __UPGRADE_PKGINDEX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hashtable.h"
+
+/*
+ * mkupgrade生成的升级包仍然是一个合法的tar.zst, 只是按文件切分成独立的zstd帧:
+ *
+ *   [帧: tar头 + manifest.json]
+ *   [帧: tar头 + 镜像1的第1段] [帧: 镜像1的第2段] ... [帧: 镜像2 ...] ...
+ *   [帧: tar结束块]
+ *   [skippable帧: 索引 + 索引长度(4字节小端) + PKG_INDEX_MAGIC]
+ *
+ * 每个文件从新的帧开始, 读取一个文件时不用解压它前面的内容; tar和zstd会忽略
+ * 最后的skippable帧. 索引是JSON:
+ *
+ *   {"frame size": 4194304,
+ *    "files": [{"name": "rootfs.img", "offset": 压缩后的起始偏移, "length": 压缩后的长度,
+ *               "skip": 解压后文件内容之前的tar头字节数, "size": 文件大小}, ...]}
+ */
+#define PKG_INDEX_MAGIC         "UPGIDX01"
+#define PKG_INDEX_MAGIC_SIZE    8
+#define PKG_INDEX_FRAME_MAGIC   0x184D2A5EU
+#define PKG_INDEX_FOOTER_SIZE   (4 + PKG_INDEX_MAGIC_SIZE)
+#define PKG_INDEX_MAX           (16 << 20)
+
+struct pkg_index_entry {
+    struct hash_node node;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t skip;
+    uint64_t size;
+    char     name[0];
+};
+
+struct pkg_index {
+    struct hash_table table;
+    size_t count;
+};
+
+/**
+ * @brief pkg_index_load 读取升级包末尾的索引
+ * @param path  升级包路径
+ * @return  没有索引或者索引无效返回NULL, 否则返回索引, 需要使用pkg_index_release释放
+ */
+extern struct pkg_index *pkg_index_load(const char *path);
+
+extern const struct pkg_index_entry *pkg_index_find(const struct pkg_index *index, const char *name);
+
+extern void pkg_index_release(struct pkg_index *index);
+
+#endif /* __UPGRADE_PKGINDEX_H__ */
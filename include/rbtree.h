@@ -13,6 +13,12 @@ struct rb_root {
     struct rb_node *rb_node;
 };
 
+/* rbtree that also caches the leftmost node, so rb_first_cached() is O(1) */
+struct rb_root_cached {
+    struct rb_root rb_root;
+    struct rb_node *rb_leftmost;
+};
+
 #define rb_parent(rb)       ((struct rb_node *)(((char *)NULL) + (((rb)->rb_parent_color & ~3))))
 #define rb_color(rb)        ((rb)->rb_parent_color & 1)
 #define rb_is_red(rb)       (!rb_color(rb))
@@ -39,6 +45,7 @@ __attribute__((always_inline)) static inline void rb_set_parent_color(struct rb_
 #define rb_entry(ptr, type, m)  ((type *)((((char *)(ptr)) - ((char *)&((type *)0)->m))))
 
 #define RB_ROOT             (struct rb_root){NULL,}
+#define RB_ROOT_CACHED      (struct rb_root_cached){{NULL,}, NULL}
 #define RB_EMPTY_ROOT(root) ((root)->rb_node == NULL)
 #define RB_EMPTY_NODE(rb)   ((rb)->rb_parent_color == (size_t)(((char *)(rb)) - ((char *)NULL)))
 #define RB_CLEAR_NODE(rb)   ((rb)->rb_parent_color = (size_t)(((char *)(rb)) - ((char *)NULL)))
@@ -73,5 +80,14 @@ extern struct rb_node *rb_prev(const struct rb_node *);
 extern struct rb_node *rb_first(const struct rb_root *);
 extern struct rb_node *rb_last(const struct rb_root *);
 
+#define rb_first_cached(root)   ((root)->rb_leftmost)
+
+extern void rb_insert_color_cached(struct rb_node *, struct rb_root_cached *, int leftmost);
+extern void rb_erase_cached(struct rb_node *, struct rb_root_cached *);
+
+/* build a balanced tree in O(n) from @n nodes already sorted in tree order */
+extern void rb_build_sorted(struct rb_root *, struct rb_node **nodes, size_t n);
+extern void rb_build_sorted_cached(struct rb_root_cached *, struct rb_node **nodes, size_t n);
+
 #endif /* _RBTREE_H_ */
 
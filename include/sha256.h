@@ -0,0 +1,23 @@
+#ifndef __UPGRADE_SHA256_H__
+#define __UPGRADE_SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE      32
+#define SHA256_BLOCK_SIZE       64
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t count;                     /* 已经计算过的字节数 */
+    uint8_t  buf[SHA256_BLOCK_SIZE];
+};
+
+extern void sha256_init(struct sha256_ctx *ctx);
+extern void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+extern void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/* 一次算完整段数据 */
+extern void sha256(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif /* __UPGRADE_SHA256_H__ */
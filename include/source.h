@@ -0,0 +1,70 @@
+#ifndef __UPGRADE_SOURCE_H__
+#define __UPGRADE_SOURCE_H__
+
+#include <stddef.h>
+
+/*
+ * 升级包的来源. 路径以外的来源只能顺序读一遍, 只能使用流式安装:
+ * 先读到清单, 然后边接收边校验、写入每个镜像, 不在磁盘上保存整个升级包.
+ */
+typedef enum {
+    PKG_SOURCE_PATH,
+    PKG_SOURCE_FD,
+    PKG_SOURCE_MEM,
+} pkg_source_type_t;
+
+typedef struct pkg_source pkg_source_t;
+
+/**
+ * @brief pkg_source_path 以文件路径作为来源, 也可以是命名管道
+ * @param path  升级包路径
+ * @return  失败返回NULL
+ */
+extern pkg_source_t *pkg_source_path(const char *path);
+
+/**
+ * @brief pkg_source_fd 以文件描述符作为来源, 如管道、socket或者标准输入
+ * @param fd    文件描述符, 由调用者关闭
+ * @return  失败返回NULL
+ */
+extern pkg_source_t *pkg_source_fd(int fd);
+
+/**
+ * @brief pkg_source_mem 以内存中的升级包作为来源
+ * @param buf   升级包内容, 在来源释放之前必须保持有效
+ * @param len   升级包大小
+ * @return  失败返回NULL
+ */
+extern pkg_source_t *pkg_source_mem(const void *buf, size_t len);
+
+extern pkg_source_type_t pkg_source_type(const pkg_source_t *source);
+
+/* 用于输出的来源描述, 如路径、"fd:0"、"memory" */
+extern const char *pkg_source_name(const pkg_source_t *source);
+
+/**
+ * @brief pkg_source_open_stream 打开解压后的tar流
+ * @param source    来源
+ * @return  成功返回可读的文件描述符, 失败返回-1
+ * @note    解压在子进程中进行, 一个来源同时只能打开一个流
+ */
+extern int pkg_source_open_stream(pkg_source_t *source);
+
+/**
+ * @brief pkg_source_drop_cache 丢弃升级包中解压进程已经读过的部分的页缓存
+ * @param source    来源
+ * @note    读取流的过程中定期调用, 每读过一段才真正丢弃一次; 管道和内存来源什么都不做
+ */
+extern void pkg_source_drop_cache(pkg_source_t *source);
+
+/**
+ * @brief pkg_source_close_stream 关闭tar流并回收解压进程
+ * @param source    来源
+ * @return  解压进程正常结束返回0, 否则返回-1
+ * @note    没有读完就关闭时解压进程会因为SIGPIPE退出, 返回值没有意义
+ */
+extern int pkg_source_close_stream(pkg_source_t *source);
+
+extern void pkg_source_release(pkg_source_t *source);
+
+#endif /* __UPGRADE_SOURCE_H__ */
@@ -0,0 +1,63 @@
+#ifndef __UPGRADE_TARSTREAM_H__
+#define __UPGRADE_TARSTREAM_H__
+
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define TAR_BLOCK_SIZE          512
+#define TAR_NAME_MAX            (TAR_BLOCK_SIZE - 1)
+#define TAR_HEADER_MAX          (TAR_BLOCK_SIZE * 3)
+#define TAR_TRAILER_SIZE        (TAR_BLOCK_SIZE * 2)
+
+/*
+ * 从管道顺序读取ustar/GNU/pax格式的归档, 升级包还在接收时就可以解开. 只认识tar(1)
+ * 为普通文件写的内容: ustar的文件名前缀、base-256的大小、GNU长文件名('L')以及pax的
+ * "path"和"size"记录('x').
+ *
+ *     tar_stream_init(&ts, fd);
+ *     while ((ret = tar_stream_next(&ts)) > 0) {
+ *         if (ts.type == TAR_TYPE_FILE)
+ *             while ((n = tar_stream_read(&ts, buf, sizeof(buf))) > 0)
+ *                 ...
+ *     }
+ *
+ * 一个文件没有读完的数据由下一次tar_stream_next跳过.
+ */
+typedef enum {
+    TAR_TYPE_FILE,
+    TAR_TYPE_DIR,
+    TAR_TYPE_OTHER,
+} tar_type_t;
+
+struct tar_stream {
+    int         fd;
+    uint64_t    remain;         /* 当前文件还没读的数据 */
+    size_t      pad;            /* 数据之后补齐到块大小的填充 */
+    tar_type_t  type;
+    uint64_t    size;
+    char        name[PATH_MAX];
+};
+
+extern void tar_stream_init(struct tar_stream *ts, int fd);
+
+/* 读到下一个文件返回1, 信息在ts中; 归档结束返回0, 出错返回-1 */
+extern int tar_stream_next(struct tar_stream *ts);
+
+/* 读取当前文件的数据, 读完返回0, 出错返回-1 */
+extern ssize_t tar_stream_read(struct tar_stream *ts, void *buf, size_t n);
+
+/**
+ * @brief tar_write_header 按GNU tar的格式生成普通文件的头
+ * @param buf   输出
+ * @param n     buf的大小
+ * @param name  文件名, 最长TAR_NAME_MAX字节, 头块放不下时前面加一个GNU长文件名
+ * @param size  文件大小
+ * @param mtime 修改时间
+ * @return  写到buf中的头的长度, 放不下返回-1
+ * @note    头之后是数据, 用0补齐到TAR_BLOCK_SIZE; 归档以TAR_TRAILER_SIZE个0字节结束
+ */
+extern ssize_t tar_write_header(void *buf, size_t n, const char *name, uint64_t size, time_t mtime);
+
+#endif /* __UPGRADE_TARSTREAM_H__ */
@@ -3,11 +3,34 @@
 
 #include <stddef.h>
 #include <limits.h>
+#include "source.h"
 
 enum {
     UPGRADE_NO_ERROR = 0,
 };
 
+typedef struct upgrade_job upgrade_job_t;
+
+typedef enum {
+    UPGRADE_JOB_UPGRADE,        /* 校验并升级 */
+    UPGRADE_JOB_CHECK,          /* 只校验 */
+} upgrade_job_type_t;
+
+typedef enum {
+    UPGRADE_JOB_CREATED,
+    UPGRADE_JOB_RUNNING,
+    UPGRADE_JOB_SUCCEEDED,
+    UPGRADE_JOB_FAILED,
+    UPGRADE_JOB_CANCELED,
+} upgrade_job_state_t;
+
+typedef struct {
+    /* 任务的进度输出, NULL时输出到stdout */
+    void (*progress)(void *arg, const char *text, size_t len);
+    /* 任务结束时在任务线程中调用, 此时upgrade_job_wait还没有返回 */
+    void (*finished)(upgrade_job_t *job, int ret, void *arg);
+} upgrade_job_ops_t;
+
 /**
  * -- dual rootfs partions --
  * part1: boot/kernel
@@ -17,6 +40,105 @@ enum {
  */
 extern int upgrade_package(const char *pkg);
 
+/* 只读取并校验升级包, 不升级 */
+extern int check_package(const char *pkg);
+
+/* 流式安装, source在返回前被释放 */
+extern int upgrade_package_source(pkg_source_t *source);
+
+/*
+ * 异步任务接口, upgrade_package/check_package是在调用线程中执行任务的同步版本:
+ *
+ *     job = upgrade_job_create(UPGRADE_JOB_CHECK, "/data/os.pkg", &ops, arg);
+ *     upgrade_job_start(job);
+ *     ...
+ *     if (upgrade_job_wait(job, -1) == UPGRADE_JOB_SUCCEEDED) ...
+ *     upgrade_job_destroy(job);
+ */
+
+/**
+ * @brief upgrade_job_create 创建一个任务, 不会立即执行
+ * @param type  任务类型
+ * @param pkg   升级包路径
+ * @param ops   回调, 可以为NULL
+ * @param arg   传给回调的参数
+ * @return  失败返回NULL, 否则返回任务, 需要使用upgrade_job_destroy释放
+ * @note    解压后的镜像放在没有路径的暂存文件中, 不同任务可以在不同线程中同时校验升级包;
+ *          升级分区的阶段在进程内串行执行
+ */
+extern upgrade_job_t *upgrade_job_create(upgrade_job_type_t type, const char *pkg,
+    const upgrade_job_ops_t *ops, void *arg);
+
+/**
+ * @brief upgrade_job_create_source 创建一个流式安装或校验的任务
+ * @param type      任务类型
+ * @param source    升级包来源, 任务创建成功后由任务释放
+ * @param ops       回调, 可以为NULL
+ * @param arg       传给回调的参数
+ * @return  失败返回NULL, 此时source仍由调用者释放
+ * @note    清单必须是升级包中的第一个文件, 镜像按清单中的顺序排列
+ */
+extern upgrade_job_t *upgrade_job_create_source(upgrade_job_type_t type, pkg_source_t *source,
+    const upgrade_job_ops_t *ops, void *arg);
+
+/**
+ * @brief upgrade_job_start 在新线程中开始执行任务
+ * @param job   任务
+ * @return  成功返回0, 任务已经开始过或者创建线程失败返回-1
+ */
+extern int upgrade_job_start(upgrade_job_t *job);
+
+/**
+ * @brief upgrade_job_poll 获取任务当前的状态, 不阻塞
+ * @param job   任务
+ * @return  任务的状态
+ */
+extern upgrade_job_state_t upgrade_job_poll(upgrade_job_t *job);
+
+/**
+ * @brief upgrade_job_wait 等待任务结束
+ * @param job           任务
+ * @param timeout_ms    最多等待的毫秒数, 小于0时一直等待
+ * @return  任务的状态, 超时返回UPGRADE_JOB_RUNNING
+ */
+extern upgrade_job_state_t upgrade_job_wait(upgrade_job_t *job, int timeout_ms);
+
+/**
+ * @brief upgrade_job_result 获取已结束任务的返回值
+ * @param job   任务
+ * @return  成功返回0, 失败、被取消或者还没有结束返回-1
+ */
+extern int upgrade_job_result(upgrade_job_t *job);
+
+/**
+ * @brief upgrade_job_cancel 请求取消任务
+ * @param job   任务
+ * @return  成功返回0, 任务已经结束返回-1
+ * @note    任务在校验下一个镜像或升级下一个分区之前停止, 正在写入的分区会写完
+ */
+extern int upgrade_job_cancel(upgrade_job_t *job);
+
+/**
+ * @brief upgrade_job_destroy 释放任务, 任务还在执行时先取消并等待它结束
+ * @param job   任务
+ */
+extern void upgrade_job_destroy(upgrade_job_t *job);
+
+/* 以下供库内部使用 */
+
+/**
+ * @brief upgrade_job_scratch 为任务创建暂存解压后镜像的匿名文件
+ * @param job   任务
+ * @param name  名字, 只用于调试
+ * @param size  预计的大小, 0表示不知道
+ * @return  可读写的文件描述符, 失败返回-1
+ * @note    不超过memory_budget时用memfd, 否则在磁盘上用O_TMPFILE; 没有路径,
+ *          并行的任务互不影响, 关闭或者进程崩溃后都不会留下文件
+ */
+extern int upgrade_job_scratch(const upgrade_job_t *job, const char *name, size_t size);
+
+extern int upgrade_job_canceled(const upgrade_job_t *job);
+
 extern const char *upgrade_err2str(const int errcode);
 
 #endif /* _UPGRADE_H_ */
@@ -0,0 +1,39 @@
+#ifndef __UPGRADE_UPGRADED_H__
+#define __UPGRADE_UPGRADED_H__
+
+/*
+ * 常驻的升级服务. 配置、设备id、已校验包缓存在进程内只加载一次, 请求通过
+ * Unix socket提交, 按顺序在一个工作线程中执行, 互相冲突的升级不会同时进行.
+ *
+ * 协议以行为单位, 客户端发送一行请求:
+ *   upgrade <package>
+ *   check <package>
+ *   status
+ * 服务端回复:
+ *   queued <job> <ahead>       请求已排队, 前面还有ahead个任务
+ *   log <len>\n<len字节>       任务的进度输出
+ *   done <job> <ret>           任务结束, ret为0表示成功
+ *   status <running> <queued>  正在执行的任务(0表示空闲)和排队的任务数
+ *   error <message>            请求无法处理
+ */
+#define UPGRADED_SOCKET_DIR     "/run/upgrade"
+#define UPGRADED_SOCKET         UPGRADED_SOCKET_DIR "/upgraded.sock"
+
+/**
+ * @brief upgraded_run 运行升级服务, 直到收到SIGINT/SIGTERM
+ * @param path  socket路径
+ * @return  正常退出返回0, 启动失败返回-1
+ * @note    退出前会等待正在执行的任务结束, 排队中的任务被取消
+ */
+extern int upgraded_run(const char *path);
+
+/**
+ * @brief upgraded_client 向升级服务提交请求, 并把进度输出到stdout
+ * @param path  socket路径
+ * @param cmd   upgrade, check或status
+ * @param pkg   升级包, status时可以为NULL
+ * @return  任务成功返回0, 否则返回-1
+ */
+extern int upgraded_client(const char *path, const char *cmd, const char *pkg);
+
+#endif /* __UPGRADE_UPGRADED_H__ */
@@ -0,0 +1,289 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "blobstore.h"
+#include "codec.h"
+#include "configs.h"
+#include "iniparser.h"
+
+/* 内容标识只能是"算法:十六进制", 避免清单中的名字被拼进路径后越出仓库目录 */
+static int blob_store_object_path(const char *content, char *path, size_t n)
+{
+    const char *p, *colon;
+
+    if (content == NULL || (colon = strchr(content, ':')) == NULL || colon == content
+            || colon[1] == '\0') {
+        return -1;
+    }
+
+    for (p = content; p < colon; ++p) {
+        if (!islower((unsigned char)*p) && !isdigit((unsigned char)*p)) {
+            return -1;
+        }
+    }
+
+    for (p = colon + 1; *p; ++p) {
+        if (!isxdigit((unsigned char)*p)) {
+            return -1;
+        }
+    }
+
+    return snprintf(path, n, "%s/%.*s/%s", BLOB_STORE_OBJECTS, (int)(colon - content), content,
+        colon + 1) < (int)n ? 0 : -1;
+}
+
+static int blob_store_mkdir(const char *path)
+{
+    return mkdir(path, 0755) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+/* 打开状态文件并开始事务, 文件不存在时先创建空文件 */
+static INI_CONFIG blob_store_begin(const char *file)
+{
+    int fd;
+    INI_CONFIG config;
+
+    if (blob_store_mkdir(BLOB_STORE_ROOT) != 0) {
+        return NULL;
+    }
+
+    if ((fd = open(file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        return NULL;
+    }
+    close(fd);
+
+    if ((config = ini_config_create(file)) == NULL) {
+        return NULL;
+    }
+
+    if (ini_config_begin(config) != 0) {
+        ini_config_release(config);
+        return NULL;
+    }
+
+    return config;
+}
+
+static int blob_store_commit(INI_CONFIG config)
+{
+    int ret;
+
+    ret = ini_config_commit(config);
+    ini_config_release(config);
+
+    return ret;
+}
+
+int blob_store_installed(const char *slot, const char *content, long *cost_ms)
+{
+    int ret;
+    const char *str;
+    INI_CONFIG state;
+
+    if (slot == NULL || content == NULL || (state = ini_config_create(BLOB_STORE_STATE)) == NULL) {
+        return 0;
+    }
+
+    ret = (str = ini_config_get(state, slot, "content", NULL)) != NULL && strcmp(str, content) == 0;
+    if (ret && cost_ms) {
+        *cost_ms = strtol(ini_config_get(state, slot, "cost_ms", "0"), NULL, 10);
+    }
+    ini_config_release(state);
+
+    return ret;
+}
+
+int blob_store_set_installed(const char *slot, const char *content, size_t size, long cost_ms)
+{
+    char buf[32];
+    INI_CONFIG state;
+
+    if (slot == NULL || content == NULL || (state = blob_store_begin(BLOB_STORE_STATE)) == NULL) {
+        return -1;
+    }
+
+    ini_config_clear_section(state, slot);
+    ini_config_set(state, slot, "content", content);
+    snprintf(buf, sizeof(buf), "%zu", size);
+    ini_config_set(state, slot, "size", buf);
+    snprintf(buf, sizeof(buf), "%ld", cost_ms);
+    ini_config_set(state, slot, "cost_ms", buf);
+    snprintf(buf, sizeof(buf), "%lld", (long long)time(NULL));
+    ini_config_set(state, slot, "installed", buf);
+
+    return blob_store_commit(state);
+}
+
+int blob_store_clear_installed(const char *slot)
+{
+    INI_CONFIG state;
+
+    if (slot == NULL || (state = blob_store_begin(BLOB_STORE_STATE)) == NULL) {
+        return -1;
+    }
+
+    ini_config_erase_section(state, slot);
+    return blob_store_commit(state);
+}
+
+int blob_store_lookup(const char *content, size_t size, char *path, size_t n, long *cost_ms)
+{
+    struct stat st;
+    INI_CONFIG index;
+
+    if (path == NULL || blob_store_object_path(content, path, n) != 0
+            || stat(path, &st) != 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size != size) {
+        return 0;
+    }
+
+    if (cost_ms) {
+        *cost_ms = 0;
+        if ((index = ini_config_create(BLOB_STORE_INDEX)) != NULL) {
+            *cost_ms = strtol(ini_config_get(index, content, "cost_ms", "0"), NULL, 10);
+            ini_config_release(index);
+        }
+    }
+
+    return 1;
+}
+
+/* 按durability把仓库中的文件落盘 */
+static int blob_store_sync(int fd)
+{
+    switch (system_config_int(SYS_TUNABLE_DURABILITY)) {
+    case SYS_DURABILITY_NONE:
+        return 0;
+    case SYS_DURABILITY_DATA:
+        return fdatasync(fd);
+    default:
+        return fsync(fd);
+    }
+}
+
+/* durability为full时rename之后还要落盘所在目录, 否则掉电后新名字可能丢失 */
+static int blob_store_sync_dir(const char *path)
+{
+    int fd, ret;
+    char dir[PATH_MAX];
+    char *slash;
+
+    if (system_config_int(SYS_TUNABLE_DURABILITY) != SYS_DURABILITY_FULL) {
+        return 0;
+    }
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    if ((slash = strrchr(dir, '/')) == NULL) {
+        return 0;
+    }
+    *slash = '\0';
+
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    ret = fsync(fd);
+    close(fd);
+
+    return ret;
+}
+
+/* O_TMPFILE创建的文件通过/proc中的路径链接成临时名字, 落盘后再rename */
+static int blob_store_link(int fd, const char *dst)
+{
+    char src[PATH_MAX];
+    char tmp[PATH_MAX + 32];
+
+    if (fd_path(fd, src, sizeof(src)) != 0
+            || snprintf(tmp, sizeof(tmp), "%s.%d.%d", dst, (int)getpid(), fd) >= (int)sizeof(tmp)) {
+        return -1;
+    }
+
+    /* memfd和其他文件系统上的文件不能链接 */
+    if (linkat(AT_FDCWD, src, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW) != 0) {
+        return -1;
+    }
+
+    if (fchmod(fd, 0644) != 0 || blob_store_sync(fd) != 0 || rename(tmp, dst) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    /* 仓库中的镜像要到下次升级才会再读 */
+    file_writeback_drop(fd, 0, 0);
+    return 0;
+}
+
+/* 不能链接时复制到仓库目录下的临时文件, 落盘后再rename */
+static int blob_store_copy(int in, const char *dst)
+{
+    int out;
+    char tmp[PATH_MAX + 8];
+
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", dst) >= (int)sizeof(tmp)) {
+        return -1;
+    }
+
+    if (lseek(in, 0, SEEK_SET) != 0 || (out = mkstemp(tmp)) < 0) {
+        return -1;
+    }
+
+    /* 在内核中复制, 不经过用户态缓冲区 */
+    if (blob_decode_fd(BLOB_CODEC_RAW, BLOB_REF_NONE, NULL, in, out, NULL, NULL) != 0) {
+        goto err;
+    }
+
+    if (fchmod(out, 0644) != 0 || blob_store_sync(out) != 0 || rename(tmp, dst) != 0) {
+        goto err;
+    }
+
+    file_drop_cache(out, 0, 0);
+    file_drop_cache(in, 0, 0);
+    close(out);
+    return 0;
+err:
+    close(out);
+    unlink(tmp);
+    return -1;
+}
+
+int blob_store_put(const char *content, int fd, long cost_ms)
+{
+    char buf[32];
+    char path[PATH_MAX];
+    char *slash;
+    INI_CONFIG index;
+
+    if (fd < 0 || blob_store_object_path(content, path, sizeof(path)) != 0) {
+        return -1;
+    }
+
+    if (blob_store_mkdir(BLOB_STORE_ROOT) != 0 || blob_store_mkdir(BLOB_STORE_OBJECTS) != 0) {
+        return -1;
+    }
+
+    slash = strrchr(path, '/');
+    *slash = '\0';
+    if (blob_store_mkdir(path) != 0) {
+        return -1;
+    }
+    *slash = '/';
+
+    if ((blob_store_link(fd, path) != 0 && blob_store_copy(fd, path) != 0) || blob_store_sync_dir(path) != 0) {
+        return -1;
+    }
+
+    if ((index = blob_store_begin(BLOB_STORE_INDEX)) != NULL) {
+        snprintf(buf, sizeof(buf), "%ld", cost_ms);
+        ini_config_set(index, content, "cost_ms", buf);
+        blob_store_commit(index);
+    }
+
+    return 0;
+}
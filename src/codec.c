@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#include "common.h"
+#include "codec.h"
+
+#define BLOB_CODEC_BUFSIZE      (BUFF_SIZE * 32)
+#define BLOB_CODEC_COPY_CHUNK   (1 << 20)
+/* --patch-from的窗口要覆盖整个旧镜像, 解码时允许最大的窗口 */
+#define BLOB_CODEC_WINDOW_LOG   31
+#define BLOB_CODEC_LONG         "--long=31"
+
+struct blob_decoder {
+    blob_codec_t codec;
+    int          out;
+    int          failed;
+    size_t       pending;       /* 进程内解码时不为0表示最后一帧还不完整 */
+    pid_t        pid;           /* 调用命令解码时的子进程 */
+    int          in;            /* 子进程的输入 */
+    int          from;          /* 有check时子进程的输出, 否则子进程直接写到out */
+    blob_check_t check;
+    void        *check_arg;
+    blob_ref_type_t ref;
+    const char  *ref_path;
+    void        *ref_map;       /* 进程内解码时映射的引用内容 */
+    size_t       ref_size;
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx   *zstd;
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_dctx   *lz4;
+#endif
+    size_t       size;
+    char         buf[0];
+};
+
+static const char *const blob_codec_names[] = {
+    [BLOB_CODEC_RAW]    = "raw",
+    [BLOB_CODEC_ZSTD]   = "zstd",
+    [BLOB_CODEC_LZ4]    = "lz4",
+};
+
+/* 没有进程内解码器时使用的命令 */
+static const char *const blob_codec_commands[] = {
+    [BLOB_CODEC_RAW]    = NULL,
+    [BLOB_CODEC_ZSTD]   = "zstd",
+    [BLOB_CODEC_LZ4]    = "lz4",
+};
+
+static const char *const blob_ref_names[] = {
+    [BLOB_REF_NONE]         = "none",
+    [BLOB_REF_DICTIONARY]   = "dictionary",
+    [BLOB_REF_BASE]         = "base",
+};
+
+blob_codec_t blob_codec_lookup(const char *name)
+{
+    size_t i;
+
+    if (name == NULL) {
+        return BLOB_CODEC_RAW;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(blob_codec_names); ++i) {
+        if (strcmp(blob_codec_names[i], name) == 0) {
+            return (blob_codec_t)i;
+        }
+    }
+
+    return BLOB_CODEC_UNKNOWN;
+}
+
+const char *blob_codec_name(blob_codec_t codec)
+{
+    if (codec < 0 || codec >= ARRAY_SIZE(blob_codec_names)) {
+        return "unknown";
+    }
+
+    return blob_codec_names[codec];
+}
+
+blob_ref_type_t blob_ref_lookup(const char *name)
+{
+    size_t i;
+
+    if (name == NULL) {
+        return BLOB_REF_NONE;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(blob_ref_names); ++i) {
+        if (strcmp(blob_ref_names[i], name) == 0) {
+            return (blob_ref_type_t)i;
+        }
+    }
+
+    return BLOB_REF_UNKNOWN;
+}
+
+const char *blob_ref_name(blob_ref_type_t ref)
+{
+    if (ref < 0 || ref >= ARRAY_SIZE(blob_ref_names)) {
+        return "unknown";
+    }
+
+    return blob_ref_names[ref];
+}
+
+/*
+ * 子进程的输入用socketpair而不是管道: 解码进程因为数据损坏提前退出后, 带MSG_NOSIGNAL
+ * 的写入只会返回EPIPE, 不会让升级进程收到SIGPIPE. 有check时子进程的输出写到管道,
+ * 由blob_decoder_send在送入输入的同时读出来检查.
+ */
+static int blob_decoder_spawn(blob_decoder_t *decoder)
+{
+    int i, out, fds[2], pipefd[2];
+    pid_t pid;
+    const char *argv[6];
+    char patch_from[PATH_MAX + 16];
+
+    i = 0;
+    argv[i++] = blob_codec_commands[decoder->codec];
+    argv[i++] = "-dcq";
+    if (decoder->ref == BLOB_REF_DICTIONARY) {
+        argv[i++] = "-D";
+        argv[i++] = decoder->ref_path;
+    } else if (decoder->ref == BLOB_REF_BASE) {
+        snprintf(patch_from, sizeof(patch_from), "--patch-from=%s", decoder->ref_path);
+        argv[i++] = patch_from;
+        argv[i++] = BLOB_CODEC_LONG;
+    }
+    argv[i] = NULL;
+
+    pipefd[0] = pipefd[1] = -1;
+    if (decoder->check && pipe2(pipefd, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    out = decoder->check ? pipefd[1] : decoder->out;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+        goto err;
+    }
+
+    if ((pid = fork()) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        goto err;
+    } else if (pid == 0) {
+        if (dup2(fds[1], STDIN_FILENO) < 0 || dup2(out, STDOUT_FILENO) < 0) {
+            _exit(127);
+        }
+        execvp(argv[0], (char *const *)argv);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    decoder->in = fds[0];
+    decoder->pid = pid;
+    if (decoder->check) {
+        close(pipefd[1]);
+        decoder->from = pipefd[0];
+    }
+    return 0;
+
+err:
+    if (decoder->check) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    return -1;
+}
+
+#ifdef HAVE_ZSTD
+/* 字典不大, 由zstd复制一份; 旧镜像可能很大, 只引用映射的内容 */
+static int blob_decoder_zstd_init(blob_decoder_t *decoder)
+{
+    int fd;
+    struct stat st;
+
+    decoder->pending = 1;
+    if ((decoder->zstd = ZSTD_createDCtx()) == NULL) {
+        return -1;
+    }
+
+    if (decoder->ref == BLOB_REF_NONE) {
+        return 0;
+    }
+
+    if ((fd = open(decoder->ref_path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0
+            || (decoder->ref_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        decoder->ref_map = NULL;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    decoder->ref_size = (size_t)st.st_size;
+    if (decoder->ref == BLOB_REF_DICTIONARY) {
+        return ZSTD_isError(ZSTD_DCtx_loadDictionary(decoder->zstd, decoder->ref_map, decoder->ref_size))
+            ? -1 : 0;
+    }
+
+    madvise(decoder->ref_map, decoder->ref_size, MADV_SEQUENTIAL);
+    if (ZSTD_isError(ZSTD_DCtx_setParameter(decoder->zstd, ZSTD_d_windowLogMax, BLOB_CODEC_WINDOW_LOG))
+            || ZSTD_isError(ZSTD_DCtx_refPrefix(decoder->zstd, decoder->ref_map, decoder->ref_size))) {
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+static int blob_decoder_init(blob_decoder_t *decoder)
+{
+    switch (decoder->codec) {
+    case BLOB_CODEC_RAW:
+        return 0;
+#ifdef HAVE_ZSTD
+    case BLOB_CODEC_ZSTD:
+        return blob_decoder_zstd_init(decoder);
+#endif
+#ifdef HAVE_LZ4
+    case BLOB_CODEC_LZ4:
+        decoder->pending = 1;
+        return LZ4F_isError(LZ4F_createDecompressionContext(&decoder->lz4, LZ4F_VERSION)) ? -1 : 0;
+#endif
+    default:
+        return blob_decoder_spawn(decoder);
+    }
+}
+
+blob_decoder_t *blob_decoder_create(blob_codec_t codec, blob_ref_type_t ref, const char *ref_path,
+    int out, blob_check_t check, void *arg)
+{
+    size_t size;
+    blob_decoder_t *decoder;
+
+    if (codec < 0 || codec >= ARRAY_SIZE(blob_codec_names) || out < 0) {
+        return NULL;
+    }
+
+    if (ref != BLOB_REF_NONE && (codec != BLOB_CODEC_ZSTD || ref_path == NULL
+            || ref < 0 || ref >= ARRAY_SIZE(blob_ref_names))) {
+        return NULL;
+    }
+
+    size = 0;
+#ifdef HAVE_ZSTD
+    if (codec == BLOB_CODEC_ZSTD) {
+        size = ZSTD_DStreamOutSize();
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (codec == BLOB_CODEC_LZ4) {
+        size = BLOB_CODEC_BUFSIZE;
+    }
+#endif
+    /* 调用命令解码时用来读子进程的输出 */
+    if (check && size == 0) {
+        size = BLOB_CODEC_BUFSIZE;
+    }
+
+    if ((decoder = (blob_decoder_t *)calloc(1, sizeof(*decoder) + size)) == NULL) {
+        return NULL;
+    }
+
+    decoder->codec = codec;
+    decoder->out = out;
+    decoder->pid = -1;
+    decoder->in = -1;
+    decoder->from = -1;
+    decoder->check = check;
+    decoder->check_arg = arg;
+    decoder->size = size;
+    decoder->ref = ref;
+    decoder->ref_path = ref_path;
+    if (blob_decoder_init(decoder) != 0) {
+        blob_decoder_close(decoder);
+        return NULL;
+    }
+
+    return decoder;
+}
+
+/* 输出是暂存文件, 不用full_write逐次fsync; 需要落盘时由写分区或者放进仓库的一方负责 */
+static int blob_decoder_output(blob_decoder_t *decoder, const void *buf, size_t n)
+{
+    ssize_t ret;
+    const char *p;
+
+    if (decoder->check && n > 0 && decoder->check(decoder->check_arg, buf, n) != 0) {
+        return -1;
+    }
+
+    for (p = (const char *)buf; n > 0; p += ret, n -= ret) {
+        if ((ret = write(decoder->out, p, n)) <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* 读一次子进程的输出并检查, 读到结尾返回1 */
+static int blob_decoder_drain(blob_decoder_t *decoder)
+{
+    ssize_t ret;
+
+    while ((ret = read(decoder->from, decoder->buf, decoder->size)) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    if (ret == 0) {
+        return 1;
+    }
+
+    return blob_decoder_output(decoder, decoder->buf, ret);
+}
+
+static int blob_decoder_send(blob_decoder_t *decoder, const void *buf, size_t n)
+{
+    ssize_t ret;
+    const char *p;
+    struct pollfd pfd[2];
+
+    for (p = (const char *)buf; n > 0; p += ret, n -= ret) {
+        ret = 0;
+        if (decoder->from >= 0) {
+            /* 子进程的输出管道满了就不再读输入, 两边都要照顾到 */
+            pfd[0].fd = decoder->in;
+            pfd[0].events = POLLOUT;
+            pfd[1].fd = decoder->from;
+            pfd[1].events = POLLIN;
+            if (poll(pfd, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+
+            if ((pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) && blob_decoder_drain(decoder) != 0) {
+                return -1;
+            }
+
+            if (!(pfd[0].revents & (POLLOUT | POLLHUP | POLLERR))) {
+                continue;
+            }
+        }
+
+        if ((ret = send(decoder->in, p, n, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                ret = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int blob_decoder_zstd(blob_decoder_t *decoder, const void *buf, size_t n)
+{
+    size_t ret, pos;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+
+    in.src = buf;
+    in.size = n;
+    in.pos = 0;
+    do {
+        out.dst = decoder->buf;
+        out.size = decoder->size;
+        out.pos = 0;
+        pos = in.pos;
+        ret = ZSTD_decompressStream(decoder->zstd, &out, &in);
+        if (ZSTD_isError(ret) || blob_decoder_output(decoder, out.dst, out.pos) != 0) {
+            return -1;
+        }
+
+        /* 帧结束后没有输入时返回的是下一帧需要的长度, 不能当作帧不完整 */
+        if (in.pos != pos || out.pos) {
+            decoder->pending = ret;
+
+            /* refPrefix只对一帧有效, 下一帧开始前重新引用 */
+            if (ret == 0 && decoder->ref == BLOB_REF_BASE
+                    && ZSTD_isError(ZSTD_DCtx_refPrefix(decoder->zstd, decoder->ref_map, decoder->ref_size))) {
+                return -1;
+            }
+        }
+    } while (in.pos < in.size || out.pos == out.size);
+
+    return 0;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static int blob_decoder_lz4(blob_decoder_t *decoder, const void *buf, size_t n)
+{
+    size_t ret, pos, src, dst;
+
+    pos = 0;
+    do {
+        src = n - pos;
+        dst = decoder->size;
+        ret = LZ4F_decompress(decoder->lz4, decoder->buf, &dst, (const char *)buf + pos, &src, NULL);
+        if (LZ4F_isError(ret) || blob_decoder_output(decoder, decoder->buf, dst) != 0) {
+            return -1;
+        }
+
+        pos += src;
+        if (src || dst) {
+            decoder->pending = ret;
+        }
+    } while (pos < n || dst == decoder->size);
+
+    return 0;
+}
+#endif
+
+int blob_decoder_write(blob_decoder_t *decoder, const void *buf, size_t n)
+{
+    int ret;
+
+    if (decoder == NULL || decoder->failed) {
+        return -1;
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    if (decoder->pid > 0) {
+        ret = blob_decoder_send(decoder, buf, n);
+    } else {
+        switch (decoder->codec) {
+#ifdef HAVE_ZSTD
+        case BLOB_CODEC_ZSTD:
+            ret = blob_decoder_zstd(decoder, buf, n);
+            break;
+#endif
+#ifdef HAVE_LZ4
+        case BLOB_CODEC_LZ4:
+            ret = blob_decoder_lz4(decoder, buf, n);
+            break;
+#endif
+        default:
+            ret = blob_decoder_output(decoder, buf, n);
+            break;
+        }
+    }
+
+    if (ret != 0) {
+        decoder->failed = 1;
+    }
+
+    return ret;
+}
+
+int blob_decoder_close(blob_decoder_t *decoder)
+{
+    int ret, status;
+
+    if (decoder == NULL) {
+        return -1;
+    }
+
+    ret = decoder->failed || decoder->pending ? -1 : 0;
+    if (decoder->pid > 0) {
+        close(decoder->in);
+        if (decoder->from >= 0) {
+            /* 失败时直接关掉管道, 子进程写不出去就会退出 */
+            while (ret == 0 && (status = blob_decoder_drain(decoder)) != 1) {
+                if (status != 0) {
+                    ret = -1;
+                }
+            }
+            close(decoder->from);
+        }
+        while (waitpid(decoder->pid, &status, 0) < 0) {
+            if (errno != EINTR) {
+                status = -1;
+                break;
+            }
+        }
+        if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            ret = -1;
+        }
+    }
+
+#ifdef HAVE_ZSTD
+    ZSTD_freeDCtx(decoder->zstd);
+#endif
+    if (decoder->ref_map) {
+        munmap(decoder->ref_map, decoder->ref_size);
+    }
+#ifdef HAVE_LZ4
+    if (decoder->lz4) {
+        LZ4F_freeDecompressionContext(decoder->lz4);
+    }
+#endif
+    free(decoder);
+
+    return ret;
+}
+
+/* 在内核中复制, 返回0表示完成, -1表示出错, 1表示不支持, 需要用read/write复制 */
+static int blob_copy_fd(int in, int out)
+{
+    int first;
+    ssize_t n;
+    struct stat st;
+
+    if (fstat(in, &st) != 0) {
+        return -1;
+    }
+
+    for (first = 1; ; first = 0) {
+        if (S_ISFIFO(st.st_mode)) {
+            n = splice(in, NULL, out, NULL, BLOB_CODEC_COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else if (S_ISREG(st.st_mode)) {
+            n = copy_file_range(in, NULL, out, NULL, BLOB_CODEC_COPY_CHUNK, 0);
+        } else {
+            return 1;
+        }
+
+        if (n == 0) {
+            return 0;
+        } else if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /* 输出不支持(如O_APPEND、跨文件系统或者旧内核)时, 只有还没复制过才能退回 */
+            return first && (errno == EINVAL || errno == EXDEV || errno == ENOSYS
+                || errno == EOPNOTSUPP) ? 1 : -1;
+        }
+    }
+}
+
+int blob_decode_fd(blob_codec_t codec, blob_ref_type_t ref, const char *ref_path, int in, int out,
+    blob_check_t check, void *arg)
+{
+    int ret;
+    ssize_t n;
+    blob_decoder_t *decoder;
+    char buf[BLOB_CODEC_BUFSIZE];
+
+    if (check == NULL && codec == BLOB_CODEC_RAW && ref == BLOB_REF_NONE
+            && (ret = blob_copy_fd(in, out)) <= 0) {
+        return ret;
+    }
+
+    if ((decoder = blob_decoder_create(codec, ref, ref_path, out, check, arg)) == NULL) {
+        return -1;
+    }
+
+    while ((n = read(in, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            blob_decoder_close(decoder);
+            return -1;
+        }
+
+        if (blob_decoder_write(decoder, buf, n) != 0) {
+            break;
+        }
+    }
+
+    return blob_decoder_close(decoder);
+}
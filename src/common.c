@@ -1,24 +1,66 @@
-﻿#include <errno.h>
+﻿#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "common.h"
 
+#define FILE_CACHE_VEC_SIZE     4096    /* 每次用mincore检查的页数 */
+
+/* 每个线程可以把进度输出重定向到自己的sink, 没有设置时输出到stdout */
+static __thread progress_sink_t progress_sink;
+static __thread void *progress_sink_arg;
+
+void progress_set_sink(progress_sink_t sink, void *arg)
+{
+    progress_sink = sink;
+    progress_sink_arg = arg;
+}
+
+void progress_get_sink(progress_sink_t *sink, void **arg)
+{
+    *sink = progress_sink;
+    *arg = progress_sink_arg;
+}
+
 void progress_print(void *reserved, const char *fmt, ...)
 {
+    int n;
     va_list ap;
+    char buf[BUFF_SIZE];
 
     va_start(ap, fmt);
-    vprintf(fmt, ap);
+    if (progress_sink == NULL) {
+        vprintf(fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
     va_end(ap);
+    if (n < 0) {
+        return;
+    } else if (n >= sizeof(buf)) {
+        n = sizeof(buf) - 1;
+    }
+
+    progress_sink(progress_sink_arg, buf, n);
 }
 
 void progress_clearline(void)
 {
+    if (progress_sink) {
+        progress_sink(progress_sink_arg, "\r\33[2K\r", strlen("\r\33[2K\r"));
+        return;
+    }
+
     printf("\r\33[2K\r");
 }
 
@@ -174,3 +216,110 @@ ssize_t full_write(int fd, const void *buf, size_t size)
 
     return total;
 }
+
+/* 当前线程丢弃的页缓存计入的计数器, 由任务设置, 同一任务的线程共用一个 */
+static __thread size_t *page_cache_counter;
+
+void page_cache_set_counter(size_t *counter)
+{
+    page_cache_counter = counter;
+}
+
+size_t *page_cache_get_counter(void)
+{
+    return page_cache_counter;
+}
+
+/* 文件[off, off + len)中在页缓存里的字节数, 不能映射的文件(如只写打开的)返回0 */
+static size_t file_cached_bytes(int fd, off_t off, off_t len)
+{
+    long page;
+    off_t start, end;
+    size_t i, n, total;
+    void *addr;
+    struct stat st;
+    unsigned char vec[FILE_CACHE_VEC_SIZE];
+
+    if ((page = sysconf(_SC_PAGESIZE)) <= 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+
+    end = len == 0 || off + len > st.st_size ? st.st_size : off + len;
+    total = 0;
+    for (start = off & ~((off_t)page - 1); start < end; start += (off_t)n) {
+        n = end - start < (off_t)sizeof(vec) * page ? (size_t)(end - start) : sizeof(vec) * (size_t)page;
+        if ((addr = mmap(NULL, n, PROT_READ, MAP_SHARED, fd, start)) == MAP_FAILED) {
+            break;
+        }
+
+        if (mincore(addr, n, vec) == 0) {
+            for (i = 0; i < (n + page - 1) / page; ++i) {
+                total += (vec[i] & 1) ? (size_t)page : 0;
+            }
+        }
+        munmap(addr, n);
+    }
+
+    return total;
+}
+
+void file_drop_cache(int fd, off_t off, off_t len)
+{
+    size_t before, after;
+    size_t *counter;
+
+    if (fd < 0) {
+        return;
+    }
+
+    /* 只统计真正从页缓存中移除的部分, 重复丢弃同一段或者memfd都不会多算 */
+    counter = page_cache_counter;
+    before = counter ? file_cached_bytes(fd, off, len) : 0;
+    if (posix_fadvise(fd, off, len, POSIX_FADV_DONTNEED) != 0 || before == 0) {
+        return;
+    }
+
+    after = file_cached_bytes(fd, off, len);
+    if (before > after) {
+        __atomic_add_fetch(counter, before - after, __ATOMIC_RELAXED);
+    }
+}
+
+int file_writeback_drop(int fd, off_t off, off_t len)
+{
+    /* DONTNEED只丢弃干净的页, 脏页要先写回 */
+    if (sync_file_range(fd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+            | SYNC_FILE_RANGE_WAIT_AFTER) != 0 && errno != ESPIPE && errno != EINVAL) {
+        return -1;
+    }
+
+    file_drop_cache(fd, off, len);
+    return 0;
+}
+
+int scratch_file(const char *name, const char *dir, bool in_memory)
+{
+    int fd;
+
+    /* 文件系统不支持O_TMPFILE时退回内存 */
+    if (!in_memory && dir && (fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) >= 0) {
+        return fd;
+    }
+
+    return memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+}
+
+int scratch_seal(int fd)
+{
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0
+            && errno != EINVAL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int fd_path(int fd, char *buf, size_t n)
+{
+    return snprintf(buf, n, "/proc/%d/fd/%d", (int)getpid(), fd) < (int)n ? 0 : -1;
+}
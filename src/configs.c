@@ -1,11 +1,289 @@
-﻿#include <stdio.h>
+﻿#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include "common.h"
 #include "configs.h"
+#include "hashtable.h"
+#include "iniparser.h"
+
+#define SYSTEM_TUNABLE_SECTION  "upgrade"
+
+typedef enum {
+    TUNABLE_INT,
+    TUNABLE_BOOL,
+    TUNABLE_SIZE,       /* 可以带K/M/G后缀 */
+    TUNABLE_ENUM,       /* 取值为names中的名字, 保存为下标 */
+} tunable_type_t;
+
+struct system_tunable {
+    struct hash_node node;
+    const char *const key;
+    tunable_type_t type;
+    long long def;
+    long long min;
+    long long max;
+    const char *const *names;
+};
+
+static const char *const durability_names[] = {"none", "data", "full", NULL};
+
+static struct system_tunable system_tunables[SYS_TUNABLE_MAX] = {
+    [SYS_TUNABLE_THREADS] = {
+        .key = "threads", .type = TUNABLE_INT,
+        .def = 0, .min = 0, .max = 256
+    },
+    [SYS_TUNABLE_IO_BUFFER_SIZE] = {
+        .key = "io_buffer_size", .type = TUNABLE_SIZE,
+        .def = 1 << 20, .min = 4096, .max = 256 << 20
+    },
+    [SYS_TUNABLE_MEMORY_BUDGET] = {
+        .key = "memory_budget", .type = TUNABLE_SIZE,
+        .def = 64 << 20, .min = 1 << 20, .max = LLONG_MAX
+    },
+    [SYS_TUNABLE_DURABILITY] = {
+        .key = "durability", .type = TUNABLE_ENUM,
+        .def = SYS_DURABILITY_FULL, .min = SYS_DURABILITY_NONE, .max = SYS_DURABILITY_FULL,
+        .names = durability_names
+    },
+    [SYS_TUNABLE_KEEP_OBJECTS] = {
+        .key = "keep_objects", .type = TUNABLE_BOOL,
+        .def = 0, .min = 0, .max = 1
+    },
+};
+
+/* 加载时解析好的参数值, 之后只读 */
+static long long system_tunable_values[SYS_TUNABLE_MAX];
+static INI_CONFIG system_config;
+static pthread_once_t system_config_once = PTHREAD_ONCE_INIT;
+static DEFINE_HASH_TABLE(system_tunable_table, 3, hash_wyhash);
+
+static int system_tunable_parse_size(const char *str, long long *value)
+{
+    int shift;
+    long long v;
+    char *end;
+
+    errno = 0;
+    v = strtoll(str, &end, 0);
+    if (errno != 0 || end == str || v < 0) {
+        return -1;
+    }
+
+    switch (toupper((unsigned char)*end)) {
+    case 'K':
+        shift = 10;
+        break;
+    case 'M':
+        shift = 20;
+        break;
+    case 'G':
+        shift = 30;
+        break;
+    default:
+        shift = 0;
+        break;
+    }
+
+    if (shift) {
+        ++end;
+        if (*end == 'i') {
+            ++end;
+        }
+    }
+
+    if ((*end == 'B' || *end == 'b') && end[1] == '\0') {
+        ++end;
+    }
+
+    if (*end != '\0' || v > (LLONG_MAX >> shift)) {
+        return -1;
+    }
+
+    *value = v << shift;
+    return 0;
+}
+
+static int system_tunable_parse(const struct system_tunable *t, const char *str, long long *value)
+{
+    int i;
+    long long v;
+    char *end;
+    static const char *const true_names[] = {"1", "yes", "true", "on", NULL};
+    static const char *const false_names[] = {"0", "no", "false", "off", NULL};
+
+    v = 0;
+    switch (t->type) {
+    case TUNABLE_INT:
+        errno = 0;
+        v = strtoll(str, &end, 0);
+        if (errno != 0 || end == str || *end != '\0') {
+            return -1;
+        }
+        break;
+    case TUNABLE_SIZE:
+        if (system_tunable_parse_size(str, &v) < 0) {
+            return -1;
+        }
+        break;
+    case TUNABLE_BOOL:
+        for (i = 0; true_names[i] && strcasecmp(true_names[i], str) != 0; ++i) {
+            continue;
+        }
+        if (true_names[i]) {
+            v = 1;
+            break;
+        }
+        for (i = 0; false_names[i] && strcasecmp(false_names[i], str) != 0; ++i) {
+            continue;
+        }
+        if (false_names[i] == NULL) {
+            return -1;
+        }
+        v = 0;
+        break;
+    case TUNABLE_ENUM:
+        for (i = 0; t->names[i] && strcasecmp(t->names[i], str) != 0; ++i) {
+            continue;
+        }
+        if (t->names[i] == NULL) {
+            return -1;
+        }
+        v = i;
+        break;
+    default:
+        return -1;
+    }
+
+    if (v < t->min || v > t->max) {
+        return -1;
+    }
+
+    *value = v;
+    return 0;
+}
+
+static struct system_tunable *system_tunable_find(const char *key)
+{
+    uint64_t hash;
+    struct hlist_node *pos;
+    struct system_tunable *t;
+
+    hash = hash_table_hash(&system_tunable_table, key, strlen(key));
+    hash_table_for_each_possible(&system_tunable_table, t, pos, hash, node) {
+        if (strcmp(t->key, key) == 0) {
+            return t;
+        }
+    }
+
+    return NULL;
+}
+
+/* 按SYSTEM_TUNABLES_ENV覆盖参数, 名字为"节.字段" */
+static void system_tunable_apply_env(void)
+{
+    char *env, *item, *save, *value, *key;
+    struct system_tunable *t;
+
+    if ((env = getenv(SYSTEM_TUNABLES_ENV)) == NULL || (env = strdup(env)) == NULL) {
+        return;
+    }
+
+    for (item = strtok_r(env, ":", &save); item; item = strtok_r(NULL, ":", &save)) {
+        if ((value = strchr(item, '=')) == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+
+        key = item;
+        if (strncmp(key, SYSTEM_TUNABLE_SECTION ".", sizeof(SYSTEM_TUNABLE_SECTION ".") - 1) == 0) {
+            key += sizeof(SYSTEM_TUNABLE_SECTION ".") - 1;
+        }
+
+        if ((t = system_tunable_find(key)) == NULL) {
+            progress_print(NULL, "Unknown tunable %s in %s.\n", item, SYSTEM_TUNABLES_ENV);
+            continue;
+        }
+
+        if (system_tunable_parse(t, value, &system_tunable_values[t - system_tunables]) < 0) {
+            progress_print(NULL, "Ignore invalid value '%s' of %s in %s.\n", value, item,
+                SYSTEM_TUNABLES_ENV);
+        }
+    }
+
+    free(env);
+}
+
+static void system_config_load(void)
+{
+    int i;
+    long cpus;
+    const char *str;
+    struct system_tunable *t;
+
+    /* 缓存目录还不存在时只是不写镜像, 照常解析文本 */
+    system_config = ini_config_create_cached(SYSTEM_INFO_CONF, SYSTEM_INFO_CACHE);
+    for (i = 0; i < SYS_TUNABLE_MAX; ++i) {
+        t = &system_tunables[i];
+        hash_table_add(&system_tunable_table, &t->node,
+            hash_table_hash(&system_tunable_table, t->key, strlen(t->key)));
+
+        system_tunable_values[i] = t->def;
+        if (system_config == NULL
+                || (str = ini_config_get(system_config, SYSTEM_TUNABLE_SECTION, t->key, NULL)) == NULL) {
+            continue;
+        }
+
+        if (system_tunable_parse(t, str, &system_tunable_values[i]) < 0) {
+            progress_print(NULL, "Ignore invalid value '%s' of %s.%s in %s.\n", str,
+                SYSTEM_TUNABLE_SECTION, t->key, SYSTEM_INFO_CONF);
+        }
+    }
+
+    system_tunable_apply_env();
+
+    /* 0表示自动, 在这里换算成实际的线程数 */
+    if (system_tunable_values[SYS_TUNABLE_THREADS] == 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus < 1) {
+            cpus = 1;
+        } else if (cpus > system_tunables[SYS_TUNABLE_THREADS].max) {
+            cpus = (long)system_tunables[SYS_TUNABLE_THREADS].max;
+        }
+        system_tunable_values[SYS_TUNABLE_THREADS] = cpus;
+    }
+}
 
 void *get_system_config(void)
 {
-    void *ptr;
+    pthread_once(&system_config_once, system_config_load);
+
+    return system_config;
+}
+
+long long system_config_int(system_tunable_t id)
+{
+    if ((unsigned int)id >= SYS_TUNABLE_MAX) {
+        return 0;
+    }
+
+    pthread_once(&system_config_once, system_config_load);
+    return system_tunable_values[id];
+}
+
+bool system_config_bool(system_tunable_t id)
+{
+    return system_config_int(id) != 0;
+}
+
+size_t system_config_size(system_tunable_t id)
+{
+    long long v;
 
-    
+    v = system_config_int(id);
+    return v > (long long)(((size_t)-1) >> 1) ? ((size_t)-1) >> 1 : (size_t)v;
 }
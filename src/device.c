@@ -0,0 +1,413 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "configs.h"
+#include "device.h"
+#include "hashtable.h"
+#include "iniparser.h"
+
+#define DEVICE_SOURCES_MAX      8
+#define DEVICE_SECTION          "device"
+
+typedef enum {
+    DEVICE_SOURCE_CONFIG,
+    DEVICE_SOURCE_SYSFS,
+    DEVICE_SOURCE_DT,
+} device_source_type_t;
+
+struct device_probe;
+
+struct device_source {
+    struct device_probe *probe;
+    device_source_type_t type;
+    int state;                  /* 0: 未完成, 1: 成功, -1: 失败 */
+    uint32_t id;
+    char path[PATH_MAX];
+};
+
+/* 探测线程可能在超时后才结束, 所以由调用者和各线程按引用计数共同释放 */
+struct device_probe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs;
+    size_t nsources;
+    struct device_source sources[DEVICE_SOURCES_MAX];
+};
+
+static pthread_mutex_t device_id_lock = PTHREAD_MUTEX_INITIALIZER;
+static int device_id_valid;
+static uint32_t device_id_cached;
+
+static int device_parse_id(const char *str, uint32_t *id)
+{
+    char *end;
+    unsigned long long v;
+
+    while (isspace((unsigned char)*str)) {
+        ++str;
+    }
+
+    errno = 0;
+    v = strtoull(str, &end, 0);
+    if (errno != 0 || end == str || v > UINT32_MAX) {
+        return -1;
+    }
+
+    while (isspace((unsigned char)*end)) {
+        ++end;
+    }
+
+    if (*end != '\0') {
+        return -1;
+    }
+
+    *id = (uint32_t)v;
+    return 0;
+}
+
+static int device_read_source(const struct device_source *source, uint32_t *id)
+{
+    int fd;
+    ssize_t n, i;
+    const char *str;
+    INI_CONFIG config;
+    unsigned char buf[64];
+
+    if (source->type == DEVICE_SOURCE_CONFIG) {
+        if ((config = get_system_config()) == NULL
+                || (str = ini_config_get(config, DEVICE_SECTION, "id", NULL)) == NULL) {
+            return -1;
+        }
+        return device_parse_id(str, id);
+    }
+
+    if ((fd = open(source->path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+
+    n = full_read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+
+    /* 设备树中的数字是大端的cell, 字符串属性以'\0'结尾 */
+    if (source->type == DEVICE_SOURCE_DT && n == 4) {
+        for (i = 0; i < n - 1 && isprint(buf[i]); ++i) {
+            continue;
+        }
+        if (i < n - 1 || buf[n - 1] != '\0') {
+            *id = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16)
+                | ((uint32_t)buf[2] << 8) | buf[3];
+            return 0;
+        }
+    }
+
+    return device_parse_id((const char *)buf, id);
+}
+
+static void device_probe_put(struct device_probe *probe)
+{
+    int refs;
+
+    pthread_mutex_lock(&probe->lock);
+    refs = --probe->refs;
+    pthread_mutex_unlock(&probe->lock);
+    if (refs == 0) {
+        pthread_cond_destroy(&probe->cond);
+        pthread_mutex_destroy(&probe->lock);
+        free(probe);
+    }
+}
+
+static void *device_probe_thread(void *arg)
+{
+    int ret;
+    uint32_t id;
+    struct device_source *source;
+
+    id = 0;
+    source = (struct device_source *)arg;
+    ret = device_read_source(source, &id);
+
+    pthread_mutex_lock(&source->probe->lock);
+    source->id = id;
+    source->state = ret == 0 ? 1 : -1;
+    pthread_cond_broadcast(&source->probe->cond);
+    pthread_mutex_unlock(&source->probe->lock);
+
+    device_probe_put(source->probe);
+    return NULL;
+}
+
+/* 解析"config, sysfs:/path, dt:/path", 返回来源的个数 */
+static size_t device_parse_sources(const char *str, struct device_probe *probe)
+{
+    size_t len;
+    const char *end, *path;
+    struct device_source *source;
+
+    probe->nsources = 0;
+    while (*str && probe->nsources < DEVICE_SOURCES_MAX) {
+        while (isspace((unsigned char)*str) || *str == ',') {
+            ++str;
+        }
+
+        for (end = str; *end && *end != ','; ++end) {
+            continue;
+        }
+        len = end - str;
+        while (len > 0 && isspace((unsigned char)str[len - 1])) {
+            --len;
+        }
+
+        if (len == 0) {
+            break;
+        }
+
+        source = &probe->sources[probe->nsources];
+        memset(source, 0, sizeof(*source));
+        path = NULL;
+        if (len == strlen("config") && strncmp(str, "config", len) == 0) {
+            source->type = DEVICE_SOURCE_CONFIG;
+        } else if (strncmp(str, "sysfs:", strlen("sysfs:")) == 0) {
+            source->type = DEVICE_SOURCE_SYSFS;
+            path = str + strlen("sysfs:");
+        } else if (strncmp(str, "dt:", strlen("dt:")) == 0) {
+            source->type = DEVICE_SOURCE_DT;
+            path = str + strlen("dt:");
+        } else {
+            progress_print(NULL, "Unknown device id source %.*s.\n", (int)len, str);
+            str = end;
+            continue;
+        }
+
+        if (path) {
+            if ((size_t)(str + len - path) >= sizeof(source->path)) {
+                str = end;
+                continue;
+            }
+            memcpy(source->path, path, str + len - path);
+        }
+
+        source->probe = probe;
+        probe->nsources++;
+        str = end;
+    }
+
+    return probe->nsources;
+}
+
+static int device_probe_id(const char *sources, long timeout_ms, uint32_t *id)
+{
+    int ret, done;
+    size_t i, started;
+    pthread_t thread;
+    pthread_attr_t attr;
+    struct timespec deadline;
+    struct device_probe *probe;
+
+    if ((probe = (struct device_probe *)malloc(sizeof(*probe))) == NULL) {
+        return -1;
+    }
+
+    if (device_parse_sources(sources, probe) == 0) {
+        free(probe);
+        return -1;
+    }
+
+    pthread_mutex_init(&probe->lock, NULL);
+    pthread_cond_init(&probe->cond, NULL);
+    probe->refs = 1;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    /* sysfs/EEPROM可能很慢, 每个来源一个分离的线程, 超时后不再等待 */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    started = 0;
+    pthread_mutex_lock(&probe->lock);
+    for (i = 0; i < probe->nsources; ++i) {
+        probe->refs++;
+        if (pthread_create(&thread, &attr, device_probe_thread, &probe->sources[i]) != 0) {
+            probe->refs--;
+            probe->sources[i].state = -1;
+            continue;
+        }
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+
+    /* 优先级最高的成功来源之前的来源全部失败时即可返回, 不必等其他来源 */
+    ret = -1;
+    for (;;) {
+        done = 1;
+        for (i = 0; i < probe->nsources; ++i) {
+            if (probe->sources[i].state == 0) {
+                done = 0;
+                break;
+            }
+            if (probe->sources[i].state == 1) {
+                *id = probe->sources[i].id;
+                ret = 0;
+                break;
+            }
+        }
+
+        if (ret == 0 || done || started == 0) {
+            break;
+        }
+
+        if (pthread_cond_timedwait(&probe->cond, &probe->lock, &deadline) == ETIMEDOUT) {
+            /* 超时后取已经完成的来源中优先级最高的一个 */
+            for (i = 0; i < probe->nsources; ++i) {
+                if (probe->sources[i].state == 1) {
+                    *id = probe->sources[i].id;
+                    ret = 0;
+                    break;
+                }
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&probe->lock);
+
+    device_probe_put(probe);
+    return ret;
+}
+
+/* 缓存文件的标记, 来源配置或SYSTEM_INFO_CONF变化后旧缓存失效 */
+static uint64_t device_cache_stamp(const char *sources)
+{
+    uint64_t stamp;
+    struct stat st;
+
+    stamp = hash_wyhash(sources, strlen(sources), 0);
+    if (stat(SYSTEM_INFO_CONF, &st) == 0) {
+        stamp = hash_wyhash(&st.st_mtim, sizeof(st.st_mtim), stamp ^ (uint64_t)st.st_ino);
+    }
+
+    return stamp;
+}
+
+static int device_cache_read(uint64_t stamp, uint32_t *id)
+{
+    int ret;
+    FILE *fp;
+    unsigned int v;
+    unsigned long long s;
+
+    if ((fp = fopen(DEVICE_ID_CACHE, "re")) == NULL) {
+        return -1;
+    }
+
+    ret = fscanf(fp, "%u %llx", &v, &s) == 2 && (uint64_t)s == stamp ? 0 : -1;
+    fclose(fp);
+    if (ret == 0) {
+        *id = v;
+    }
+
+    return ret;
+}
+
+static void device_cache_write(uint64_t stamp, uint32_t id)
+{
+    int fd, n;
+    char buf[64];
+    char tmp[sizeof(DEVICE_ID_CACHE) + 16];
+
+    if (mkdir(DEVICE_ID_CACHE_DIR, 0755) != 0 && errno != EEXIST) {
+        return;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", DEVICE_ID_CACHE, (int)getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        return;
+    }
+
+    /* tmpfs不需要fsync, rename保证其他进程读到的是完整的内容 */
+    n = snprintf(buf, sizeof(buf), "%u %016llx\n", id, (unsigned long long)stamp);
+    if (full_write(fd, buf, n) != n) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    close(fd);
+
+    if (rename(tmp, DEVICE_ID_CACHE) != 0) {
+        unlink(tmp);
+    }
+}
+
+int device_get_id(uint32_t *id)
+{
+    int ret;
+    long timeout_ms;
+    uint64_t stamp;
+    const char *sources, *str;
+    INI_CONFIG config;
+
+    if (id == NULL) {
+        return -1;
+    }
+
+    if (__atomic_load_n(&device_id_valid, __ATOMIC_ACQUIRE)) {
+        *id = device_id_cached;
+        return 0;
+    }
+
+    pthread_mutex_lock(&device_id_lock);
+    if (device_id_valid) {
+        *id = device_id_cached;
+        pthread_mutex_unlock(&device_id_lock);
+        return 0;
+    }
+
+    sources = DEVICE_ID_SOURCES_DEFAULT;
+    timeout_ms = DEVICE_PROBE_TIMEOUT_MS;
+    if ((config = get_system_config()) != NULL) {
+        sources = ini_config_get(config, DEVICE_SECTION, "id_sources", sources);
+        if ((str = ini_config_get(config, DEVICE_SECTION, "probe_timeout_ms", NULL)) != NULL
+                && (timeout_ms = strtol(str, NULL, 0)) <= 0) {
+            timeout_ms = DEVICE_PROBE_TIMEOUT_MS;
+        }
+    }
+
+    stamp = device_cache_stamp(sources);
+    if ((ret = device_cache_read(stamp, &device_id_cached)) != 0
+            && (ret = device_probe_id(sources, timeout_ms, &device_id_cached)) == 0) {
+        device_cache_write(stamp, device_id_cached);
+    }
+
+    if (ret == 0) {
+        *id = device_id_cached;
+        __atomic_store_n(&device_id_valid, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&device_id_lock);
+
+    return ret;
+}
+
+void device_id_invalidate(void)
+{
+    pthread_mutex_lock(&device_id_lock);
+    __atomic_store_n(&device_id_valid, 0, __ATOMIC_RELEASE);
+    unlink(DEVICE_ID_CACHE);
+    pthread_mutex_unlock(&device_id_lock);
+}
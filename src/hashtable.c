@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hashtable.h"
+
+#define HASH_TABLE_MAX_BITS     (sizeof(size_t) * 8 - 8)
+
+/*
+ * wyhash (Wang Yi, public domain), final version 4. 对短键很快, 节名、键名和清单中的
+ * 字符串都是短键.
+ */
+static const uint64_t wyp[4] = {
+    0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+    0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL
+};
+
+static inline void wymum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r;
+
+    r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha, hb, la, lb, hi, lo, rh, rm0, rm1, rl, t;
+    int c;
+
+    ha = *a >> 32;
+    hb = *b >> 32;
+    la = (uint32_t)*a;
+    lb = (uint32_t)*b;
+    rh = ha * hb;
+    rm0 = ha * lb;
+    rm1 = hb * la;
+    rl = la * lb;
+    t = rl + (rm0 << 32);
+    c = t < rl;
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    *a = lo;
+    *b = hi;
+#endif
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b)
+{
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wyr8(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t wyr3(const uint8_t *p, size_t k)
+{
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t hash_wyhash(const void *key, size_t len, uint64_t seed)
+{
+    size_t i;
+    uint64_t a, b, see1, see2;
+    const uint8_t *p;
+
+    p = (const uint8_t *)key;
+    seed ^= wymix(seed ^ wyp[0], wyp[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+            b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = wyr3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        i = len;
+        if (i > 48) {
+            see1 = seed;
+            see2 = seed;
+            do {
+                seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+
+        while (i > 16) {
+            seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
+    }
+
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(&a, &b);
+    return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
+uint64_t hash_fnv1a(const void *key, size_t len, uint64_t seed)
+{
+    size_t i;
+    uint64_t h;
+    const uint8_t *p;
+
+    p = (const uint8_t *)key;
+    h = 0xcbf29ce484222325ULL ^ seed;
+    for (i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    /* fnv的高位混合得不好, 而选桶用的是高位 */
+    return hash_u64(h);
+}
+
+int hash_table_init(struct hash_table *table, unsigned int bits, hash_func_t hashfn)
+{
+    if (table == NULL || bits > HASH_TABLE_MAX_BITS) {
+        return -1;
+    }
+
+    if ((table->buckets = (struct hlist_head *)calloc((size_t)1 << bits,
+            sizeof(struct hlist_head))) == NULL) {
+        return -1;
+    }
+
+    table->bits = bits;
+    table->flags = 0;
+    table->count = 0;
+    table->hashfn = hashfn ? hashfn : hash_wyhash;
+    table->seed = 0;
+
+    return 0;
+}
+
+void hash_table_destroy(struct hash_table *table)
+{
+    if (table == NULL) {
+        return;
+    }
+
+    if (!(table->flags & HASH_TABLE_STATIC)) {
+        free(table->buckets);
+    }
+
+    table->buckets = NULL;
+    table->bits = 0;
+    table->count = 0;
+}
+
+int hash_table_resize(struct hash_table *table, unsigned int bits)
+{
+    size_t i;
+    struct hash_table old;
+    struct hash_node *entry;
+    struct hlist_node *pos, *n;
+
+    if (table == NULL || bits > HASH_TABLE_MAX_BITS) {
+        return -1;
+    }
+
+    if (bits == table->bits) {
+        return 0;
+    }
+
+    old = *table;
+    if ((table->buckets = (struct hlist_head *)calloc((size_t)1 << bits,
+            sizeof(struct hlist_head))) == NULL) {
+        table->buckets = old.buckets;
+        return -1;
+    }
+
+    /* 保存了哈希值, 这里只是重新链接 */
+    table->bits = bits;
+    table->flags &= ~HASH_TABLE_STATIC;
+    for (i = 0; i < hash_table_size(&old); ++i) {
+        hlist_for_each_entry_safe(entry, pos, n, &old.buckets[i], node) {
+            hlist_add_head(&entry->node, hash_table_bucket(table, entry->hash));
+        }
+    }
+
+    if (!(old.flags & HASH_TABLE_STATIC)) {
+        free(old.buckets);
+    }
+
+    return 0;
+}
@@ -1,24 +1,41 @@
-#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include "list.h"
 #include "rbtree.h"
 #include "iniparser.h"
 #include "common.h"
 
-#define INI_LINE_MAXSIZE    2048
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 struct ini_head {
     struct list_head list;
-    struct rb_root rb;
+    struct rb_root_cached rb;
 };
 
+struct ini_section;
+
 struct ini_node {
     struct list_head list;
     struct rb_node rb;
+    unsigned int hash;
+    struct ini_section *owner;  /* 节点为关键字时指向所在的节, 为节时是NULL */
 };
 
 struct ini_tag {
@@ -33,9 +50,31 @@ struct ini_section {
     struct ini_head tags;
 };
 
+/*
+ * 开放寻址(线性探测)的哈希索引, 节和关键字共用一张表.
+ * 槽中保存预先计算好的哈希值, 查找时只有哈希值相同才比较字符串.
+ */
+struct ini_index_slot {
+    unsigned int hash;
+    struct ini_node *node;
+};
+
+struct ini_index {
+    struct ini_index_slot *slots;
+    size_t mask;
+    size_t count;
+};
+
+struct ini_image_header;
+
 struct ini_config {
     char *file;
     struct ini_head sections;
+    struct ini_index index;
+    const struct ini_image_header *image;
+    int image_active;   /* 非0时链表/红黑树为空, 查询直接使用镜像 */
+    int lock_fd;        /* 事务期间持有的文件锁, 没有事务时为-1 */
+    int rb_deferred;    /* 批量加载期间只维护链表和索引, 加载完后一次建树 */
 };
 
 enum {
@@ -68,92 +107,315 @@ static int ini_strcmp(const char *stra, const char *strb)
     return strcmp(stra, strb);
 }
 
-static int ini_parse_line(char *const line, union ini_parse_block *ipb)
+/*
+ * 向量化的字符查找: 一次比较16/32个字节, 找出第一个属于给定字符集(最多4个字符,
+ * 不足时重复填充)的位置, 每行的内容只被扫描一遍. 没有SIMD时使用标量实现.
+ */
+static inline int ini_isspace(unsigned char c)
 {
-    size_t i, j;
-    int line_type;
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
 
-    for (i = 0; line[i] != '\0'; ++i)
-        if (!isspace(line[i]))
+static const char ini_set_section[4] = {']', '\r', '\n', '\n'};
+static const char ini_set_kv[4]      = {'=', '\r', '\n', '\n'};
+static const char ini_set_eol[4]     = {'\r', '\n', '\n', '\n'};
+static const char ini_set_nl[4]      = {'\n', '\n', '\n', '\n'};
+
+static char *ini_scan(char *p, char *end, const char set[4])
+{
+#if defined(__AVX2__)
+    unsigned int mask;
+    __m256i v, a, b, c, d;
+
+    a = _mm256_set1_epi8(set[0]);
+    b = _mm256_set1_epi8(set[1]);
+    c = _mm256_set1_epi8(set[2]);
+    d = _mm256_set1_epi8(set[3]);
+    for (; end - p >= 32; p += 32) {
+        v = _mm256_loadu_si256((const __m256i *)p);
+        mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, a), _mm256_cmpeq_epi8(v, b)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, c), _mm256_cmpeq_epi8(v, d))));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__SSE2__)
+    unsigned int mask;
+    __m128i v, a, b, c, d;
+
+    a = _mm_set1_epi8(set[0]);
+    b = _mm_set1_epi8(set[1]);
+    c = _mm_set1_epi8(set[2]);
+    d = _mm_set1_epi8(set[3]);
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, c), _mm_cmpeq_epi8(v, d))));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__ARM_NEON)
+    uint64_t mask;
+    uint8x16_t v, a, b, c, d, m;
+
+    a = vdupq_n_u8((uint8_t)set[0]);
+    b = vdupq_n_u8((uint8_t)set[1]);
+    c = vdupq_n_u8((uint8_t)set[2]);
+    d = vdupq_n_u8((uint8_t)set[3]);
+    for (; end - p >= 16; p += 16) {
+        v = vld1q_u8((const uint8_t *)p);
+        m = vorrq_u8(vorrq_u8(vceqq_u8(v, a), vceqq_u8(v, b)),
+                     vorrq_u8(vceqq_u8(v, c), vceqq_u8(v, d)));
+        /* 每个字节压缩成4位的掩码 */
+        mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (mask) {
+            return p + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+#endif
+    for (; p < end; ++p) {
+        if (*p == set[0] || *p == set[1] || *p == set[2] || *p == set[3]) {
             break;
-    switch (line[i]) {
-    case '\0':
-    case ';':
-        line_type = INI_CONFIG_EMPTY;
-        break;
-    case '[':
-        line_type = INI_CONFIG_SECTION;
-        for (j = i + 1; line[j] != '\0' && line[j] != '\r' && line[j] != '\n';
-            ++j) {
-            if (line[j] == ']')
-                break;
         }
-        if (line[j] == ']') {
-            line[j] = '\0';
-            ipb->section = line + i + 1;
-        } else {
-            line_type = INI_CONFIG_EMPTY;
-        }
-        break;
-    default:
-        line_type = INI_CONFIG_KEY_VALUE;
-        for (j = i + 1; line[j] != '\0' && line[j] != '\r' && line[j] != '\n';
-            ++j) {
-            if (line[j] == '=')
+    }
+
+    return p;
+}
+
+/* 解析[line, end)开始的一行, *next返回下一行的起始位置, end处必须可写 */
+static int ini_parse_line(char *line, char *end, union ini_parse_block *ipb, char **next)
+{
+    int line_type;
+    char *p, *q, *k, *v, *e, *eol;
+
+    for (p = line; p < end && *p != '\n' && ini_isspace(*p); ++p) {
+        continue;
+    }
+
+    line_type = INI_CONFIG_EMPTY;
+    q = p;
+    if (p < end) {
+        switch (*p) {
+        case '\n':
+        case ';':
+        case '\0':
+            break;
+        case '[':
+            q = ini_scan(p + 1, end, ini_set_section);
+            if (q < end && *q == ']') {
+                line_type = INI_CONFIG_SECTION;
+                ipb->section = p + 1;
+                *q++ = '\0';
+            }
+            break;
+        default:
+            q = ini_scan(p + 1, end, ini_set_kv);
+            if (q == end || *q != '=') {
                 break;
-        }
-        if (line[j] == '=') {
-            ipb->kv.key = line + i;
-            ipb->kv.value = line + j + 1;
-            while (j-- > i) {
-                if (!isspace(line[j]))
-                    break;
             }
-            line[++j] = '\0';
-            for (i = 0; ipb->kv.value[i] != '\0'
-                    && ipb->kv.value[i] != '\r' && ipb->kv.value[i] != '\n';
-                ++i) {
-                if (!isspace(ipb->kv.value[i])) {
-                    ipb->kv.value = ipb->kv.value + i;
-                    break;
-                }
+
+            line_type = INI_CONFIG_KEY_VALUE;
+            for (k = q; ini_isspace(k[-1]); --k) {
+                continue;
             }
-            for (i = 0; ipb->kv.value[i] != '\0'
-                    && ipb->kv.value[i] != '\r' && ipb->kv.value[i] != '\n';
-                ++i) {
+            eol = ini_scan(q + 1, end, ini_set_eol);
+            for (v = q + 1; v < eol && ini_isspace(*v); ++v) {
                 continue;
             }
-            while (i-- > 0)
-                if (!isspace(ipb->kv.value[i]))
-                    break;
-            ipb->kv.value[++i] = '\0';
-        } else {
-            line_type = INI_CONFIG_EMPTY;
+            for (e = eol; e > v && ini_isspace(e[-1]); --e) {
+                continue;
+            }
+            q = (eol < end && *eol == '\n') ? eol : ini_scan(eol, end, ini_set_nl);
+            *next = q < end ? q + 1 : end;
+            /* 行尾可能就是换行符, 先确定下一行再截断 */
+            *k = '\0';
+            *e = '\0';
+            ipb->kv.key = p;
+            ipb->kv.value = v;
+            return line_type;
         }
-        break;
     }
 
+    if (q < end && *q != '\n') {
+        q = ini_scan(q, end, ini_set_nl);
+    }
+    *next = q < end ? q + 1 : end;
+
     return line_type;
 }
 
+static unsigned int ini_hash(const char *section, const char *key)
+{
+    unsigned int hash;
+
+    hash = 2166136261U;
+    if (section) {
+        while (*section) {
+            hash = (hash ^ (unsigned char)*section++) * 16777619U;
+        }
+    }
+
+    if (key) {
+        hash = (hash ^ 0xffU) * 16777619U;
+        while (*key) {
+            hash = (hash ^ (unsigned char)*key++) * 16777619U;
+        }
+    }
+
+    return hash;
+}
+
+static int ini_index_match(const struct ini_node *node, const char *section, const char *key)
+{
+    if (key == NULL) {
+        return node->owner == NULL
+            && ini_strcmp(container_of(node, struct ini_section, node)->section, section) == 0;
+    }
+
+    return node->owner != NULL
+        && strcmp(container_of(node, struct ini_tag, node)->key, key) == 0
+        && ini_strcmp(node->owner->section, section) == 0;
+}
+
+static struct ini_node *ini_index_lookup(const struct ini_index *index, const char *section,
+    const char *key)
+{
+    size_t i;
+    unsigned int hash;
+
+    if (index->slots == NULL) {
+        return NULL;
+    }
+
+    hash = ini_hash(section, key);
+    for (i = hash & index->mask; index->slots[i].node; i = (i + 1) & index->mask) {
+        if (index->slots[i].hash == hash && ini_index_match(index->slots[i].node, section, key)) {
+            return index->slots[i].node;
+        }
+    }
+
+    return NULL;
+}
+
+static void ini_index_place(struct ini_index_slot *slots, size_t mask, struct ini_node *node)
+{
+    size_t i;
+
+    for (i = node->hash & mask; slots[i].node; i = (i + 1) & mask) {
+        continue;
+    }
+    slots[i].hash = node->hash;
+    slots[i].node = node;
+}
+
+static int ini_index_grow(struct ini_index *index)
+{
+    size_t i, size;
+    struct ini_index_slot *slots;
+
+    size = index->slots ? (index->mask + 1) << 1 : 16;
+    slots = (struct ini_index_slot *)calloc(size, sizeof(*slots));
+    if (slots == NULL) {
+        return -1;
+    }
+
+    if (index->slots) {
+        for (i = 0; i <= index->mask; ++i) {
+            if (index->slots[i].node) {
+                ini_index_place(slots, size - 1, index->slots[i].node);
+            }
+        }
+        free(index->slots);
+    }
+    index->slots = slots;
+    index->mask = size - 1;
+
+    return 0;
+}
+
+static int ini_index_insert(struct ini_index *index, struct ini_node *node)
+{
+    /* 装载因子保持在3/4以下 */
+    if ((index->slots == NULL || (index->count + 1) * 4 > (index->mask + 1) * 3)
+            && ini_index_grow(index) != 0) {
+        return -1;
+    }
+
+    ini_index_place(index->slots, index->mask, node);
+    index->count++;
+
+    return 0;
+}
+
+static void ini_index_remove(struct ini_index *index, struct ini_node *node)
+{
+    size_t i, j, home;
+
+    if (index->slots == NULL) {
+        return;
+    }
+
+    for (i = node->hash & index->mask; index->slots[i].node != node; i = (i + 1) & index->mask) {
+        if (index->slots[i].node == NULL) {
+            return;
+        }
+    }
+
+    /* 后移删除: 把探测链上后面的元素往前挪, 不需要墓碑 */
+    for (j = i; ; ) {
+        j = (j + 1) & index->mask;
+        if (index->slots[j].node == NULL) {
+            break;
+        }
+
+        home = index->slots[j].hash & index->mask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+            continue;
+        }
+
+        index->slots[i] = index->slots[j];
+        i = j;
+    }
+    index->slots[i].node = NULL;
+    index->count--;
+}
+
+static void ini_index_release(struct ini_index *index)
+{
+    if (index->slots) {
+        free(index->slots);
+    }
+    index->slots = NULL;
+    index->mask = 0;
+    index->count = 0;
+}
+
 static void ini_config_release_section(struct ini_config *config, struct ini_section *section)
 {
+    ini_index_remove(&config->index, &section->node);
     list_del(&section->node.list);
-    rb_erase(&section->node.rb, &config->sections.rb);
+    if (!config->rb_deferred) {
+        rb_erase_cached(&section->node.rb, &config->sections.rb);
+    }
     if (section->section) {
         free(section->section);
     }
     free(section);
 }
 
-static void ini_config_release_tag(struct ini_section *section, struct ini_tag *tag)
+static void ini_config_release_tag(struct ini_config *config, struct ini_tag *tag)
 {
+    ini_index_remove(&config->index, &tag->node);
     list_del(&tag->node.list);
-    rb_erase(&tag->node.rb, &section->tags.rb);
+    if (!config->rb_deferred) {
+        rb_erase_cached(&tag->node.rb, &tag->node.owner->tags.rb);
+    }
     if (tag->value) {
         free(tag->value);
     }
-    free(tag->key);
     free(tag);
 }
 
@@ -185,35 +447,116 @@ static struct rb_node *ini_config_find(struct rb_root *proot, const void *new_va
     return NULL;
 }
 
-static int ini_section_rb_cmp(const void *value, const struct rb_node *rb)
+static inline const char *ini_node_name(const struct ini_node *node)
+{
+    return node->owner ? container_of(node, struct ini_tag, node)->key
+        : container_of(node, struct ini_section, node)->section;
+}
+
+static int ini_node_rb_cmp(const void *value, const struct rb_node *rb)
+{
+    return ini_strcmp(value, ini_node_name(rb_entry(rb, struct ini_node, rb)));
+}
+
+static void ini_head_insert(struct ini_head *head, struct ini_node *node)
+{
+    struct rb_node **new, *parent;
+
+    new = &head->rb.rb_root.rb_node;
+    parent = NULL;
+    ini_config_find(&head->rb.rb_root, ini_node_name(node), ini_node_rb_cmp, &new, &parent);
+    rb_link_node(&node->rb, parent, new);
+    rb_insert_color_cached(&node->rb, &head->rb,
+        parent == NULL || (new == &parent->rb_left && parent == head->rb.rb_leftmost));
+}
+
+static int ini_node_ptr_cmp(const void *a, const void *b)
+{
+    return ini_strcmp(ini_node_name(rb_entry(*(struct rb_node *const *)a, struct ini_node, rb)),
+        ini_node_name(rb_entry(*(struct rb_node *const *)b, struct ini_node, rb)));
+}
+
+/*
+ * 按链表重建红黑树: 链表已经有序(配置文件按顺序书写)时O(n)建树,
+ * 否则先排序再建树, 仍然省去了逐个插入时的旋转
+ */
+static void ini_head_build(struct ini_head *head)
 {
-    return ini_strcmp(value, rb_entry(rb, struct ini_section, node.rb)->section);
+    int sorted;
+    size_t i, n;
+    struct rb_node **nodes;
+    struct ini_node *node, *prev;
+
+    n = 0;
+    sorted = 1;
+    prev = NULL;
+    list_for_each_entry (node, &head->list, list) {
+        if (prev && ini_strcmp(ini_node_name(prev), ini_node_name(node)) >= 0) {
+            sorted = 0;
+        }
+        prev = node;
+        n++;
+    }
+
+    head->rb = RB_ROOT_CACHED;
+    if (n > 0 && (nodes = (struct rb_node **)malloc(n * sizeof(*nodes))) != NULL) {
+        i = 0;
+        list_for_each_entry (node, &head->list, list) {
+            nodes[i++] = &node->rb;
+        }
+        if (!sorted) {
+            qsort(nodes, n, sizeof(*nodes), ini_node_ptr_cmp);
+        }
+        rb_build_sorted_cached(&head->rb, nodes, n);
+        free(nodes);
+        return;
+    }
+
+    list_for_each_entry (node, &head->list, list) {
+        ini_head_insert(head, node);
+    }
 }
 
-static int ini_tag_rb_cmp(const void *value, const struct rb_node *rb)
+static void ini_config_defer_trees(struct ini_config *config)
 {
-    return ini_strcmp(value, rb_entry(rb, struct ini_tag, node.rb)->key);
+    config->rb_deferred = 1;
+}
+
+static void ini_config_build_trees(struct ini_config *config)
+{
+    struct ini_section *section;
+
+    if (!config->rb_deferred) {
+        return;
+    }
+
+    list_for_each_entry (section, &config->sections.list, node.list) {
+        ini_head_build(&section->tags);
+    }
+    ini_head_build(&config->sections);
+    config->rb_deferred = 0;
 }
 
 static struct ini_section *ini_config_find_section(struct ini_config *config, const char *name)
 {
     void *node;
 
-    node = ini_config_find(&config->sections.rb, name, ini_section_rb_cmp, NULL, NULL);
+    node = ini_index_lookup(&config->index, name, NULL);
     if (node) {
-        node = rb_entry(node, struct ini_section, node.rb);
+        node = container_of(node, struct ini_section, node);
     }
 
     return node;
 }
 
-static struct ini_tag *ini_config_find_tag(struct ini_section *section, const char *key)
+static struct ini_tag *ini_config_find_tag(struct ini_config *config, const char *section_name,
+    const char *key)
 {
     void *node;
 
-    node = ini_config_find(&section->tags.rb, key, ini_tag_rb_cmp, NULL, NULL);
+    node = ini_index_lookup(&config->index, section_name, key);
     if (node) {
-        node = rb_entry(node, struct ini_tag, node.rb);
+        node = container_of(node, struct ini_tag, node);
     }
 
     return node;
@@ -221,12 +564,11 @@ static struct ini_tag *ini_config_find_tag(struct ini_section *section, const ch
 
 static struct ini_section *ini_config_add_section(struct ini_config *config, const char *name)
 {
-    struct rb_node *node, **new, *parent;
     struct ini_section *section;
 
-    node = ini_config_find(&config->sections.rb, name, ini_section_rb_cmp, &new, &parent);
-    if (node != NULL) {
-        return rb_entry(node, struct ini_section, node.rb);
+    section = ini_config_find_section(config, name);
+    if (section != NULL) {
+        return section;
     }
 
     section = (struct ini_section *)malloc(sizeof(struct ini_section));
@@ -234,44 +576,58 @@ static struct ini_section *ini_config_add_section(struct ini_config *config, con
         return NULL;
     }
 
-    section->tags.rb = RB_ROOT;
+    section->tags.rb = RB_ROOT_CACHED;
     INIT_LIST_HEAD(&section->tags.list);
+    section->node.owner = NULL;
+    section->node.hash = ini_hash(name, NULL);
     if (name != NULL) {
-        list_add_tail(&section->node.list, &config->sections.list);
         section->section = strdup(name);
         if (section->section == NULL) {
             free(section);
             return NULL;
         }
     } else {
-        list_add(&section->node.list, &config->sections.list);
         section->section = NULL;
     }
-    rb_link_node(&section->node.rb, parent, new);
-    rb_insert_color(&section->node.rb, &config->sections.rb);
+
+    if (ini_index_insert(&config->index, &section->node) != 0) {
+        if (section->section) {
+            free(section->section);
+        }
+        free(section);
+        return NULL;
+    }
+
+    if (name != NULL) {
+        list_add_tail(&section->node.list, &config->sections.list);
+    } else {
+        list_add(&section->node.list, &config->sections.list);
+    }
+    if (!config->rb_deferred) {
+        ini_head_insert(&config->sections, &section->node);
+    }
 
     return section;
 }
 
 static struct ini_tag *ini_config_new_tag(const char *key, const char *value)
 {
+    size_t len;
     struct ini_tag *tag;
 
-    tag = (struct ini_tag *)malloc(sizeof(struct ini_tag));
+    /* 关键字创建后不再变化, 和节点分配在同一块内存中 */
+    len = strlen(key) + 1;
+    tag = (struct ini_tag *)malloc(sizeof(struct ini_tag) + len);
     if (tag == NULL) {
         return NULL;
     }
 
-    tag->key = strdup(key);
-    if (tag->key == NULL) {
-        free(tag);
-        return NULL;
-    }
+    tag->key = (char *)(tag + 1);
+    memcpy(tag->key, key, len);
 
     if (value) {
         tag->value = strdup(value);
         if (tag->value == NULL) {
-            free(tag->key);
             free(tag);
             return NULL;
         }
@@ -282,24 +638,33 @@ static struct ini_tag *ini_config_new_tag(const char *key, const char *value)
     return tag;
 }
 
-static struct ini_tag *ini_config_add_tag(struct ini_section *section, const char *key, const char *value)
+static struct ini_tag *ini_config_add_tag(struct ini_config *config, struct ini_section *section,
+    const char *key, const char *value)
 {
     struct ini_tag *tag;
-    struct rb_node *node, **new, *parent;
 
     if (section == NULL || strempty(key)) {
         return NULL;
     }
 
-    node = ini_config_find(&section->tags.rb, key, ini_tag_rb_cmp, &new, &parent);
-    if (node == NULL) {
+    tag = ini_config_find_tag(config, section->section, key);
+    if (tag == NULL) {
         if ((tag = ini_config_new_tag(key, value)) != NULL) {
+            tag->node.owner = section;
+            tag->node.hash = ini_hash(section->section, key);
+            if (ini_index_insert(&config->index, &tag->node) != 0) {
+                if (tag->value) {
+                    free(tag->value);
+                }
+                free(tag);
+                return NULL;
+            }
             list_add_tail(&tag->node.list, &section->tags.list);
-            rb_link_node(&tag->node.rb, parent, new);
-            rb_insert_color(&tag->node.rb, &section->tags.rb);
+            if (!config->rb_deferred) {
+                ini_head_insert(&section->tags, &tag->node);
+            }
         }
     } else {
-        tag = rb_entry(node, struct ini_tag, node.rb);
         if (ini_strcmp(tag->value, value) == 0) {
             return tag;
         }
@@ -310,7 +675,7 @@ static struct ini_tag *ini_config_add_tag(struct ini_section *section, const cha
         }
 
         if (value != NULL && (tag->value = strdup(value)) == NULL) {
-            ini_config_release_tag(section, tag);
+            ini_config_release_tag(config, tag);
             return NULL;
         }
     }
@@ -318,118 +683,697 @@ static struct ini_tag *ini_config_add_tag(struct ini_section *section, const cha
     return tag;
 }
 
-INI_CONFIG ini_config_create(const char *const file)
+/*
+ * 预编译的二进制镜像, 文件布局:
+ *   header | sections[nsections] | tags[ntags] | slots[nslots] | strings
+ * 所有偏移都相对于镜像起始地址, 镜像可以直接mmap后只读查询.
+ */
+#define INI_IMAGE_MAGIC     "INIIMG\0\0"
+#define INI_IMAGE_VERSION   1
+#define INI_IMAGE_NULL      0xffffffffU
+
+struct ini_image_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t nsections;
+    uint32_t ntags;
+    uint32_t nslots;
+    uint32_t strings_size;
+    uint32_t reserved;
+    uint64_t image_size;
+    uint64_t checksum;
+    uint64_t src_dev;
+    uint64_t src_ino;
+    uint64_t src_size;
+    int64_t  src_mtime_sec;
+    int64_t  src_mtime_nsec;
+};
+
+struct ini_image_section {
+    uint32_t name;
+    uint32_t first_tag;
+    uint32_t ntags;
+    uint32_t hash;
+};
+
+struct ini_image_tag {
+    uint32_t key;
+    uint32_t value;
+    uint32_t section;
+    uint32_t hash;
+};
+
+/* ref为0表示空槽, 否则为关键字下标加1 */
+struct ini_image_slot {
+    uint32_t hash;
+    uint32_t ref;
+};
+
+#define ini_image_sections(h)   ((const struct ini_image_section *)((const char *)(h) + sizeof(*(h))))
+#define ini_image_tags(h)       ((const struct ini_image_tag *)(ini_image_sections(h) + (h)->nsections))
+#define ini_image_slots(h)      ((const struct ini_image_slot *)(ini_image_tags(h) + (h)->ntags))
+#define ini_image_strings(h)    ((const char *)(ini_image_slots(h) + (h)->nslots))
+
+static inline const char *ini_image_str(const struct ini_image_header *h, uint32_t off)
 {
-    FILE *fp;
-    struct ini_config *config;
-    struct ini_section *section;
-    union ini_parse_block ipb;
-    char line[INI_LINE_MAXSIZE];
+    return off == INI_IMAGE_NULL ? NULL : ini_image_strings(h) + off;
+}
 
-    if (file == NULL) {
-        return NULL;
+static uint64_t ini_image_checksum(const struct ini_image_header *h)
+{
+    size_t i;
+    uint64_t sum;
+    const unsigned char *p;
+
+    sum = 14695981039346656037ULL;
+    p = (const unsigned char *)(h + 1);
+    for (i = 0; i < h->image_size - sizeof(*h); ++i) {
+        sum = (sum ^ p[i]) * 1099511628211ULL;
     }
 
-    config = (INI_CONFIG )malloc(sizeof(*config));
-    if (config == NULL) {
-        return NULL;
-    }
+    return sum;
+}
 
-    INIT_LIST_HEAD(&config->sections.list);
-    config->sections.rb = RB_ROOT;
-    config->file = strdup(file);
-    fp = fopen(file, "r");
-    if (fp == NULL) {
-        goto err;
-    }
+static const char *ini_image_get(const struct ini_image_header *h, const char *section,
+    const char *key)
+{
+    size_t i, mask;
+    unsigned int hash;
+    const struct ini_image_tag *tag;
+    const struct ini_image_slot *slots;
 
-    if ((section = ini_config_add_section(config, NULL)) == NULL) {
-        goto err;
+    if (h->nslots == 0) {
+        return NULL;
     }
 
-    while (fgets(line, sizeof(line) - 1, fp) != NULL) {
-        switch (ini_parse_line(line, &ipb)) {
-        case INI_CONFIG_SECTION:
-            if ((section = ini_config_add_section(config, ipb.section)) == NULL) {
-                goto err;
-            }
-            break;
-        case INI_CONFIG_KEY_VALUE:
-            if (ini_config_add_tag(section, ipb.kv.key, ipb.kv.value) == NULL) {
-                goto err;
-            }
-            break;
-        default:
-            break;
+    hash = ini_hash(section, key);
+    mask = h->nslots - 1;
+    slots = ini_image_slots(h);
+    for (i = hash & mask; slots[i].ref; i = (i + 1) & mask) {
+        if (slots[i].hash != hash) {
+            continue;
+        }
+
+        tag = ini_image_tags(h) + slots[i].ref - 1;
+        if (strcmp(ini_image_str(h, tag->key), key) == 0
+                && ini_strcmp(ini_image_str(h, ini_image_sections(h)[tag->section].name), section) == 0) {
+            return ini_image_str(h, tag->value);
         }
     }
-    fclose(fp);
 
-    return config;
-err:
-    ini_config_release(config);
     return NULL;
 }
 
-int ini_config_set(INI_CONFIG config, const char *section_name,
-    const char *key, const char *value)
+static void ini_image_unmap(struct ini_config *config)
 {
-    int status;
-    struct ini_tag *tag;
-    struct ini_section *section;
-
-    status = 0;
-    section = ini_config_find_section((struct ini_config *)config, section_name);
-    if (section == NULL) {
-        status = 1;
-        section = ini_config_add_section((struct ini_config *)config, section_name);
-        if (section == NULL) {
-            return -1;
-        }
-    }
-
-    tag = ini_config_add_tag(section, key, value);
-    if (tag == NULL && status) {
-        ini_config_release_section((struct ini_config *)config, section);
-        return -1;
+    if (config->image) {
+        munmap((void *)config->image, config->image->image_size);
+        config->image = NULL;
     }
+    config->image_active = 0;
+}
 
-    return 0;
+static inline int ini_image_str_valid(const struct ini_image_header *h, uint32_t off, int nullable)
+{
+    return off == INI_IMAGE_NULL ? nullable : off < h->strings_size;
 }
 
-const char *ini_config_get(INI_CONFIG config, const char *section_name,
-    const char *key, const char *default_value)
+/*
+ * 查询时不再检查下标和偏移, 映射时一次性全部检查: 字符串区以'\0'结尾, 所有偏移落在
+ * 字符串区内, 下标不超过对应的个数, 散列表至少有一个空槽, 否则查找不会结束.
+ */
+static int ini_image_valid(const struct ini_image_header *h)
 {
-    struct ini_section *section;
-    struct ini_tag *tag;
+    uint32_t i, empty;
+    const struct ini_image_tag *tag;
+    const struct ini_image_slot *slot;
+    const struct ini_image_section *isec;
 
-    if (key == NULL) {
-        return NULL;
+    if (h->strings_size && ini_image_strings(h)[h->strings_size - 1] != '\0') {
+        return 0;
     }
 
-    section = ini_config_find_section((struct ini_config *)config, section_name);
-    if (section == NULL) {
-        return default_value;
+    isec = ini_image_sections(h);
+    for (i = 0; i < h->nsections; ++i, ++isec) {
+        if (!ini_image_str_valid(h, isec->name, 1)
+                || (uint64_t)isec->first_tag + isec->ntags > h->ntags) {
+            return 0;
+        }
     }
 
-    tag = ini_config_find_tag(section, key);
-    if (tag == NULL || tag->value == NULL) {
-        return default_value;
+    tag = ini_image_tags(h);
+    for (i = 0; i < h->ntags; ++i, ++tag) {
+        if (!ini_image_str_valid(h, tag->key, 0) || !ini_image_str_valid(h, tag->value, 1)
+                || tag->section >= h->nsections) {
+            return 0;
+        }
     }
 
-    return tag->value;
+    empty = 0;
+    slot = ini_image_slots(h);
+    for (i = 0; i < h->nslots; ++i, ++slot) {
+        if (slot->ref > h->ntags) {
+            return 0;
+        }
+        empty += slot->ref == 0;
+    }
+
+    return h->nslots == 0 ? h->ntags == 0 : empty > 0;
 }
 
-static int ini_config_clear_section_node(struct ini_section *section)
+static const struct ini_image_header *ini_image_map(const char *cache, const struct stat *src)
 {
-    struct ini_tag *tag, *tmp_tag;
+    int fd;
+    struct stat st;
+    uint64_t size;
+    struct ini_image_header *h;
 
-    if (section == NULL) {
-        return -1;
+    if ((fd = open(cache, O_RDONLY | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*h)) {
+        close(fd);
+        return NULL;
+    }
+
+    h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        return NULL;
+    }
+
+    size = sizeof(*h) + (uint64_t)h->nsections * sizeof(struct ini_image_section)
+        + (uint64_t)h->ntags * sizeof(struct ini_image_tag)
+        + (uint64_t)h->nslots * sizeof(struct ini_image_slot) + h->strings_size;
+    if (memcmp(h->magic, INI_IMAGE_MAGIC, sizeof(h->magic)) != 0
+            || h->version != INI_IMAGE_VERSION
+            || h->image_size != (uint64_t)st.st_size || size != h->image_size
+            || (h->nslots & (h->nslots - 1)) != 0
+            || h->src_dev != (uint64_t)src->st_dev || h->src_ino != (uint64_t)src->st_ino
+            || h->src_size != (uint64_t)src->st_size
+            || h->src_mtime_sec != (int64_t)src->st_mtim.tv_sec
+            || h->src_mtime_nsec != (int64_t)src->st_mtim.tv_nsec
+            || h->checksum != ini_image_checksum(h) || !ini_image_valid(h)) {
+        munmap(h, st.st_size);
+        return NULL;
+    }
+
+    return h;
+}
+
+static uint32_t ini_image_add_str(char *strings, size_t *off, const char *str)
+{
+    uint32_t ret;
+    size_t len;
+
+    if (str == NULL) {
+        return INI_IMAGE_NULL;
+    }
+
+    ret = (uint32_t)*off;
+    len = strlen(str) + 1;
+    memcpy(strings + *off, str, len);
+    *off += len;
+
+    return ret;
+}
+
+static int ini_image_write(struct ini_config *config, const char *cache, const struct stat *src)
+{
+    int fd, ret;
+    size_t i, nslots, strings_off, size, mask;
+    uint32_t nsections, ntags;
+    struct ini_tag *tag;
+    struct ini_section *section;
+    struct ini_image_header *h;
+    struct ini_image_section *isec;
+    struct ini_image_tag *itag;
+    struct ini_image_slot *slots;
+    char *strings, tmp[PATH_MAX];
+
+    nsections = ntags = 0;
+    strings_off = 0;
+    list_for_each_entry(section, &config->sections.list, node.list) {
+        nsections++;
+        strings_off += section->section ? strlen(section->section) + 1 : 0;
+        list_for_each_entry(tag, &section->tags.list, node.list) {
+            ntags++;
+            strings_off += strlen(tag->key) + 1 + (tag->value ? strlen(tag->value) + 1 : 0);
+        }
+    }
+
+    for (nslots = ntags ? 8 : 0; nslots && nslots * 3 < (size_t)ntags * 4; nslots <<= 1) {
+        continue;
+    }
+    size = sizeof(*h) + nsections * sizeof(*isec) + ntags * sizeof(*itag)
+        + nslots * sizeof(*slots) + strings_off;
+    if (strings_off > INI_IMAGE_NULL || (h = calloc(1, size)) == NULL) {
+        return -1;
+    }
+
+    memcpy(h->magic, INI_IMAGE_MAGIC, sizeof(h->magic));
+    h->version = INI_IMAGE_VERSION;
+    h->nsections = nsections;
+    h->ntags = ntags;
+    h->nslots = (uint32_t)nslots;
+    h->strings_size = (uint32_t)strings_off;
+    h->image_size = size;
+    h->src_dev = src->st_dev;
+    h->src_ino = src->st_ino;
+    h->src_size = src->st_size;
+    h->src_mtime_sec = src->st_mtim.tv_sec;
+    h->src_mtime_nsec = src->st_mtim.tv_nsec;
+
+    isec = (struct ini_image_section *)ini_image_sections(h);
+    itag = (struct ini_image_tag *)ini_image_tags(h);
+    slots = (struct ini_image_slot *)ini_image_slots(h);
+    strings = (char *)ini_image_strings(h);
+    mask = nslots - 1;
+    strings_off = 0;
+    ntags = 0;
+    list_for_each_entry(section, &config->sections.list, node.list) {
+        isec->name = ini_image_add_str(strings, &strings_off, section->section);
+        isec->first_tag = ntags;
+        isec->hash = section->node.hash;
+        list_for_each_entry(tag, &section->tags.list, node.list) {
+            itag->key = ini_image_add_str(strings, &strings_off, tag->key);
+            itag->value = ini_image_add_str(strings, &strings_off, tag->value);
+            itag->section = (uint32_t)(isec - ini_image_sections(h));
+            itag->hash = tag->node.hash;
+            for (i = itag->hash & mask; slots[i].ref; i = (i + 1) & mask) {
+                continue;
+            }
+            slots[i].hash = itag->hash;
+            slots[i].ref = ++ntags;
+            itag++;
+            isec->ntags++;
+        }
+        isec++;
+    }
+    h->checksum = ini_image_checksum(h);
+
+    /* 先写临时文件再rename, 其他进程不会读到写了一半的镜像 */
+    ret = -1;
+    snprintf(tmp, sizeof(tmp), "%s.%d", cache, (int)getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0) {
+        if (full_write(fd, h, size) == (ssize_t)size && rename(tmp, cache) == 0) {
+            ret = 0;
+        }
+        close(fd);
+        if (ret != 0) {
+            unlink(tmp);
+        }
+    }
+    free(h);
+
+    return ret;
+}
+
+static int ini_image_expand(struct ini_config *config, const struct ini_image_header *h)
+{
+    int ret;
+    uint32_t i, j;
+    struct ini_section *section;
+    const struct ini_image_tag *tag;
+    const struct ini_image_section *isec;
+
+    ret = 0;
+    ini_config_defer_trees(config);
+    isec = ini_image_sections(h);
+    for (i = 0; i < h->nsections && ret == 0; ++i, ++isec) {
+        if ((section = ini_config_add_section(config, ini_image_str(h, isec->name))) == NULL) {
+            ret = -1;
+            break;
+        }
+
+        tag = ini_image_tags(h) + isec->first_tag;
+        for (j = 0; j < isec->ntags; ++j, ++tag) {
+            if (ini_config_add_tag(config, section, ini_image_str(h, tag->key),
+                    ini_image_str(h, tag->value)) == NULL) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    ini_config_build_trees(config);
+
+    return ret;
+}
+
+/* 把镜像中的内容展开到链表/红黑树中, 修改或遍历配置前调用 */
+static int ini_config_materialize(struct ini_config *config)
+{
+    if (!config->image_active) {
+        return 0;
+    }
+
+    /* 已经通过ini_config_get返回的指针仍指向镜像, 镜像保留到ini_config_release */
+    config->image_active = 0;
+
+    return ini_image_expand(config, config->image);
+}
+
+static int ini_config_load(struct ini_config *config, FILE *fp)
+{
+    int ret;
+    char *buf, *tmp, *line, *end;
+    struct stat st;
+    ssize_t n;
+    size_t size, cap;
+    struct ini_section *section;
+    union ini_parse_block ipb;
+
+    /*
+     * 整个文件读到一块缓冲区中, 就地切分, 不再逐行fgets. 文件大小只是初始的容量:
+     * 管道和procfs的大小是0, 文件也可能在fstat之后变长, 都要读到结尾
+     */
+    if (fstat(fileno(fp), &st) != 0) {
+        return -1;
+    }
+
+    cap = st.st_size > 0 ? (size_t)st.st_size + 1 : BUFF_SIZE;
+    if ((buf = (char *)malloc(cap)) == NULL) {
+        return -1;
+    }
+
+    for (size = 0; ; size += n) {
+        if (size + 1 == cap) {
+            if ((tmp = (char *)realloc(buf, cap * 2)) == NULL) {
+                free(buf);
+                return -1;
+            }
+            buf = tmp;
+            cap *= 2;
+        }
+
+        if ((n = full_read(fileno(fp), buf + size, cap - size - 1)) < 0) {
+            free(buf);
+            return -1;
+        }
+
+        if (n == 0) {
+            break;
+        }
+    }
+    buf[size] = '\0';
+
+    /* 按文件顺序书写的节和关键字可以O(n)建树 */
+    ini_config_defer_trees(config);
+    ret = 0;
+    if ((section = ini_config_add_section(config, NULL)) == NULL) {
+        ret = -1;
+    }
+
+    end = buf + size;
+    for (line = buf; line < end && ret == 0; ) {
+        switch (ini_parse_line(line, end, &ipb, &line)) {
+        case INI_CONFIG_SECTION:
+            if ((section = ini_config_add_section(config, ipb.section)) == NULL) {
+                ret = -1;
+            }
+            break;
+        case INI_CONFIG_KEY_VALUE:
+            if (ini_config_add_tag(config, section, ipb.kv.key, ipb.kv.value) == NULL) {
+                ret = -1;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    free(buf);
+    ini_config_build_trees(config);
+
+    return ret;
+}
+
+static struct ini_config *ini_config_alloc(const char *file)
+{
+    struct ini_config *config;
+
+    config = (struct ini_config *)malloc(sizeof(*config));
+    if (config == NULL) {
+        return NULL;
+    }
+
+    INIT_LIST_HEAD(&config->sections.list);
+    config->sections.rb = RB_ROOT_CACHED;
+    config->index.slots = NULL;
+    config->index.mask = 0;
+    config->index.count = 0;
+    config->image = NULL;
+    config->image_active = 0;
+    config->lock_fd = -1;
+    config->rb_deferred = 0;
+    config->file = file ? strdup(file) : NULL;
+
+    return config;
+}
+
+INI_CONFIG ini_config_create_cached(const char *const file, const char *const cache)
+{
+    int ret, use_cache;
+    FILE *fp;
+    struct stat st;
+    struct ini_config *config;
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    config = ini_config_alloc(file);
+    if (config == NULL) {
+        return NULL;
+    }
+
+    fp = fopen(file, "r");
+    if (fp == NULL) {
+        goto err;
+    }
+
+    /* 取不到源文件的状态时既不能判断镜像是否过期, 也不能写新的镜像 */
+    use_cache = cache != NULL && fstat(fileno(fp), &st) == 0;
+    if (use_cache && (config->image = ini_image_map(cache, &st)) != NULL) {
+        config->image_active = 1;
+        fclose(fp);
+        return config;
+    }
+
+    ret = ini_config_load(config, fp);
+    fclose(fp);
+    if (ret != 0) {
+        goto err;
+    }
+
+    if (use_cache) {
+        ini_image_write(config, cache, &st);
+    }
+
+    return config;
+err:
+    ini_config_release(config);
+    return NULL;
+}
+
+INI_CONFIG ini_config_create(const char *const file)
+{
+    return ini_config_create_cached(file, NULL);
+}
+
+INI_CONFIG ini_config_dup(INI_CONFIG config)
+{
+    struct ini_tag *tag;
+    struct ini_config *src, *dst;
+    struct ini_section *section, *new_section;
+
+    src = (struct ini_config *)config;
+    if (src == NULL || (dst = ini_config_alloc(src->file)) == NULL) {
+        return NULL;
+    }
+
+    /* 不能展开源配置: 源配置可能正被其他线程只读访问 */
+    if (src->image_active) {
+        if (ini_image_expand(dst, src->image) != 0) {
+            goto err;
+        }
+        return dst;
+    }
+
+    ini_config_defer_trees(dst);
+    list_for_each_entry (section, &src->sections.list, node.list) {
+        if ((new_section = ini_config_add_section(dst, section->section)) == NULL) {
+            goto err;
+        }
+
+        list_for_each_entry (tag, &section->tags.list, node.list) {
+            if (ini_config_add_tag(dst, new_section, tag->key, tag->value) == NULL) {
+                goto err;
+            }
+        }
+    }
+    ini_config_build_trees(dst);
+
+    return dst;
+err:
+    ini_config_build_trees(dst);
+    ini_config_release(dst);
+    return NULL;
+}
+
+int ini_config_set(INI_CONFIG config, const char *section_name,
+    const char *key, const char *value)
+{
+    int status;
+    struct ini_tag *tag;
+    struct ini_section *section;
+
+    if (ini_config_materialize((struct ini_config *)config) != 0) {
+        return -1;
+    }
+
+    status = 0;
+    section = ini_config_find_section((struct ini_config *)config, section_name);
+    if (section == NULL) {
+        status = 1;
+        section = ini_config_add_section((struct ini_config *)config, section_name);
+        if (section == NULL) {
+            return -1;
+        }
+    }
+
+    tag = ini_config_add_tag((struct ini_config *)config, section, key, value);
+    if (tag == NULL && status) {
+        ini_config_release_section((struct ini_config *)config, section);
+        return -1;
+    }
+
+    return 0;
+}
+
+const char *ini_config_get(INI_CONFIG config, const char *section_name,
+    const char *key, const char *default_value)
+{
+    const char *value;
+    struct ini_tag *tag;
+
+    if (key == NULL) {
+        return NULL;
+    }
+
+    if (((struct ini_config *)config)->image_active) {
+        value = ini_image_get(((struct ini_config *)config)->image, section_name, key);
+        return value ? value : default_value;
+    }
+
+    tag = ini_config_find_tag((struct ini_config *)config, section_name, key);
+    if (tag == NULL || tag->value == NULL) {
+        return default_value;
+    }
+
+    return tag->value;
+}
+
+/* 两节的关键字按名字排序后逐个比较 */
+static int ini_config_same_tags(const struct ini_section *a, const struct ini_section *b)
+{
+    const struct rb_node *x, *y;
+    const struct ini_tag *ta, *tb;
+
+    x = rb_first_cached(&a->tags.rb);
+    y = rb_first_cached(&b->tags.rb);
+    for (; x && y; x = rb_next(x), y = rb_next(y)) {
+        ta = rb_entry(x, struct ini_tag, node.rb);
+        tb = rb_entry(y, struct ini_tag, node.rb);
+        if (ini_strcmp(ta->key, tb->key) != 0 || ini_strcmp(ta->value, tb->value) != 0) {
+            return 0;
+        }
+    }
+
+    return x == NULL && y == NULL;
+}
+
+/* 两份配置的节都按名字排序, 从最左的节开始同步遍历, 一趟找出新增, 删除和变化的节 */
+static int ini_config_diff_nodes(struct ini_config *old, struct ini_config *new,
+    void (*changed)(const char *section, void *arg), void *arg)
+{
+    int n, cmp;
+    const char *name;
+    struct rb_node *a, *b;
+    struct ini_section *old_section, *section;
+
+    n = 0;
+    a = rb_first_cached(&old->sections.rb);
+    b = rb_first_cached(&new->sections.rb);
+    while (a || b) {
+        old_section = a ? rb_entry(a, struct ini_section, node.rb) : NULL;
+        section = b ? rb_entry(b, struct ini_section, node.rb) : NULL;
+        if (section == NULL) {
+            cmp = -1;
+        } else if (old_section == NULL) {
+            cmp = 1;
+        } else {
+            cmp = ini_strcmp(old_section->section, section->section);
+        }
+
+        if (cmp < 0) {
+            name = old_section->section;
+            a = rb_next(a);
+        } else if (cmp > 0) {
+            name = section->section;
+            b = rb_next(b);
+        } else {
+            a = rb_next(a);
+            b = rb_next(b);
+            if (ini_config_same_tags(old_section, section)) {
+                continue;
+            }
+            name = section->section;
+        }
+
+        n++;
+        if (changed) {
+            changed(name, arg);
+        }
+    }
+
+    return n;
+}
+
+int ini_config_diff(INI_CONFIG old, INI_CONFIG new,
+    void (*changed)(const char *section, void *arg), void *arg)
+{
+    int n;
+    struct ini_config *a, *b;
+
+    if (old == NULL || new == NULL) {
+        return -1;
+    }
+
+    /* 镜像方式加载的配置可能正被其他线程读取, 在副本上比较 */
+    a = ((struct ini_config *)old)->image_active ? ini_config_dup(old) : old;
+    b = ((struct ini_config *)new)->image_active ? ini_config_dup(new) : new;
+    n = (a && b) ? ini_config_diff_nodes(a, b, changed, arg) : -1;
+    if (a && a != old) {
+        ini_config_release(a);
+    }
+    if (b && b != new) {
+        ini_config_release(b);
+    }
+
+    return n;
+}
+
+static int ini_config_clear_section_node(struct ini_config *config, struct ini_section *section)
+{
+    struct ini_tag *tag, *tmp_tag;
+
+    if (section == NULL) {
+        return -1;
     }
 
     list_for_each_entry_safe(tag, tmp_tag, &section->tags.list, node.list) {
-        ini_config_release_tag(section, tag);
+        ini_config_release_tag(config, tag);
     }
 
     return 0;
@@ -437,12 +1381,17 @@ static int ini_config_clear_section_node(struct ini_section *section)
 
 int ini_config_clear_section(INI_CONFIG config, const char *section)
 {
-    return ini_config_clear_section_node(ini_config_find_section((struct ini_config *)config, section));
+    if (ini_config_materialize((struct ini_config *)config) != 0) {
+        return -1;
+    }
+
+    return ini_config_clear_section_node((struct ini_config *)config,
+            ini_config_find_section((struct ini_config *)config, section));
 }
 
 static int ini_config_erase_section_node(struct ini_config *config, struct ini_section *section)
 {
-    if (ini_config_clear_section_node(section) == -1) {
+    if (ini_config_clear_section_node(config, section) == -1) {
         return -1;
     }
 
@@ -453,27 +1402,29 @@ static int ini_config_erase_section_node(struct ini_config *config, struct ini_s
 
 int ini_config_erase_section(INI_CONFIG config, const char *section)
 {
+    if (ini_config_materialize((struct ini_config *)config) != 0) {
+        return -1;
+    }
+
     return ini_config_erase_section_node((struct ini_config *)config,
             ini_config_find_section((struct ini_config *)config, section));
 }
 
 int ini_config_erase_key(INI_CONFIG config, const char *section_name, const char *key)
 {
-    struct ini_section *section;
     struct ini_tag *tag;
 
     if (config == NULL || key == NULL)
         return -1;
 
-    section = ini_config_find_section((struct ini_config *)config, section_name);
-    if (section == NULL)
+    if (ini_config_materialize((struct ini_config *)config) != 0)
         return -1;
 
-    tag = ini_config_find_tag(section, key);
+    tag = ini_config_find_tag((struct ini_config *)config, section_name, key);
     if (tag == NULL)
         return -1;
 
-    ini_config_release_tag(section, tag);
+    ini_config_release_tag((struct ini_config *)config, tag);
 
     return 0;
 }
@@ -483,7 +1434,8 @@ int ini_config_save2filestream(INI_CONFIG config, FILE *fp)
     struct ini_tag *tag;
     struct ini_section *section;
 
-    if (config == NULL || fp == NULL) {
+    if (config == NULL || fp == NULL
+            || ini_config_materialize((struct ini_config *)config) != 0) {
         return -1;
     }
 
@@ -505,21 +1457,137 @@ int ini_config_save2filestream(INI_CONFIG config, FILE *fp)
     return 0;
 }
 
+int ini_config_clear(INI_CONFIG config)
+{
+    struct ini_section *section, *temp_section;
+
+    if (config == NULL) {
+        return -1;
+    }
+
+    ((struct ini_config *)config)->image_active = 0;
+    list_for_each_entry_safe(section, temp_section, &((struct ini_config *)config)->sections.list, node.list) {
+        ini_config_erase_section_node((struct ini_config *)config, section);
+    }
+    ((struct ini_config *)config)->sections.rb = RB_ROOT_CACHED;
+
+    return 0;
+}
+
+static char *ini_config_serialize(struct ini_config *config, size_t *psize)
+{
+    char *buf, *p;
+    size_t size, len;
+    struct ini_tag *tag;
+    struct ini_section *section;
+
+    if (ini_config_materialize(config) != 0) {
+        return NULL;
+    }
+
+    size = 0;
+    list_for_each_entry (section, &config->sections.list, node.list) {
+        if (section->section) {
+            size += strlen(section->section) + 3;
+        }
+
+        list_for_each_entry (tag, &section->tags.list, node.list) {
+            size += strlen(tag->key) + 3 + (tag->value ? strlen(tag->value) + 1 : 0);
+        }
+    }
+
+    if ((buf = (char *)malloc(size + 1)) == NULL) {
+        return NULL;
+    }
+
+    p = buf;
+    list_for_each_entry (section, &config->sections.list, node.list) {
+        if (section->section) {
+            len = strlen(section->section);
+            *p++ = '[';
+            memcpy(p, section->section, len);
+            p += len;
+            *p++ = ']';
+            *p++ = '\n';
+        }
+
+        list_for_each_entry (tag, &section->tags.list, node.list) {
+            len = strlen(tag->key);
+            memcpy(p, tag->key, len);
+            p += len;
+            memcpy(p, " =", 2);
+            p += 2;
+            if (tag->value) {
+                *p++ = ' ';
+                len = strlen(tag->value);
+                memcpy(p, tag->value, len);
+                p += len;
+            }
+            *p++ = '\n';
+        }
+    }
+    *p = '\0';
+    *psize = size;
+
+    return buf;
+}
+
+/* 写临时文件 -> fsync -> rename, 读者要么看到旧文件, 要么看到完整的新文件 */
+static int ini_config_write_atomic(const char *file, const char *buf, size_t size)
+{
+    int fd, dirfd;
+    struct stat st;
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+
+    if (realpath(file, path) == NULL) {
+        if (strlen(file) >= sizeof(path)) {
+            return -1;
+        }
+        strcpy(path, file);
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0) {
+        return -1;
+    }
+
+    fchmod(fd, stat(path, &st) == 0 ? (st.st_mode & 07777) : 0644);
+    if (full_write(fd, buf, size) != (ssize_t)size || fsync(fd) != 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    if ((dirfd = open(dirname(tmp), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+
+    return 0;
+}
+
 int ini_config_saveas(INI_CONFIG config, const char *file)
 {
     int ret;
-    FILE *fp;
+    char *buf;
+    size_t size;
 
-    if (file_exist(file) && truncate(file, 0) != 0) {
-        unlink(file);
+    if (config == NULL || file == NULL) {
+        return -1;
     }
 
-    fp = fopen(file, "w");
-    if (fp == NULL)
+    if ((buf = ini_config_serialize((struct ini_config *)config, &size)) == NULL) {
         return -1;
+    }
 
-    ret = ini_config_save2filestream(config, fp);
-    fclose(fp);
+    ret = ini_config_write_atomic(file, buf, size);
+    free(buf);
 
     return ret;
 }
@@ -529,28 +1597,106 @@ int ini_config_save(INI_CONFIG config)
     return ini_config_saveas(config, ((struct ini_config *)config)->file);
 }
 
-int ini_config_clear(INI_CONFIG config)
+static int ini_config_reload(struct ini_config *config)
 {
-    struct ini_section *section, *temp_section;
+    int ret;
+    FILE *fp;
 
-    if (config == NULL) {
+    if ((fp = fopen(config->file, "r")) == NULL) {
         return -1;
     }
 
-    list_for_each_entry_safe(section, temp_section, &((struct ini_config *)config)->sections.list, node.list) {
-        ini_config_erase_section_node((struct ini_config *)config, section);
+    ini_config_clear(config);
+    ret = ini_config_load(config, fp);
+    fclose(fp);
+
+    return ret;
+}
+
+static void ini_config_unlock(struct ini_config *config)
+{
+    if (config->lock_fd >= 0) {
+        flock(config->lock_fd, LOCK_UN);
+        close(config->lock_fd);
+        config->lock_fd = -1;
+    }
+}
+
+int ini_config_begin(INI_CONFIG config)
+{
+    char lock[PATH_MAX];
+    struct ini_config *c;
+
+    c = (struct ini_config *)config;
+    if (c == NULL || c->lock_fd >= 0) {
+        return -1;
+    }
+
+    snprintf(lock, sizeof(lock), "%s.lock", c->file);
+    if ((c->lock_fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        return -1;
+    }
+
+    while (flock(c->lock_fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            ini_config_unlock(c);
+            return -1;
+        }
+    }
+
+    /* 其他进程可能在我们加载之后提交过, 在锁内重新读取最新内容 */
+    if (file_exist(c->file) && ini_config_reload(c) != 0) {
+        ini_config_unlock(c);
+        return -1;
     }
-    ((struct ini_config *)config)->sections.rb = RB_ROOT;
 
     return 0;
 }
 
+int ini_config_commit(INI_CONFIG config)
+{
+    int ret;
+    struct ini_config *c;
+
+    c = (struct ini_config *)config;
+    if (c == NULL || c->lock_fd < 0) {
+        return -1;
+    }
+
+    ret = ini_config_save(config);
+    ini_config_unlock(c);
+
+    return ret;
+}
+
+int ini_config_rollback(INI_CONFIG config)
+{
+    int ret;
+    struct ini_config *c;
+
+    c = (struct ini_config *)config;
+    if (c == NULL || c->lock_fd < 0) {
+        return -1;
+    }
+
+    ret = file_exist(c->file) ? ini_config_reload(c) : ini_config_clear(config);
+    ini_config_unlock(c);
+
+    return ret;
+}
+
 void ini_config_release(INI_CONFIG config)
 {
+    if (config) {
+        ini_config_unlock((struct ini_config *)config);
+    }
+
     if (ini_config_clear(config) == 0) {
         if (((struct ini_config *)config)->file) {
             free(((struct ini_config *)config)->file);
         }
+        ini_index_release(&((struct ini_config *)config)->index);
+        ini_image_unmap((struct ini_config *)config);
 
         free(config);
     }
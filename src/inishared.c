@@ -0,0 +1,402 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "iniparser.h"
+#include "inishared.h"
+
+struct ini_section_gen {
+    char *section;
+    unsigned long generation;
+};
+
+/* 版本发布后不再修改, 节的代数表按节名排序 */
+struct ini_version {
+    INI_CONFIG config;
+    unsigned long refs;
+    unsigned long generation;
+    size_t nsections;
+    struct ini_section_gen *sections;
+};
+
+/*
+ * 读者在读取current并增加版本引用计数期间, 在readers[epoch & 1]上登记.
+ * 写者替换current之后依次翻转两次epoch并等待对应的计数清零, 此后不会再有
+ * 读者拿着旧指针还没来得及增加引用计数, 可以安全地放掉发布时持有的引用.
+ */
+struct ini_shared {
+    struct ini_version *current;
+    unsigned long readers[2];
+    unsigned long epoch;
+    unsigned long generation;
+    pthread_mutex_t lock;
+};
+
+struct ini_changes {
+    size_t n;
+    size_t size;
+    struct ini_section_gen *sections;
+    unsigned long generation;
+    int failed;
+};
+
+static struct ini_version *ini_version_new(INI_CONFIG config)
+{
+    struct ini_version *version;
+
+    version = (struct ini_version *)malloc(sizeof(*version));
+    if (version == NULL) {
+        return NULL;
+    }
+
+    version->config = config;
+    version->refs = 1;
+    version->generation = 1;
+    version->nsections = 0;
+    version->sections = NULL;
+
+    return version;
+}
+
+static void ini_section_gen_free(struct ini_section_gen *sections, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        if (sections[i].section) {
+            free(sections[i].section);
+        }
+    }
+    if (sections) {
+        free(sections);
+    }
+}
+
+static void ini_version_put(struct ini_version *version)
+{
+    if (__atomic_sub_fetch(&version->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        ini_config_release(version->config);
+        ini_section_gen_free(version->sections, version->nsections);
+        free(version);
+    }
+}
+
+static int ini_section_cmp(const char *a, const char *b)
+{
+    if (a == NULL || *a == '\0') {
+        return (b == NULL || *b == '\0') ? 0 : -1;
+    } else if (b == NULL || *b == '\0') {
+        return 1;
+    }
+
+    return strcmp(a, b);
+}
+
+static int ini_section_gen_cmp(const void *a, const void *b)
+{
+    return ini_section_cmp(((const struct ini_section_gen *)a)->section,
+        ((const struct ini_section_gen *)b)->section);
+}
+
+static const struct ini_section_gen *ini_version_find_section(const struct ini_version *version,
+    const char *section)
+{
+    struct ini_section_gen key;
+
+    if (version->nsections == 0) {
+        return NULL;
+    }
+
+    key.section = (char *)section;
+    return bsearch(&key, version->sections, version->nsections, sizeof(key), ini_section_gen_cmp);
+}
+
+static int ini_section_gen_add(struct ini_changes *changes, const char *section,
+    unsigned long generation)
+{
+    size_t size;
+    struct ini_section_gen *sections;
+
+    if (changes->n == changes->size) {
+        size = changes->size ? changes->size * 2 : 16;
+        sections = realloc(changes->sections, size * sizeof(*sections));
+        if (sections == NULL) {
+            return -1;
+        }
+        changes->sections = sections;
+        changes->size = size;
+    }
+
+    if (section == NULL) {
+        changes->sections[changes->n].section = NULL;
+    } else if ((changes->sections[changes->n].section = strdup(section)) == NULL) {
+        return -1;
+    }
+    changes->sections[changes->n++].generation = generation;
+
+    return 0;
+}
+
+static void ini_shared_changed(const char *section, void *arg)
+{
+    struct ini_changes *changes;
+
+    changes = (struct ini_changes *)arg;
+    if (!changes->failed && ini_section_gen_add(changes, section, changes->generation) != 0) {
+        changes->failed = 1;
+    }
+}
+
+/*
+ * 和当前版本比较, 生成新版本的代数表: 没有变化的节沿用旧代数, 变化的节
+ * (包括被删除的节)使用新的全局代数. 没有任何变化时返回0.
+ */
+static int ini_version_track(struct ini_version *version, const struct ini_version *old)
+{
+    int n;
+    size_t i;
+    struct ini_changes changes;
+
+    memset(&changes, 0, sizeof(changes));
+    changes.generation = old->generation + 1;
+    n = ini_config_diff(old->config, version->config, ini_shared_changed, &changes);
+    if (n < 0 || changes.failed) {
+        ini_section_gen_free(changes.sections, changes.n);
+        return -1;
+    } else if (n == 0) {
+        ini_section_gen_free(changes.sections, changes.n);
+        return 0;
+    }
+
+    qsort(changes.sections, changes.n, sizeof(*changes.sections), ini_section_gen_cmp);
+    for (i = 0; i < old->nsections; ++i) {
+        if (bsearch(&old->sections[i], changes.sections, (size_t)n, sizeof(*changes.sections),
+                ini_section_gen_cmp) == NULL) {
+            if (ini_section_gen_add(&changes, old->sections[i].section,
+                    old->sections[i].generation) != 0) {
+                ini_section_gen_free(changes.sections, changes.n);
+                return -1;
+            }
+        }
+    }
+    qsort(changes.sections, changes.n, sizeof(*changes.sections), ini_section_gen_cmp);
+
+    version->generation = changes.generation;
+    version->sections = changes.sections;
+    version->nsections = changes.n;
+
+    return n;
+}
+
+static void ini_shared_synchronize(struct ini_shared *shared)
+{
+    int i;
+    unsigned long idx;
+
+    for (i = 0; i < 2; ++i) {
+        idx = __atomic_fetch_add(&shared->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&shared->readers[idx], __ATOMIC_SEQ_CST) != 0) {
+            sched_yield();
+        }
+    }
+}
+
+INI_SHARED ini_shared_create(INI_CONFIG config)
+{
+    struct ini_shared *shared;
+
+    if (config == NULL) {
+        return NULL;
+    }
+
+    shared = (struct ini_shared *)malloc(sizeof(*shared));
+    if (shared == NULL) {
+        return NULL;
+    }
+
+    if ((shared->current = ini_version_new(config)) == NULL) {
+        free(shared);
+        return NULL;
+    }
+    shared->readers[0] = shared->readers[1] = 0;
+    shared->epoch = 0;
+    shared->generation = shared->current->generation;
+    pthread_mutex_init(&shared->lock, NULL);
+
+    return shared;
+}
+
+void ini_shared_destroy(INI_SHARED shared)
+{
+    struct ini_shared *s;
+
+    if ((s = (struct ini_shared *)shared) == NULL) {
+        return;
+    }
+
+    ini_version_put(s->current);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+INI_SNAPSHOT ini_shared_acquire(INI_SHARED shared)
+{
+    unsigned long idx;
+    struct ini_shared *s;
+    struct ini_version *version;
+
+    s = (struct ini_shared *)shared;
+    idx = __atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&s->readers[idx], 1, __ATOMIC_SEQ_CST);
+    version = __atomic_load_n(&s->current, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&version->refs, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&s->readers[idx], 1, __ATOMIC_RELEASE);
+
+    return version;
+}
+
+INI_CONFIG ini_snapshot_config(INI_SNAPSHOT snapshot)
+{
+    return snapshot ? ((struct ini_version *)snapshot)->config : NULL;
+}
+
+const char *ini_snapshot_get(INI_SNAPSHOT snapshot, const char *section,
+    const char *key, const char *default_value)
+{
+    if (snapshot == NULL) {
+        return default_value;
+    }
+
+    return ini_config_get(((struct ini_version *)snapshot)->config, section, key, default_value);
+}
+
+void ini_snapshot_release(INI_SNAPSHOT snapshot)
+{
+    if (snapshot) {
+        ini_version_put((struct ini_version *)snapshot);
+    }
+}
+
+INI_CONFIG ini_shared_edit(INI_SHARED shared)
+{
+    INI_CONFIG config;
+    struct ini_shared *s;
+
+    if ((s = (struct ini_shared *)shared) == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if ((config = ini_config_dup(s->current->config)) == NULL) {
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return config;
+}
+
+/* 调用者持有写锁, 返回时已经释放 */
+static int ini_shared_publish_locked(struct ini_shared *s, INI_CONFIG config)
+{
+    int ret;
+    struct ini_version *old, *version;
+
+    if ((version = ini_version_new(config)) == NULL) {
+        ini_config_release(config);
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+
+    old = s->current;
+    if ((ret = ini_version_track(version, old)) <= 0) {
+        /* 内容没有变化时保留当前版本, 代数不变 */
+        ini_version_put(version);
+        pthread_mutex_unlock(&s->lock);
+        return ret;
+    }
+
+    __atomic_store_n(&s->current, version, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&s->generation, version->generation, __ATOMIC_RELEASE);
+    ini_shared_synchronize(s);
+    pthread_mutex_unlock(&s->lock);
+    ini_version_put(old);
+
+    return 0;
+}
+
+int ini_shared_publish(INI_SHARED shared, INI_CONFIG config)
+{
+    return ini_shared_publish_locked((struct ini_shared *)shared, config);
+}
+
+int ini_shared_replace(INI_SHARED shared, INI_CONFIG config)
+{
+    struct ini_shared *s;
+
+    if ((s = (struct ini_shared *)shared) == NULL || config == NULL) {
+        if (config) {
+            ini_config_release(config);
+        }
+        return -1;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    return ini_shared_publish_locked(s, config);
+}
+
+unsigned long ini_shared_generation(INI_SHARED shared)
+{
+    return __atomic_load_n(&((struct ini_shared *)shared)->generation, __ATOMIC_ACQUIRE);
+}
+
+unsigned long ini_shared_section_generation(INI_SHARED shared, const char *section)
+{
+    unsigned long generation;
+    INI_SNAPSHOT snapshot;
+
+    snapshot = ini_shared_acquire(shared);
+    generation = ini_snapshot_section_generation(snapshot, section);
+    ini_snapshot_release(snapshot);
+
+    return generation;
+}
+
+unsigned long ini_snapshot_generation(INI_SNAPSHOT snapshot)
+{
+    return snapshot ? ((struct ini_version *)snapshot)->generation : 0;
+}
+
+unsigned long ini_snapshot_section_generation(INI_SNAPSHOT snapshot, const char *section)
+{
+    const struct ini_section_gen *gen;
+
+    if (snapshot == NULL) {
+        return 0;
+    }
+
+    gen = ini_version_find_section((struct ini_version *)snapshot, section);
+    return gen ? gen->generation : 0;
+}
+
+void ini_shared_abort(INI_SHARED shared, INI_CONFIG config)
+{
+    ini_config_release(config);
+    pthread_mutex_unlock(&((struct ini_shared *)shared)->lock);
+}
+
+int ini_shared_set(INI_SHARED shared, const char *section,
+    const char *key, const char *value)
+{
+    INI_CONFIG config;
+
+    if ((config = ini_shared_edit(shared)) == NULL) {
+        return -1;
+    }
+
+    if (ini_config_set(config, section, key, value) != 0) {
+        ini_shared_abort(shared, config);
+        return -1;
+    }
+
+    return ini_shared_publish(shared, config);
+}
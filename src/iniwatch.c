@@ -0,0 +1,170 @@
+#include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include "iniparser.h"
+#include "inishared.h"
+#include "iniwatch.h"
+
+/* 不关心IN_CREATE: 文件刚创建时还是空的, 此时重新解析会发布一个空配置 */
+#define INI_WATCH_EVENTS    (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE)
+
+struct ini_watch {
+    char *file;
+    char *name;     /* 文件名部分, 指向file内部 */
+    int inotify_fd;
+    int stop_fd;
+    pthread_t thread;
+    INI_SHARED shared;
+};
+
+/* 读空inotify队列, 返回是否有我们关心的文件的事件 */
+static int ini_watch_drain(struct ini_watch *watch)
+{
+    int hit;
+    ssize_t len;
+    char *p;
+    struct inotify_event *event;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    hit = 0;
+    while ((len = read(watch->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+            event = (struct inotify_event *)p;
+            if (event->len && strcmp(event->name, watch->name) == 0) {
+                hit = 1;
+            }
+        }
+    }
+
+    return hit;
+}
+
+static void *ini_watch_thread(void *arg)
+{
+    INI_CONFIG config;
+    struct pollfd fds[2];
+    struct ini_watch *watch;
+
+    watch = (struct ini_watch *)arg;
+    fds[0].fd = watch->stop_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = watch->inotify_fd;
+    fds[1].events = POLLIN;
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (fds[0].revents) {
+            break;
+        }
+
+        if (!(fds[1].revents & POLLIN) || !ini_watch_drain(watch)) {
+            continue;
+        }
+
+        /* 文件可能刚被删除, 等待随后的rename或者写完的事件 */
+        if ((config = ini_config_create(watch->file)) != NULL) {
+            ini_shared_replace(watch->shared, config);
+        }
+    }
+
+    return NULL;
+}
+
+static void ini_watch_free(struct ini_watch *watch)
+{
+    if (watch->shared) {
+        ini_shared_destroy(watch->shared);
+    }
+    if (watch->inotify_fd >= 0) {
+        close(watch->inotify_fd);
+    }
+    if (watch->stop_fd >= 0) {
+        close(watch->stop_fd);
+    }
+    free(watch->file);
+    free(watch);
+}
+
+INI_WATCH ini_watch_create(const char *file)
+{
+    char *dir;
+    INI_CONFIG config;
+    struct ini_watch *watch;
+    char path[PATH_MAX];
+
+    if (file == NULL || (watch = calloc(1, sizeof(*watch))) == NULL) {
+        return NULL;
+    }
+
+    watch->inotify_fd = -1;
+    watch->stop_fd = -1;
+    if ((watch->file = strdup(file)) == NULL) {
+        ini_watch_free(watch);
+        return NULL;
+    }
+    watch->name = strrchr(watch->file, '/') ? strrchr(watch->file, '/') + 1 : watch->file;
+
+    strncpy(path, file, sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
+    dir = dirname(path);
+
+    /* 先开始监视再加载, 不会漏掉加载期间的修改 */
+    if ((watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0
+            || inotify_add_watch(watch->inotify_fd, dir, INI_WATCH_EVENTS) < 0
+            || (watch->stop_fd = eventfd(0, EFD_CLOEXEC)) < 0
+            || (config = ini_config_create(file)) == NULL) {
+        ini_watch_free(watch);
+        return NULL;
+    }
+
+    if ((watch->shared = ini_shared_create(config)) == NULL) {
+        ini_config_release(config);
+        ini_watch_free(watch);
+        return NULL;
+    }
+
+    if (pthread_create(&watch->thread, NULL, ini_watch_thread, watch) != 0) {
+        ini_watch_free(watch);
+        return NULL;
+    }
+
+    return watch;
+}
+
+INI_SHARED ini_watch_shared(INI_WATCH watch)
+{
+    return watch ? ((struct ini_watch *)watch)->shared : NULL;
+}
+
+void ini_watch_destroy(INI_WATCH watch)
+{
+    uint64_t one;
+    struct ini_watch *w;
+
+    if ((w = (struct ini_watch *)watch) == NULL) {
+        return;
+    }
+
+    one = 1;
+    if (write(w->stop_fd, &one, sizeof(one)) == sizeof(one)) {
+        pthread_join(w->thread, NULL);
+    } else {
+        pthread_cancel(w->thread);
+        pthread_join(w->thread, NULL);
+    }
+    ini_watch_free(w);
+}
@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include "intervaltree.h"
+
+#define itn_entry(ptr)  rb_entry(ptr, struct interval_tree_node, rb)
+
+static void interval_tree_augment(struct rb_node *rb, void *data)
+{
+    uint64_t max;
+    struct interval_tree_node *node;
+
+    node = itn_entry(rb);
+    max = node->last;
+    if (rb->rb_left && itn_entry(rb->rb_left)->subtree_last > max)
+        max = itn_entry(rb->rb_left)->subtree_last;
+    if (rb->rb_right && itn_entry(rb->rb_right)->subtree_last > max)
+        max = itn_entry(rb->rb_right)->subtree_last;
+    node->subtree_last = max;
+}
+
+void interval_tree_insert(struct interval_tree_node *node, struct rb_root *root)
+{
+    struct rb_node **link, *parent;
+
+    parent = NULL;
+    link = &root->rb_node;
+    while (*link) {
+        parent = *link;
+        if (node->start < itn_entry(parent)->start)
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+
+    node->subtree_last = node->last;
+    rb_link_node(&node->rb, parent, link);
+    rb_insert_color(&node->rb, root);
+    rb_augment_insert(&node->rb, interval_tree_augment, NULL);
+}
+
+void interval_tree_remove(struct interval_tree_node *node, struct rb_root *root)
+{
+    struct rb_node *deepest;
+
+    deepest = rb_augment_erase_begin(&node->rb);
+    rb_erase(&node->rb, root);
+    rb_augment_erase_end(deepest, interval_tree_augment, NULL);
+}
+
+/*
+ * leftmost node of the subtree rooted at @node that overlaps [start, last],
+ * the caller guarantees start <= node->subtree_last
+ */
+static struct interval_tree_node *interval_tree_subtree_search(struct interval_tree_node *node,
+        uint64_t start, uint64_t last)
+{
+    struct interval_tree_node *left;
+
+    while (1) {
+        if (node->rb.rb_left) {
+            left = itn_entry(node->rb.rb_left);
+            if (start <= left->subtree_last) {
+                /* some interval on the left overlaps or nothing on the right can */
+                node = left;
+                continue;
+            }
+        }
+
+        if (node->start <= last) {
+            if (start <= node->last)
+                return node;
+            if (node->rb.rb_right) {
+                node = itn_entry(node->rb.rb_right);
+                if (start <= node->subtree_last)
+                    continue;
+            }
+        }
+
+        return NULL;
+    }
+}
+
+struct interval_tree_node *interval_tree_iter_first(struct rb_root *root,
+        uint64_t start, uint64_t last)
+{
+    struct interval_tree_node *node;
+
+    if (!root->rb_node)
+        return NULL;
+
+    node = itn_entry(root->rb_node);
+    if (node->subtree_last < start)
+        return NULL;
+
+    return interval_tree_subtree_search(node, start, last);
+}
+
+struct interval_tree_node *interval_tree_iter_next(struct interval_tree_node *node,
+        uint64_t start, uint64_t last)
+{
+    struct rb_node *rb, *prev;
+    struct interval_tree_node *right;
+
+    rb = node->rb.rb_right;
+    while (1) {
+        /* intervals starting after @node live in its right subtree... */
+        if (rb) {
+            right = itn_entry(rb);
+            if (start <= right->subtree_last)
+                return interval_tree_subtree_search(right, start, last);
+        }
+
+        /* ...or in the first ancestor we reach from a left child */
+        do {
+            rb = rb_parent(&node->rb);
+            if (!rb)
+                return NULL;
+            prev = &node->rb;
+            node = itn_entry(rb);
+            rb = node->rb.rb_right;
+        } while (prev == rb);
+
+        if (last < node->start)
+            return NULL;
+        else if (start <= node->last)
+            return node;
+    }
+}
+
+static void extent_map_erase(struct extent_map *map, struct interval_tree_node *node)
+{
+    interval_tree_remove(node, &map->root);
+    map->bytes -= node->last - node->start + 1;
+    map->count--;
+    free(node);
+}
+
+static int extent_map_insert(struct extent_map *map, uint64_t start, uint64_t last)
+{
+    struct interval_tree_node *node;
+
+    if ((node = (struct interval_tree_node *)malloc(sizeof(*node))) == NULL)
+        return -1;
+
+    node->start = start;
+    node->last = last;
+    interval_tree_insert(node, &map->root);
+    map->bytes += last - start + 1;
+    map->count++;
+
+    return 0;
+}
+
+int extent_map_add(struct extent_map *map, uint64_t offset, uint64_t len)
+{
+    uint64_t start, last;
+    struct interval_tree_node *node, *next;
+
+    if (len == 0)
+        return 0;
+
+    if (offset + len - 1 < offset)
+        return -1;
+
+    start = offset;
+    last = offset + len - 1;
+
+    /* absorb everything that overlaps or touches [start, last] */
+    node = interval_tree_iter_first(&map->root, start ? start - 1 : 0,
+            last == UINT64_MAX ? last : last + 1);
+    while (node) {
+        next = interval_tree_iter_next(node, start ? start - 1 : 0,
+                last == UINT64_MAX ? last : last + 1);
+        if (node->start < start)
+            start = node->start;
+        if (node->last > last)
+            last = node->last;
+        extent_map_erase(map, node);
+        node = next;
+    }
+
+    return extent_map_insert(map, start, last);
+}
+
+int extent_map_remove(struct extent_map *map, uint64_t offset, uint64_t len)
+{
+    int ret;
+    uint64_t start, last, head_start, tail_last;
+    struct interval_tree_node *node, *next;
+
+    if (len == 0)
+        return 0;
+
+    if (offset + len - 1 < offset)
+        return -1;
+
+    start = offset;
+    last = offset + len - 1;
+    ret = 0;
+    node = interval_tree_iter_first(&map->root, start, last);
+    while (node) {
+        next = interval_tree_iter_next(node, start, last);
+        head_start = node->start;
+        tail_last = node->last;
+        extent_map_erase(map, node);
+        /* keep the parts that stick out of the removed range */
+        if (head_start < start && extent_map_insert(map, head_start, start - 1) != 0)
+            ret = -1;
+        if (tail_last > last && extent_map_insert(map, last + 1, tail_last) != 0)
+            ret = -1;
+        node = next;
+    }
+
+    return ret;
+}
+
+uint64_t extent_map_covered(struct extent_map *map, uint64_t offset, uint64_t len)
+{
+    uint64_t start, last, covered;
+    struct interval_tree_node *node;
+
+    if (len == 0)
+        return 0;
+
+    start = offset;
+    last = offset + len - 1 < offset ? UINT64_MAX : offset + len - 1;
+    covered = 0;
+    for (node = interval_tree_iter_first(&map->root, start, last); node;
+            node = interval_tree_iter_next(node, start, last)) {
+        covered += (node->last < last ? node->last : last)
+            - (node->start > start ? node->start : start) + 1;
+    }
+
+    return covered;
+}
+
+bool extent_map_contains(struct extent_map *map, uint64_t offset, uint64_t len)
+{
+    return extent_map_covered(map, offset, len) == len;
+}
+
+void extent_map_clear(struct extent_map *map)
+{
+    struct rb_node *rb;
+
+    while ((rb = map->root.rb_node) != NULL)
+        extent_map_erase(map, itn_entry(rb));
+}
@@ -0,0 +1,447 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "common.h"
+#include "intervaltree.h"
+#include "merkle.h"
+
+enum {
+    MERKLE_SLOT_FREE,
+    MERKLE_SLOT_FILLED,
+    MERKLE_SLOT_BUSY,
+};
+
+struct merkle_slot {
+    uint8_t *buf;
+    size_t   len;
+    size_t   index;
+    int      state;
+};
+
+/*
+ * 调用者按顺序把块读进环形的槽中, 工作线程计算任意一个已经填好的槽. 环限制了同时
+ * 占用的内存, 遇到第一个坏块时failed让读取和计算都停下来. 块是乱序算完的, 通过的块
+ * 记在verified中, 最后要求整个镜像都被覆盖, 而不是只看有没有坏块.
+ */
+struct merkle_verify {
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t freed;
+    const struct merkle_tree *tree;
+    struct merkle_slot *slots;
+    size_t nslots;
+    struct extent_map verified;
+    int eof;
+    int failed;
+};
+
+struct merkle_tree *merkle_tree_alloc(size_t chunk_size, size_t nchunks)
+{
+    struct merkle_tree *tree;
+
+    if (chunk_size == 0 || nchunks == 0
+            || nchunks > (((size_t)-1) - sizeof(*tree)) / MERKLE_HASH_SIZE) {
+        return NULL;
+    }
+
+    if ((tree = (struct merkle_tree *)calloc(1, sizeof(*tree) + nchunks * MERKLE_HASH_SIZE)) == NULL) {
+        return NULL;
+    }
+
+    tree->chunk_size = chunk_size;
+    tree->nchunks = nchunks;
+
+    return tree;
+}
+
+void merkle_leaf_hash(const void *chunk, size_t len, uint8_t hash[MERKLE_HASH_SIZE])
+{
+    struct sha256_ctx ctx;
+    static const uint8_t prefix = 0x00;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, &prefix, 1);
+    sha256_update(&ctx, chunk, len);
+    sha256_final(&ctx, hash);
+}
+
+static void merkle_node_hash(const uint8_t left[MERKLE_HASH_SIZE],
+    const uint8_t right[MERKLE_HASH_SIZE], uint8_t hash[MERKLE_HASH_SIZE])
+{
+    struct sha256_ctx ctx;
+    static const uint8_t prefix = 0x01;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, &prefix, 1);
+    sha256_update(&ctx, left, MERKLE_HASH_SIZE);
+    sha256_update(&ctx, right, MERKLE_HASH_SIZE);
+    sha256_final(&ctx, hash);
+}
+
+void merkle_tree_root(const struct merkle_tree *tree, uint8_t root[MERKLE_HASH_SIZE])
+{
+    size_t i, n;
+    uint8_t (*level)[MERKLE_HASH_SIZE];
+
+    if (tree->nchunks == 1) {
+        memcpy(root, tree->leaves[0], MERKLE_HASH_SIZE);
+        return;
+    }
+
+    /* 只有第一层需要复制, 后面各层在原地计算 */
+    n = tree->nchunks;
+    if ((level = malloc(((n + 1) / 2) * MERKLE_HASH_SIZE)) == NULL) {
+        memset(root, 0, MERKLE_HASH_SIZE);
+        return;
+    }
+
+    for (i = 0; i + 1 < n; i += 2) {
+        merkle_node_hash(tree->leaves[i], tree->leaves[i + 1], level[i / 2]);
+    }
+    if (n & 1) {
+        memcpy(level[n / 2], tree->leaves[n - 1], MERKLE_HASH_SIZE);
+    }
+    n = (n + 1) / 2;
+
+    while (n > 1) {
+        for (i = 0; i + 1 < n; i += 2) {
+            merkle_node_hash(level[i], level[i + 1], level[i / 2]);
+        }
+        if (n & 1) {
+            memmove(level[n / 2], level[n - 1], MERKLE_HASH_SIZE);
+        }
+        n = (n + 1) / 2;
+    }
+
+    memcpy(root, level[0], MERKLE_HASH_SIZE);
+    free(level);
+}
+
+int merkle_tree_check_root(const struct merkle_tree *tree)
+{
+    uint8_t root[MERKLE_HASH_SIZE];
+
+    if (tree == NULL) {
+        return -1;
+    }
+
+    merkle_tree_root(tree, root);
+    return memcmp(root, tree->root, MERKLE_HASH_SIZE) == 0 ? 0 : -1;
+}
+
+static int merkle_hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+int merkle_hex2hash(const char *hex, uint8_t hash[MERKLE_HASH_SIZE])
+{
+    int i, hi, lo;
+
+    if (hex == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < MERKLE_HASH_SIZE; ++i) {
+        if ((hi = merkle_hex_digit(hex[2 * i])) < 0 || (lo = merkle_hex_digit(hex[2 * i + 1])) < 0) {
+            return -1;
+        }
+        hash[i] = (uint8_t)((hi << 4) | lo);
+    }
+
+    return hex[2 * MERKLE_HASH_SIZE] == '\0' ? 0 : -1;
+}
+
+static int merkle_chunk_ok(const struct merkle_tree *tree, size_t index, const void *buf, size_t len)
+{
+    uint8_t hash[MERKLE_HASH_SIZE];
+
+    merkle_leaf_hash(buf, len, hash);
+    return memcmp(hash, tree->leaves[index], MERKLE_HASH_SIZE) == 0;
+}
+
+static void *merkle_verify_worker(void *arg)
+{
+    int ok;
+    size_t i;
+    struct merkle_slot *slot;
+    struct merkle_verify *verify;
+
+    verify = (struct merkle_verify *)arg;
+    pthread_mutex_lock(&verify->lock);
+    for (;;) {
+        for (i = 0, slot = NULL; i < verify->nslots; ++i) {
+            if (verify->slots[i].state == MERKLE_SLOT_FILLED) {
+                slot = &verify->slots[i];
+                break;
+            }
+        }
+
+        if (slot == NULL) {
+            if (verify->eof || verify->failed) {
+                break;
+            }
+            pthread_cond_wait(&verify->filled, &verify->lock);
+            continue;
+        }
+
+        slot->state = MERKLE_SLOT_BUSY;
+        pthread_mutex_unlock(&verify->lock);
+        ok = merkle_chunk_ok(verify->tree, slot->index, slot->buf, slot->len);
+        pthread_mutex_lock(&verify->lock);
+        if (ok && extent_map_add(&verify->verified, (uint64_t)slot->index * verify->tree->chunk_size,
+                    slot->len) != 0) {
+            ok = 0;
+        }
+        if (!ok) {
+            verify->failed = 1;
+            pthread_cond_broadcast(&verify->filled);
+        }
+        slot->state = MERKLE_SLOT_FREE;
+        pthread_cond_broadcast(&verify->freed);
+    }
+    pthread_mutex_unlock(&verify->lock);
+
+    return NULL;
+}
+
+/* 读取下一块, 流中的块比分块哈希多时返回-1 */
+static ssize_t merkle_read_chunk(int fd, const struct merkle_tree *tree, size_t index, uint8_t *buf)
+{
+    ssize_t n;
+
+    if ((n = full_read(fd, buf, tree->chunk_size)) <= 0) {
+        return n;
+    }
+
+    return index < tree->nchunks ? n : -1;
+}
+
+int merkle_verify_fd(int fd, const struct merkle_tree *tree, int threads,
+    size_t budget, uint64_t *size)
+{
+    int ret, err, failed;
+    size_t i, index, nslots, nthreads;
+    ssize_t n;
+    uint64_t total;
+    pthread_t *tids;
+    struct merkle_slot *slot;
+    struct merkle_verify verify;
+
+    if (fd < 0 || tree == NULL) {
+        return -1;
+    }
+
+    /* 每个线程两个槽, 一个在计算一个在填充, 不超过budget */
+    nslots = threads > 1 ? (size_t)threads * 2 : 1;
+    if (budget / tree->chunk_size < nslots) {
+        nslots = budget / tree->chunk_size ? budget / tree->chunk_size : 1;
+    }
+    nthreads = threads > 1 ? (size_t)threads : 1;
+    if (nthreads > nslots) {
+        nthreads = nslots;
+    }
+
+    memset(&verify, 0, sizeof(verify));
+    verify.tree = tree;
+    verify.nslots = nslots;
+    verify.verified = EXTENT_MAP_INIT;
+    if ((verify.slots = (struct merkle_slot *)calloc(nslots, sizeof(*verify.slots))) == NULL) {
+        return -1;
+    }
+
+    ret = -1;
+    tids = NULL;
+    for (i = 0; i < nslots; ++i) {
+        if ((verify.slots[i].buf = (uint8_t *)malloc(tree->chunk_size)) == NULL) {
+            goto out;
+        }
+    }
+
+    total = 0;
+    err = 0;
+    index = 0;
+
+    /* 只有一个线程时不需要环, 读一块算一块 */
+    if (nthreads == 1) {
+        slot = &verify.slots[0];
+        while ((n = merkle_read_chunk(fd, tree, index, slot->buf)) > 0) {
+            if (!merkle_chunk_ok(tree, index, slot->buf, n)
+                    || extent_map_add(&verify.verified, total, n) != 0) {
+                verify.failed = 1;
+                break;
+            }
+            total += n;
+            index++;
+            if ((size_t)n < tree->chunk_size) {
+                break;
+            }
+        }
+        err = n < 0;
+        goto check;
+    }
+
+    if ((tids = (pthread_t *)calloc(nthreads, sizeof(*tids))) == NULL) {
+        goto out;
+    }
+
+    pthread_mutex_init(&verify.lock, NULL);
+    pthread_cond_init(&verify.filled, NULL);
+    pthread_cond_init(&verify.freed, NULL);
+    for (i = 0; i < nthreads; ++i) {
+        if (pthread_create(&tids[i], NULL, merkle_verify_worker, &verify) != 0) {
+            break;
+        }
+    }
+    nthreads = i;
+
+    for (;;) {
+        slot = &verify.slots[index % nslots];
+        pthread_mutex_lock(&verify.lock);
+        while (slot->state != MERKLE_SLOT_FREE && !verify.failed) {
+            pthread_cond_wait(&verify.freed, &verify.lock);
+        }
+        failed = verify.failed;
+        pthread_mutex_unlock(&verify.lock);
+        if (failed || nthreads == 0) {
+            break;
+        }
+
+        if ((n = merkle_read_chunk(fd, tree, index, slot->buf)) <= 0) {
+            err = n < 0;
+            break;
+        }
+
+        pthread_mutex_lock(&verify.lock);
+        slot->len = n;
+        slot->index = index;
+        slot->state = MERKLE_SLOT_FILLED;
+        pthread_cond_signal(&verify.filled);
+        pthread_mutex_unlock(&verify.lock);
+
+        total += n;
+        index++;
+        if ((size_t)n < tree->chunk_size) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&verify.lock);
+    verify.eof = 1;
+    pthread_cond_broadcast(&verify.filled);
+    pthread_mutex_unlock(&verify.lock);
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    err |= nthreads == 0;
+
+    pthread_cond_destroy(&verify.freed);
+    pthread_cond_destroy(&verify.filled);
+    pthread_mutex_destroy(&verify.lock);
+
+check:
+    if (!err && !verify.failed && index == tree->nchunks
+            && verify.verified.bytes == total && extent_map_contains(&verify.verified, 0, total)) {
+        if (size) {
+            *size = total;
+        }
+        ret = 0;
+    }
+out:
+    extent_map_clear(&verify.verified);
+    for (i = 0; i < nslots; ++i) {
+        free(verify.slots[i].buf);
+    }
+    free(verify.slots);
+    free(tids);
+
+    return ret;
+}
+
+static void merkle_stream_begin_chunk(struct merkle_stream *ms)
+{
+    static const uint8_t prefix = 0x00;
+
+    sha256_init(&ms->ctx);
+    sha256_update(&ms->ctx, &prefix, 1);
+    ms->fill = 0;
+}
+
+/* 结束当前块并与它的叶子比较 */
+static int merkle_stream_end_chunk(struct merkle_stream *ms)
+{
+    uint8_t hash[MERKLE_HASH_SIZE];
+
+    sha256_final(&ms->ctx, hash);
+    if (memcmp(hash, ms->tree->leaves[ms->index], MERKLE_HASH_SIZE) != 0) {
+        ms->failed = 1;
+        return -1;
+    }
+
+    ms->index++;
+    merkle_stream_begin_chunk(ms);
+    return 0;
+}
+
+void merkle_stream_init(struct merkle_stream *ms, const struct merkle_tree *tree)
+{
+    memset(ms, 0, sizeof(*ms));
+    ms->tree = tree;
+    merkle_stream_begin_chunk(ms);
+}
+
+int merkle_stream_update(struct merkle_stream *ms, const void *buf, size_t len)
+{
+    size_t n;
+    const uint8_t *p;
+
+    for (p = (const uint8_t *)buf; len > 0 && !ms->failed; p += n, len -= n) {
+        if (ms->index >= ms->tree->nchunks) {
+            ms->failed = 1;
+            break;
+        }
+
+        n = ms->tree->chunk_size - ms->fill;
+        if (n > len) {
+            n = len;
+        }
+        sha256_update(&ms->ctx, p, n);
+        ms->fill += n;
+        ms->size += n;
+        if (ms->fill == ms->tree->chunk_size && merkle_stream_end_chunk(ms) != 0) {
+            break;
+        }
+    }
+
+    return ms->failed ? -1 : 0;
+}
+
+int merkle_stream_final(struct merkle_stream *ms, uint64_t *size)
+{
+    if (!ms->failed && ms->fill > 0) {
+        if (ms->index >= ms->tree->nchunks) {
+            ms->failed = 1;
+        } else {
+            merkle_stream_end_chunk(ms);
+        }
+    }
+
+    if (ms->failed || ms->index != ms->tree->nchunks) {
+        return -1;
+    }
+
+    if (size) {
+        *size = ms->size;
+    }
+    return 0;
+}
@@ -1,50 +1,222 @@
 ﻿#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <libgen.h>
 #include <limits.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <json-c/json.h>
 #include "common.h"
+#include "configs.h"
 #include "package.h"
+#include "blobstore.h"
+#include "hashtable.h"
+#include "pkgcache.h"
+
+#define PKG_MANIFEST_MAX        (16 << 20)
 
 const char *const cmd_check_md5sum = "tar -O -I zstd -xf %s %s | md5sum";
-const char *const cmd_extract_file = "tar -I zstd -xf %s -C %s %s";
 const char *const cmd_package_size = "tar -I zstd -tvf %s %s | awk '{print $3}'";
-
-static const struct {
-    package_type_t type;
+const char *const cmd_extract_stdout = "tar -O -I zstd -xf %s %s";
+/* 按索引取出文件所在的帧解压, 再去掉tar头和填充 */
+const char *const cmd_index_extract_stdout = "tail -c +%llu %s | head -c %llu | zstd -dcq"
+                                             " | tail -c +%llu | head -c %llu";
+
+struct package_name {
+    struct hash_node node;
+    int type;
     const char *const name;
-} package_type_map[] = {
-    {PKG_OS,            "os"},
-    {PKG_PATCH,         "patch"},
-    {PKG_MULTI_OS,      "multi-os"},
-    {PKG_MULTI_PATCH,   "multi-patch"}
 };
 
-static const struct {
-    os_blob_type_t type;
-    const char *const name;
-} os_blob_type_map[] = {
-    {OS_BLOB_BOOTLOADER,    "bootloader"},
-    {OS_BLOB_KERNEL,        "kernel"},
-    {OS_BLOB_ROOTFS,        "rootfs"},
-    {OS_BLOB_OTHER,         "other"}
+static struct package_name package_type_map[] = {
+    {.type = PKG_OS,            .name = "os"},
+    {.type = PKG_PATCH,         .name = "patch"},
+    {.type = PKG_MULTI_OS,      .name = "multi-os"},
+    {.type = PKG_MULTI_PATCH,   .name = "multi-patch"}
 };
 
-int decompress_package(const char *dst, const char *pkg, const char *file)
+static struct package_name os_blob_type_map[] = {
+    {.type = OS_BLOB_BOOTLOADER,    .name = "bootloader"},
+    {.type = OS_BLOB_KERNEL,        .name = "kernel"},
+    {.type = OS_BLOB_DICTIONARY,    .name = "dictionary"},
+    {.type = OS_BLOB_ROOTFS,        .name = "rootfs"},
+    {.type = OS_BLOB_OTHER,         .name = "other"}
+};
+
+/* 名字到类型的索引, 第一次查找时建立 */
+static DEFINE_HASH_TABLE(package_type_table, 3, hash_wyhash);
+static DEFINE_HASH_TABLE(os_blob_type_table, 3, hash_wyhash);
+static pthread_once_t package_name_once = PTHREAD_ONCE_INIT;
+
+static void package_name_table_fill(struct hash_table *table, struct package_name *map, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        hash_table_add(table, &map[i].node, hash_table_hash(table, map[i].name, strlen(map[i].name)));
+    }
+}
+
+static void package_name_init(void)
+{
+    package_name_table_fill(&package_type_table, package_type_map, ARRAY_SIZE(package_type_map));
+    package_name_table_fill(&os_blob_type_table, os_blob_type_map, ARRAY_SIZE(os_blob_type_map));
+}
+
+static int package_name_lookup(struct hash_table *table, const char *str, int unknown)
+{
+    uint64_t hash;
+    struct hlist_node *pos;
+    struct package_name *entry;
+
+    if (str == NULL) {
+        return unknown;
+    }
+
+    pthread_once(&package_name_once, package_name_init);
+    hash = hash_table_hash(table, str, strlen(str));
+    hash_table_for_each_possible(table, entry, pos, hash, node) {
+        if (strcmp(entry->name, str) == 0) {
+            return entry->type;
+        }
+    }
+
+    return unknown;
+}
+
+/* 生成把包中的文件输出到stdout的命令 */
+static int package_file_command(char *command, size_t n, const char *pkg,
+    const struct pkg_index *index, const char *file)
+{
+    int ret;
+    const struct pkg_index_entry *entry;
+
+    if ((entry = pkg_index_find(index, file)) != NULL) {
+        ret = snprintf(command, n, cmd_index_extract_stdout, (unsigned long long)entry->offset + 1, pkg,
+            (unsigned long long)entry->length, (unsigned long long)entry->skip + 1,
+            (unsigned long long)entry->size);
+    } else {
+        ret = snprintf(command, n, cmd_extract_stdout, pkg, file);
+    }
+
+    return ret >= 0 && ret < (int)n ? 0 : -1;
+}
+
+/*
+ * 包中的文件由解压命令读取, 读完后丢弃它占用的页缓存. 有索引时只丢弃文件所在的帧,
+ * 否则解压时从头读过整个包, 全部丢弃.
+ */
+static void package_drop_cache(const char *pkg, const struct pkg_index *index, const char *file)
+{
+    int fd;
+    const struct pkg_index_entry *entry;
+
+    if ((fd = open(pkg, O_RDONLY | O_CLOEXEC)) < 0) {
+        return;
+    }
+
+    if ((entry = pkg_index_find(index, file)) != NULL) {
+        file_drop_cache(fd, (off_t)entry->offset, (off_t)entry->length);
+    } else {
+        file_drop_cache(fd, 0, 0);
+    }
+    close(fd);
+}
+
+int extract_package_file(const package_t *package, int fd, const char *file)
 {
     int ret;
+    FILE *fp;
+    struct stat st;
+    char command[PATH_MAX];
+    const struct pkg_index_entry *entry;
+
+    if (package == NULL || fd < 0 || file == NULL
+            || package_file_command(command, sizeof(command), package->path, package->index, file) != 0
+            || (fp = popen(command, "re")) == NULL) {
+        return -1;
+    }
+
+    ret = blob_decode_fd(BLOB_CODEC_RAW, BLOB_REF_NONE, NULL, fileno(fp), fd, NULL, NULL);
+    if (pclose(fp) != 0) {
+        ret = -1;
+    }
+
+    /* 管道的退出状态是最后一个head的, 解压失败时只能从长度上发现 */
+    if (ret == 0 && (entry = pkg_index_find(package->index, file)) != NULL
+            && (fstat(fd, &st) != 0 || (uint64_t)st.st_size != entry->size)) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* 把包中的镜像按它的编码解码到fd, 有分块哈希时边解码边校验 */
+static int decode_blob(const char *pkg, const struct pkg_index *index, const os_blob_t *blob, int fd,
+    os_blob_check_t *check)
+{
+    int ret;
+    FILE *fp;
+    char command[PATH_MAX];
+    char ref[PATH_MAX];
+
+    if (os_blob_reference(blob, ref, sizeof(ref)) != 0) {
+        progress_print(NULL, "\tthe %s %s is not in the local store\n", blob_ref_name(blob->ref),
+            blob->ref_content);
+        return -1;
+    }
 
-    if (dst == NULL) {
+    if (package_file_command(command, sizeof(command), pkg, index, blob->name) != 0
+            || (fp = popen(command, "re")) == NULL) {
         return -1;
     }
 
-    if (access(dst, F_OK) != 0 && (ret = shell_command("mkdir -p %s", dst)) != 0) {
+    /* 只用md5sum校验的raw镜像仍然在内核中复制 */
+    ret = blob_decode_fd(blob->codec, blob->ref, ref, fileno(fp), fd,
+        blob->merkle ? os_blob_check_update : NULL, check);
+
+    /* 解码出错或者遇到坏块提前停止时tar会因SIGPIPE退出 */
+    if (pclose(fp) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int decode_checked_blob(const char *pkg, const struct pkg_index *index, const os_blob_t *blob,
+    int fd, uint64_t *size)
+{
+    os_blob_check_t check;
+
+    os_blob_check_init(&check, blob);
+    if (decode_blob(pkg, index, blob, fd, &check) != 0) {
         return -1;
     }
 
-    return shell_command(cmd_extract_file, pkg, dst, file);
+    return os_blob_check_final(&check, fd, size);
+}
+
+int extract_os_blob(const package_t *package, const os_blob_t *blob, int fd)
+{
+    int ret;
+    uint64_t size;
+
+    if (package == NULL || blob == NULL || fd < 0) {
+        return -1;
+    }
+
+    /* 大小在检查升级包时已经得到 */
+    ret = decode_checked_blob(package->path, package->index, blob, fd, &size);
+    if (ret == 0 && blob->size && size != (uint64_t)blob->size) {
+        ret = -1;
+    }
+    package_drop_cache(package->path, package->index, blob->name);
+
+    return ret;
 }
 
 int check_md5sum(const char *path, const char md5sum[32])
@@ -60,22 +232,7 @@ int check_md5sum(const char *path, const char md5sum[32])
 
 static package_type_t str2type(const char *str)
 {
-    int i;
-    package_type_t type;
-
-    type = PKG_UNKNOWN;
-    if (str == NULL) {
-        return type;
-    }
-
-    for (i = 0; i < ARRAY_SIZE(package_type_map); ++i) {
-        if (strcmp(package_type_map[i].name, str) == 0) {
-            type = package_type_map[i].type;
-            break;
-        }
-    }
-
-    return type;
+    return (package_type_t)package_name_lookup(&package_type_table, str, PKG_UNKNOWN);
 }
 
 const char *package_type2name(const package_type_t t)
@@ -110,6 +267,79 @@ const char *os_blob_type2name(const os_blob_type_t t)
     return name;
 }
 
+int os_package_match_id(const os_package_t *os, uint32_t id)
+{
+    uint64_t hash;
+    struct hlist_node *pos;
+    const apply_id_t *entry;
+
+    if (os == NULL) {
+        return 0;
+    }
+
+    hash = hash_u64(id);
+    hash_table_for_each_possible(&os->apply_ids, entry, pos, hash, node) {
+        if (entry->id == id) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int os_blob_content_id(const os_blob_t *blob, char *buf, size_t n)
+{
+    int i, len;
+
+    if (blob == NULL || buf == NULL) {
+        return -1;
+    }
+
+    if (blob->merkle == NULL) {
+        return snprintf(buf, n, "md5:%.32s", blob->md5sum) < (int)n ? 0 : -1;
+    }
+
+    if ((len = snprintf(buf, n, "merkle:")) < 0 || len + MERKLE_HASH_SIZE * 2 >= (int)n) {
+        return -1;
+    }
+
+    for (i = 0; i < MERKLE_HASH_SIZE; ++i) {
+        len += snprintf(buf + len, n - len, "%02x", blob->merkle->root[i]);
+    }
+
+    return 0;
+}
+
+int os_blob_reference(const os_blob_t *blob, char *path, size_t n)
+{
+    if (blob == NULL || path == NULL || n == 0) {
+        return -1;
+    }
+
+    path[0] = '\0';
+    if (blob->ref == BLOB_REF_NONE) {
+        return 0;
+    }
+
+    return blob_store_lookup(blob->ref_content, blob->ref_size, path, n, NULL) ? 0 : -1;
+}
+
+int store_dictionary_blob(const os_blob_t *blob, int fd)
+{
+    char content[OS_BLOB_CONTENT_SIZE];
+    char path[PATH_MAX];
+
+    if (blob == NULL || fd < 0 || os_blob_content_id(blob, content, sizeof(content)) != 0) {
+        return -1;
+    }
+
+    if (blob_store_lookup(content, blob->size, path, sizeof(path), NULL)) {
+        return 0;
+    }
+
+    return blob_store_put(content, fd, 0);
+}
+
 int str2version(const char *str, package_version_t *ver)
 {
     unsigned int a, b, c;
@@ -222,6 +452,207 @@ failure:
     return -1;
 }
 
+/*
+ * "merkle": {
+ *     "chunk size": 1048576,
+ *     "root": "<sha256>",
+ *     "chunks": ["<sha256>", ...]
+ * }
+ * 叶子哈希必须能算出root, 否则认为清单被篡改
+ */
+static struct merkle_tree *read_merkle_from_json_obj(json_object *obj)
+{
+    size_t i, n;
+    int64_t chunk_size;
+    json_object *key, *value;
+    struct merkle_tree *tree;
+
+    if ((key = json_object_object_get(obj, "chunk size")) == NULL
+            || json_object_get_type(key) != json_type_int
+            || (chunk_size = json_object_get_int64(key)) <= 0
+            || (key = json_object_object_get(obj, "chunks")) == NULL
+            || json_object_get_type(key) != json_type_array
+            || (n = json_object_array_length(key)) == 0
+            || (tree = merkle_tree_alloc((size_t)chunk_size, n)) == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < n; ++i) {
+        value = json_object_array_get_idx(key, i);
+        if (merkle_hex2hash(json_object_get_string(value), tree->leaves[i]) < 0) {
+            goto failure;
+        }
+    }
+
+    if ((key = json_object_object_get(obj, "root")) == NULL
+            || merkle_hex2hash(json_object_get_string(key), tree->root) < 0
+            || merkle_tree_check_root(tree) < 0) {
+        goto failure;
+    }
+
+    return tree;
+failure:
+    free(tree);
+
+    return NULL;
+}
+
+static void free_os_blob(os_blob_t *blob)
+{
+    if (blob->fd >= 0) {
+        close(blob->fd);
+    }
+    free(blob->after);
+    free(blob->merkle);
+    free(blob);
+}
+
+/* 流式校验分块哈希, 同时得到文件大小; 坏块出现后立即停止解压 */
+static int check_merkle(const char *pkg, const struct pkg_index *index, os_blob_t *blob)
+{
+    int ret;
+    FILE *fp;
+    uint64_t size;
+    char command[PATH_MAX];
+
+    if (package_file_command(command, sizeof(command), pkg, index, blob->name) != 0
+            || (fp = popen(command, "re")) == NULL) {
+        return -1;
+    }
+
+    ret = merkle_verify_fd(fileno(fp), blob->merkle, (int)system_config_int(SYS_TUNABLE_THREADS),
+        system_config_size(SYS_TUNABLE_MEMORY_BUDGET), &size);
+
+    /* 提前停止时tar会因SIGPIPE退出, 只在校验通过时关心它的退出状态 */
+    if (pclose(fp) != 0) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        blob->size = (size_t)size;
+    }
+
+    return ret;
+}
+
+void os_blob_check_init(os_blob_check_t *check, const os_blob_t *blob)
+{
+    check->blob = blob;
+    if (blob->merkle) {
+        merkle_stream_init(&check->merkle, blob->merkle);
+    }
+}
+
+int os_blob_check_update(void *check, const void *buf, size_t n)
+{
+    os_blob_check_t *c = (os_blob_check_t *)check;
+
+    return c->blob->merkle ? merkle_stream_update(&c->merkle, buf, n) : 0;
+}
+
+int os_blob_check_final(os_blob_check_t *check, int fd, uint64_t *size)
+{
+    struct stat st;
+    char path[PATH_MAX];
+
+    if (check->blob->merkle == NULL) {
+        if (fstat(fd, &st) != 0 || fd_path(fd, path, sizeof(path)) != 0
+                || check_md5sum(path, check->blob->md5sum) != 0) {
+            return -1;
+        }
+        *size = (uint64_t)st.st_size;
+    } else if (merkle_stream_final(&check->merkle, size) != 0) {
+        return -1;
+    }
+
+    /* 校验过的内容不能再被改动, 直到写入分区 */
+    return scratch_seal(fd);
+}
+
+size_t os_blob_size_hint(const os_blob_t *blob)
+{
+    if (blob->size) {
+        return blob->size;
+    }
+
+    return blob->merkle ? blob->merkle->nchunks * blob->merkle->chunk_size : 0;
+}
+
+/*
+ * 编码过的镜像和字典边解码到任务的暂存文件边校验. 字典校验通过后立即放进本地仓库,
+ * 同一个包中后面引用它的镜像才能解码; 镜像封住后留在blob->fd中, 写分区时不用再解码一次.
+ * 留下的镜像一起占用memory_budget, kept记录已经占用的部分, 用完后暂存在磁盘上. 每个镜像
+ * 占用的部分记在blob->kept中, 写分区时调度器从这里接着算, 不会重复占用.
+ */
+static int check_decoded_blob(const char *pkg, const struct pkg_index *index, os_blob_t *blob,
+    const upgrade_job_t *job, size_t *kept)
+{
+    int fd, ret;
+    size_t hint, budget;
+    uint64_t size;
+    struct timespec start, now;
+
+    budget = system_config_size(SYS_TUNABLE_MEMORY_BUDGET);
+    hint = os_blob_size_hint(blob);
+    if (blob->type != OS_BLOB_DICTIONARY && *kept + hint > budget) {
+        hint = 0;
+    }
+
+    if ((fd = upgrade_job_scratch(job, blob->name, hint)) < 0) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((ret = decode_checked_blob(pkg, index, blob, fd, &size)) != 0) {
+        close(fd);
+        return ret;
+    }
+    blob->size = (size_t)size;
+
+    if (blob->type == OS_BLOB_DICTIONARY) {
+        ret = store_dictionary_blob(blob, fd);
+        close(fd);
+        return ret;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    blob->decode_ms = (long)(now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    blob->fd = fd;
+    if (hint && hint <= budget) {
+        blob->kept = hint;
+        *kept += hint;
+    }
+
+    return 0;
+}
+
+static int read_reference_from_json_obj(json_object *obj, os_blob_t *blob)
+{
+    const char *str;
+    json_object *key;
+
+    if ((key = json_object_object_get(obj, "type")) == NULL
+            || (blob->ref = blob_ref_lookup(json_object_get_string(key))) == BLOB_REF_UNKNOWN
+            || blob->ref == BLOB_REF_NONE) {
+        return -1;
+    }
+
+    if ((key = json_object_object_get(obj, "content")) == NULL
+            || (str = json_object_get_string(key)) == NULL || str[0] == '\0'
+            || json_object_get_string_len(key) >= sizeof(blob->ref_content)) {
+        return -1;
+    }
+    strcpy(blob->ref_content, str);
+
+    if ((key = json_object_object_get(obj, "size")) == NULL || json_object_get_type(key) != json_type_int
+            || json_object_get_int64(key) <= 0) {
+        return -1;
+    }
+    blob->ref_size = (size_t)json_object_get_int64(key);
+
+    return 0;
+}
+
 static os_blob_t *read_os_blob_from_json_array_item(json_object *obj)
 {
     const char *str;
@@ -234,6 +665,7 @@ static os_blob_t *read_os_blob_from_json_array_item(json_object *obj)
 
     memset(blob, 0, sizeof(os_blob_t));
     INIT_LIST_HEAD(&blob->node);
+    blob->fd = -1;
     if ((key = json_object_object_get(obj, "name")) == NULL
             || (str = json_object_get_string(key)) == NULL
             || json_object_get_string_len(key) >= sizeof(blob->name)) {
@@ -253,14 +685,22 @@ static os_blob_t *read_os_blob_from_json_array_item(json_object *obj)
         goto failure;
     }
 
-    if (strcmp(str, "rootfs") == 0) {
-        blob->type = OS_BLOB_ROOTFS;
-    } else if (strcmp(str, "kernel") == 0) {
-        blob->type = OS_BLOB_KERNEL;
-    } else if (strcmp(str, "bootloader") == 0) {
-        blob->type = OS_BLOB_BOOTLOADER;
-    } else {
-        blob->type = OS_BLOB_OTHER;
+    blob->type = (os_blob_type_t)package_name_lookup(&os_blob_type_table, str, OS_BLOB_OTHER);
+
+    key = json_object_object_get(obj, "codec");
+    if ((blob->codec = blob_codec_lookup(key ? json_object_get_string(key) : NULL)) == BLOB_CODEC_UNKNOWN) {
+        goto failure;
+    }
+
+    /* 只有zstd可以引用字典或者旧镜像 */
+    if ((key = json_object_object_get(obj, "reference")) != NULL
+            && (blob->codec != BLOB_CODEC_ZSTD || read_reference_from_json_obj(key, blob) != 0)) {
+        goto failure;
+    }
+
+    if ((key = json_object_object_get(obj, "merkle")) != NULL
+            && (blob->merkle = read_merkle_from_json_obj(key)) == NULL) {
+        goto failure;
     }
 
     return blob;
@@ -270,6 +710,49 @@ failure:
     return NULL;
 }
 
+/*
+ * "after"中的名字换成序号, 只能引用排在前面的镜像, 因此不会有环. 给出"after"表示这个镜像
+ * 可以与其他分区同时写, 空的"after"表示不用等任何镜像
+ */
+static int read_after_from_json_obj(json_object *obj, os_blob_t *blob, struct list_head *header)
+{
+    size_t i, n;
+    const char *str;
+    os_blob_t *pos;
+
+    if (json_object_get_type(obj) != json_type_array) {
+        return -1;
+    }
+
+    blob->parallel = 1;
+    if ((n = json_object_array_length(obj)) == 0) {
+        return 0;
+    }
+
+    if ((blob->after = (size_t *)malloc(n * sizeof(size_t))) == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if ((str = json_object_get_string(json_object_array_get_idx(obj, i))) == NULL) {
+            return -1;
+        }
+
+        list_for_each_entry(pos, header, node) {
+            if (strcmp(pos->name, str) == 0) {
+                break;
+            }
+        }
+
+        if (&pos->node == header) {
+            return -1;
+        }
+        blob->after[blob->nafter++] = pos->index;
+    }
+
+    return 0;
+}
+
 static int read_os_blobs_from_json_obj(json_object *list, struct list_head *header)
 {
     size_t i, n;
@@ -290,6 +773,13 @@ static int read_os_blobs_from_json_obj(json_object *list, struct list_head *head
             goto failure;
         }
 
+        blob->index = i;
+        if ((obj = json_object_object_get(obj, "after")) != NULL
+                && read_after_from_json_obj(obj, blob, header) != 0) {
+            free_os_blob(blob);
+            goto failure;
+        }
+
         list_add_tail(&blob->node, header);
     }
 
@@ -297,50 +787,147 @@ static int read_os_blobs_from_json_obj(json_object *list, struct list_head *head
 failure:
     list_for_each_entry_safe(blob, tmp, header, node) {
         list_del(&blob->node);
-        free(blob);
+        free_os_blob(blob);
     }
     return -1;
 }
 
-package_t *read_package(const char *pkg)
+/* 读出命令输出的清单, 以'\0'结尾, 不经过临时文件 */
+static char *read_manifest(const char *command, size_t *len)
 {
-    int ret;
-    size_t i, n;
-    char md5sum[32 + 1];
-    package_t *package;
-    package_type_t t;
-    json_object *obj;
-    json_object *val;
-    json_object *val1;
-    json_object *blob_obj;
-    struct list_head *head;
-    multi_os_blob_t *mos_tmp;
-    multi_os_blob_t *mos_blob;
-    os_blob_t *os_blob, *os_tmp;
-    const char *const tmp_path = "/tmp/.upgrade_check_manifest";
-    const char *const manifest = "/tmp/.upgrade_check_manifest/manifest.json";
+    FILE *fp;
+    char *buf, *tmp;
+    size_t n, size;
 
-    if (pkg == NULL) {
+    if ((fp = popen(command, "re")) == NULL) {
         return NULL;
     }
 
-    progress_print(NULL, "Read package from %s.\n", pkg);
-    if ((ret = shell_command("mkdir -p %s", tmp_path)) < 0) {
-        return NULL;
+    buf = NULL;
+    size = 0;
+    *len = 0;
+    for (;;) {
+        if (*len + 1 >= size) {
+            if (size >= PKG_MANIFEST_MAX || (tmp = (char *)realloc(buf, size ? size * 2 : BUFF_SIZE)) == NULL) {
+                *len = 0;
+                break;
+            }
+            buf = tmp;
+            size = size ? size * 2 : BUFF_SIZE;
+        }
+
+        if ((n = fread(buf + *len, 1, size - *len - 1, fp)) == 0) {
+            break;
+        }
+        *len += n;
     }
 
-    if ((ret = shell_command(cmd_extract_file, pkg, tmp_path, "manifest.json")) < 0) {
-        progress_print(NULL, "Package does not contain the valid information!\n");
-        unlink(manifest);
+    /* 清单过大时没有读完, 解压命令可能已经全部写进管道, 不能只看退出状态 */
+    if (pclose(fp) != 0 || *len == 0) {
+        free(buf);
         return NULL;
     }
 
-    if ((obj = json_object_from_file(manifest)) == NULL) {
+    buf[*len] = '\0';
+    return buf;
+}
+
+/* 从缓存记录中恢复校验时得到的文件大小, 记录不完整时返回-1 */
+static int restore_os_blobs_from_cache(INI_CONFIG entry, struct list_head *head)
+{
+    char *end;
+    const char *str;
+    os_blob_t *blob;
+    unsigned long long size;
+
+    /* 中途失败时已恢复的大小会在重新校验时被覆盖 */
+    list_for_each_entry(blob, head, node) {
+        if ((str = ini_config_get(entry, PKG_CACHE_BLOBS, blob->name, NULL)) == NULL) {
+            return -1;
+        }
+
+        errno = 0;
+        size = strtoull(str, &end, 10);
+        if (errno != 0 || end == str || *end != '\0') {
+            return -1;
+        }
+        blob->size = (size_t)size;
+    }
+
+    return 0;
+}
+
+static void save_os_blobs_to_cache(const struct pkg_cache_key *key, struct list_head *head)
+{
+    char size[24];
+    os_blob_t *blob;
+    INI_CONFIG entry;
+
+    if ((entry = pkg_cache_prepare(key)) == NULL) {
+        return;
+    }
+
+    if (head) {
+        list_for_each_entry(blob, head, node) {
+            snprintf(size, sizeof(size), "%zu", blob->size);
+            if (ini_config_set(entry, PKG_CACHE_BLOBS, blob->name, size) != 0) {
+                ini_config_release(entry);
+                return;
+            }
+        }
+    }
+
+    pkg_cache_store(key, entry);
+}
+
+void release_package(package_t *package)
+{
+    os_package_t *os;
+    os_blob_t *os_blob, *os_tmp;
+    multi_os_blob_t *mos_blob, *mos_tmp;
+
+    if (package == NULL) {
+        return;
+    }
+
+    switch (package->type) {
+    case PKG_OS:
+        os = (os_package_t *)package->package;
+        list_for_each_entry_safe(os_blob, os_tmp, &os->blobs, node) {
+            list_del(&os_blob->node);
+            free_os_blob(os_blob);
+        }
+        hash_table_destroy(&os->apply_ids);
+        break;
+    case PKG_MULTI_OS:
+        list_for_each_entry_safe(mos_blob, mos_tmp, &((multi_os_package_t *)package->package)->blobs, node) {
+            list_del(&mos_blob->node);
+            free(mos_blob);
+        }
+        break;
+    default:
+        break;
+    }
+
+    pkg_index_release(package->index);
+    free(package);
+}
+
+package_t *parse_package(const char *manifest)
+{
+    size_t i, n;
+    package_t *package;
+    package_type_t t;
+    json_object *obj;
+    json_object *val;
+    json_object *val1;
+    json_object *blob_obj;
+    struct list_head *head;
+
+    if (manifest == NULL || (obj = json_tokener_parse(manifest)) == NULL) {
         progress_print(NULL, "The package information is broken!\n");
-        unlink(manifest);
         return NULL;
     }
-    unlink(manifest);
 
     progress_print(NULL, "Starting to parse package information...\n");
     package = NULL;
@@ -359,7 +946,7 @@ package_t *read_package(const char *pkg)
             goto release_json;
         }
 
-        i = sizeof(uint32_t) * n + sizeof(package_t) + sizeof(os_package_t);
+        i = sizeof(apply_id_t) * n + sizeof(package_t) + sizeof(os_package_t);
         if ((package = (package_t *)malloc(i)) == NULL) {
             progress_clearline();
             progress_print(NULL, "System has no enough memories to allocate!\n");
@@ -376,10 +963,27 @@ package_t *read_package(const char *pkg)
                 progress_print(NULL, "The package is unavailable for upgrading!\n");
                 goto release_json;
             }
-            ((os_package_t *)package->package)->apply_id[i] = (uint32_t)json_object_get_int(val1);
+            ((os_package_t *)package->package)->apply_id[i].id = (uint32_t)json_object_get_int(val1);
         }
         ((os_package_t *)package->package)->napply_id = n;
 
+        /* 一个多机型的包可能带有大量id, 建立索引后匹配设备id不必逐个比较 */
+        for (i = 0; (((size_t)1) << i) < n; ++i) {
+            continue;
+        }
+        if (hash_table_init(&((os_package_t *)package->package)->apply_ids, i, NULL) < 0) {
+            free(package);
+            package = NULL;
+            progress_clearline();
+            progress_print(NULL, "System has no enough memories to allocate!\n");
+            goto release_json;
+        }
+        for (i = 0; i < n; ++i) {
+            hash_table_add(&((os_package_t *)package->package)->apply_ids,
+                &((os_package_t *)package->package)->apply_id[i].node,
+                hash_u64(((os_package_t *)package->package)->apply_id[i].id));
+        }
+
         if ((val = json_object_object_get(obj, "version")) != NULL
                 && json_object_get_type(val) == json_type_string) {
             str2version(json_object_get_string(val), &((os_package_t *)package->package)->version);
@@ -389,42 +993,12 @@ package_t *read_package(const char *pkg)
         head = &((os_package_t *)package->package)->blobs;
         INIT_LIST_HEAD(head);
         if (read_os_blobs_from_json_obj(blob_obj, head) < 0) {
+            hash_table_destroy(&((os_package_t *)package->package)->apply_ids);
             free(package);
             package = NULL;
             progress_print(NULL, "The package is unavailable for upgrading!\n");
             goto release_json;
         }
-
-        /* md5sum check */
-        list_for_each_entry(os_blob, head, node) {
-            progress_print(NULL, "Checking %s file...", os_blob_type2name(os_blob->type), os_blob->name);
-            if (shell_command_output(md5sum, sizeof(md5sum), cmd_package_size, pkg, os_blob->name) < 0) {
-                progress_print(NULL, "\tfail to get file size\n");
-                goto release_all_os_blob;
-            }
-            os_blob->size = atoi(md5sum);
-            if (shell_command_output(md5sum, sizeof(md5sum), cmd_check_md5sum, pkg, os_blob->name) < 0
-                    || memcmp(md5sum, os_blob->md5sum, sizeof(os_blob->md5sum)) != 0) {
-                progress_print(NULL, "\tfail to get file md5sum\n");
-release_all_os_blob:
-                list_for_each_entry_safe(os_blob, os_tmp, head, node) {
-                    list_del(&os_blob->node);
-                    free(os_blob);
-                }
-                free(package);
-                package = NULL;
-                goto release_json;
-            }
-            progress_clearline();
-            progress_print(NULL, "[%s]\n"
-                                 "name: %s\n"
-                                 "size: %zu\n"
-                                 "md5sum: %.32s\n",
-                                 os_blob_type2name(os_blob->type),
-                                 os_blob->name,
-                                 os_blob->size,
-                                 os_blob->md5sum);
-        }
         break;
     case PKG_MULTI_OS:
         if ((package = (package_t *)malloc(sizeof(package_t) + sizeof(multi_os_package_t))) == NULL) {
@@ -436,21 +1010,6 @@ release_all_os_blob:
         if (read_multi_os_blobs_from_json_obj(blob_obj, head) < 0) {
             free(package);
             package = NULL;
-            break;
-        }
-
-        /* md5sum check */
-        list_for_each_entry(mos_blob, head, node) {
-            if (shell_command_output(md5sum, sizeof(md5sum), cmd_check_md5sum, pkg, mos_blob->name) < 0
-                    || memcmp(md5sum, mos_blob->md5sum, sizeof(mos_blob->md5sum)) != 0) {
-                list_for_each_entry_safe(mos_blob, mos_tmp, head, node) {
-                    list_del(&mos_blob->node);
-                    free(mos_blob);
-                }
-                free(package);
-                package = NULL;
-                goto release_json;
-            }
         }
         break;
     case PKG_PATCH:
@@ -459,12 +1018,181 @@ release_all_os_blob:
         break;
     case PKG_UNKNOWN:
     default:
-        goto release_json;
+        break;
+    }
+
+    if (package != NULL) {
+        package->type = t;
+        package->index = NULL;
+        package->path[0] = '\0';
     }
-    package->type = t;
-    strncpy(package->path, pkg, sizeof(package->path) - 1);
 
 release_json:
     json_object_put(obj);
     return package;
 }
+
+/* 逐个校验系统包中的镜像, 同时得到它们的大小 */
+static int check_os_blobs(const char *pkg, const struct pkg_index *index, struct list_head *head,
+    const upgrade_job_t *job)
+{
+    size_t kept;
+    char md5sum[32 + 1];
+    char command[PATH_MAX];
+    os_blob_t *os_blob;
+    const struct pkg_index_entry *entry;
+
+    kept = 0;
+    list_for_each_entry(os_blob, head, node) {
+        if (upgrade_job_canceled(job)) {
+            progress_print(NULL, "Checking is canceled.\n");
+            return -1;
+        }
+
+        progress_print(NULL, "Checking %s file...", os_blob_type2name(os_blob->type), os_blob->name);
+        if (os_blob->codec != BLOB_CODEC_RAW || os_blob->type == OS_BLOB_DICTIONARY) {
+            if (check_decoded_blob(pkg, index, os_blob, job, &kept) < 0) {
+                progress_print(NULL, "\tfail to decode %s file\n", blob_codec_name(os_blob->codec));
+                return -1;
+            }
+        } else if (os_blob->merkle) {
+            if (check_merkle(pkg, index, os_blob) < 0) {
+                progress_print(NULL, "\tfail to verify file chunks\n");
+                return -1;
+            }
+        } else {
+            if ((entry = pkg_index_find(index, os_blob->name)) != NULL) {
+                os_blob->size = (size_t)entry->size;
+            } else if (shell_command_output(md5sum, sizeof(md5sum), cmd_package_size, pkg, os_blob->name) < 0) {
+                progress_print(NULL, "\tfail to get file size\n");
+                return -1;
+            } else {
+                os_blob->size = atoi(md5sum);
+            }
+            if (package_file_command(command, sizeof(command), pkg, index, os_blob->name) != 0
+                    || shell_command_output(md5sum, sizeof(md5sum), "%s | md5sum", command) < 0
+                    || memcmp(md5sum, os_blob->md5sum, sizeof(os_blob->md5sum)) != 0) {
+                progress_print(NULL, "\tfail to get file md5sum\n");
+                return -1;
+            }
+        }
+        package_drop_cache(pkg, index, os_blob->name);
+
+        progress_clearline();
+        progress_print(NULL, "[%s]\n"
+                             "name: %s\n"
+                             "size: %zu\n"
+                             "md5sum: %.32s\n",
+                             os_blob_type2name(os_blob->type),
+                             os_blob->name,
+                             os_blob->size,
+                             os_blob->md5sum);
+    }
+
+    return 0;
+}
+
+static int check_multi_os_blobs(const char *pkg, const struct pkg_index *index, struct list_head *head,
+    const upgrade_job_t *job)
+{
+    char md5sum[32 + 1];
+    char command[PATH_MAX];
+    multi_os_blob_t *mos_blob;
+
+    list_for_each_entry(mos_blob, head, node) {
+        if (upgrade_job_canceled(job)
+                || package_file_command(command, sizeof(command), pkg, index, mos_blob->name) != 0
+                || shell_command_output(md5sum, sizeof(md5sum), "%s | md5sum", command) < 0
+                || memcmp(md5sum, mos_blob->md5sum, sizeof(mos_blob->md5sum)) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+package_t *read_package(const char *pkg, const upgrade_job_t *job)
+{
+    char *buf;
+    size_t len;
+    int cacheable;
+    INI_CONFIG cached;
+    package_t *package;
+    struct list_head *head;
+    struct pkg_index *index;
+    struct pkg_cache_key cache_key;
+    char command[PATH_MAX];
+
+    if (pkg == NULL) {
+        return NULL;
+    }
+
+    /* 有索引时清单在包的第一帧, 不用解压整个包去找它 */
+    progress_print(NULL, "Read package from %s.\n", pkg);
+    index = pkg_index_load(pkg);
+    if (package_file_command(command, sizeof(command), pkg, index, "manifest.json") != 0
+            || (buf = read_manifest(command, &len)) == NULL) {
+        progress_print(NULL, "Package does not contain the valid information!\n");
+        pkg_index_release(index);
+        return NULL;
+    }
+
+    /* 同一个包没有变化时, 上次的校验结果仍然有效 */
+    cacheable = pkg_cache_key_init(&cache_key, pkg, buf, len) == 0;
+    cached = cacheable ? pkg_cache_lookup(&cache_key) : NULL;
+    package = parse_package(buf);
+    free(buf);
+    if (package == NULL) {
+        pkg_index_release(index);
+        goto release_cache;
+    }
+    package->index = index;
+
+    switch (package->type) {
+    case PKG_OS:
+        head = &((os_package_t *)package->package)->blobs;
+        if (cached && restore_os_blobs_from_cache(cached, head) == 0) {
+            progress_print(NULL, "The package has been verified before, skip checking.\n");
+            break;
+        }
+
+        if (check_os_blobs(pkg, index, head, job) < 0) {
+            release_package(package);
+            package = NULL;
+            break;
+        }
+
+        if (cacheable) {
+            save_os_blobs_to_cache(&cache_key, head);
+        }
+        break;
+    case PKG_MULTI_OS:
+        if (cached) {
+            progress_print(NULL, "The package has been verified before, skip checking.\n");
+            break;
+        }
+
+        if (check_multi_os_blobs(pkg, index, &((multi_os_package_t *)package->package)->blobs, job) < 0) {
+            release_package(package);
+            package = NULL;
+            break;
+        }
+
+        if (cacheable) {
+            save_os_blobs_to_cache(&cache_key, NULL);
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (package != NULL) {
+        strncpy(package->path, pkg, sizeof(package->path) - 1);
+    }
+
+release_cache:
+    if (cached) {
+        ini_config_release(cached);
+    }
+    return package;
+}
@@ -0,0 +1,168 @@
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "pkgcache.h"
+
+static void pkg_cache_entry_path(const struct pkg_cache_key *key, char *path, size_t n)
+{
+    snprintf(path, n, "%s/%llx-%llx.ini", PKG_CACHE_DIR,
+        (unsigned long long)key->dev, (unsigned long long)key->ino);
+}
+
+int pkg_cache_key_init(struct pkg_cache_key *key, const char *pkg, const void *manifest, size_t len)
+{
+    int i;
+    struct stat st;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    if (key == NULL || pkg == NULL || manifest == NULL || stat(pkg, &st) != 0) {
+        return -1;
+    }
+
+    memset(key, 0, sizeof(*key));
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    if (realpath(pkg, key->path) == NULL) {
+        strncpy(key->path, pkg, sizeof(key->path) - 1);
+    }
+
+    /* ctime不能被用户修改, 可以发现touch -d之类还原mtime的改动 */
+    snprintf(key->size, sizeof(key->size), "%lld", (long long)st.st_size);
+    snprintf(key->mtime, sizeof(key->mtime), "%lld.%09ld", (long long)st.st_mtim.tv_sec,
+        st.st_mtim.tv_nsec);
+    snprintf(key->ctime, sizeof(key->ctime), "%lld.%09ld", (long long)st.st_ctim.tv_sec,
+        st.st_ctim.tv_nsec);
+
+    sha256(manifest, len, digest);
+    for (i = 0; i < SHA256_DIGEST_SIZE; ++i) {
+        snprintf(key->manifest + i * 2, 3, "%02x", digest[i]);
+    }
+
+    return 0;
+}
+
+static int pkg_cache_match(INI_CONFIG entry, const char *name, const char *value)
+{
+    const char *str;
+
+    return (str = ini_config_get(entry, PKG_CACHE_SECTION, name, NULL)) != NULL
+        && strcmp(str, value) == 0;
+}
+
+INI_CONFIG pkg_cache_lookup(const struct pkg_cache_key *key)
+{
+    char path[PATH_MAX];
+    INI_CONFIG entry;
+
+    if (key == NULL) {
+        return NULL;
+    }
+
+    pkg_cache_entry_path(key, path, sizeof(path));
+    if ((entry = ini_config_create(path)) == NULL) {
+        return NULL;
+    }
+
+    if (!pkg_cache_match(entry, "size", key->size)
+            || !pkg_cache_match(entry, "mtime", key->mtime)
+            || !pkg_cache_match(entry, "ctime", key->ctime)
+            || !pkg_cache_match(entry, "manifest", key->manifest)) {
+        ini_config_release(entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+INI_CONFIG pkg_cache_prepare(const struct pkg_cache_key *key)
+{
+    char now[24];
+    INI_CONFIG entry;
+
+    /* 从空配置开始, 保存时再通过ini_config_saveas写到缓存目录 */
+    if (key == NULL || (entry = ini_config_create("/dev/null")) == NULL) {
+        return NULL;
+    }
+
+    snprintf(now, sizeof(now), "%lld", (long long)time(NULL));
+    if (ini_config_set(entry, PKG_CACHE_SECTION, "path", key->path) != 0
+            || ini_config_set(entry, PKG_CACHE_SECTION, "size", key->size) != 0
+            || ini_config_set(entry, PKG_CACHE_SECTION, "mtime", key->mtime) != 0
+            || ini_config_set(entry, PKG_CACHE_SECTION, "ctime", key->ctime) != 0
+            || ini_config_set(entry, PKG_CACHE_SECTION, "manifest", key->manifest) != 0
+            || ini_config_set(entry, PKG_CACHE_SECTION, "verified", now) != 0) {
+        ini_config_release(entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+/* 超过PKG_CACHE_MAX时删除最早写入的记录 */
+static void pkg_cache_evict(void)
+{
+    DIR *dir;
+    size_t count;
+    time_t oldest;
+    struct stat st;
+    struct dirent *ent;
+    char path[PATH_MAX], victim[PATH_MAX];
+
+    do {
+        if ((dir = opendir(PKG_CACHE_DIR)) == NULL) {
+            return;
+        }
+
+        count = 0;
+        oldest = 0;
+        victim[0] = '\0';
+        while ((ent = readdir(dir)) != NULL) {
+            if (strstr(ent->d_name, ".ini") == NULL) {
+                continue;
+            }
+
+            snprintf(path, sizeof(path), "%s/%s", PKG_CACHE_DIR, ent->d_name);
+            if (stat(path, &st) != 0) {
+                continue;
+            }
+
+            if (count++ == 0 || st.st_mtime < oldest) {
+                oldest = st.st_mtime;
+                strcpy(victim, path);
+            }
+        }
+        closedir(dir);
+    } while (count > PKG_CACHE_MAX && victim[0] != '\0' && unlink(victim) == 0);
+}
+
+int pkg_cache_store(const struct pkg_cache_key *key, INI_CONFIG entry)
+{
+    int ret;
+    char path[PATH_MAX];
+
+    if (key == NULL || entry == NULL) {
+        return -1;
+    }
+
+    if ((mkdir(PKG_CACHE_ROOT, 0755) != 0 && errno != EEXIST)
+            || (mkdir(PKG_CACHE_DIR, 0755) != 0 && errno != EEXIST)) {
+        ini_config_release(entry);
+        return -1;
+    }
+
+    pkg_cache_entry_path(key, path, sizeof(path));
+    ret = ini_config_saveas(entry, path);
+    ini_config_release(entry);
+    if (ret == 0) {
+        pkg_cache_evict();
+    }
+
+    return ret;
+}
@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <json-c/json.h>
+#include "common.h"
+#include "pkgindex.h"
+
+static uint32_t pkg_index_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int pkg_index_pread(int fd, void *buf, size_t n, off_t off)
+{
+    ssize_t ret;
+    size_t done;
+
+    for (done = 0; done < n; done += ret) {
+        if ((ret = pread(fd, (char *)buf + done, n - done, off + done)) <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* 读出skippable帧中的索引JSON, 以'\0'结尾 */
+static char *pkg_index_read(const char *path)
+{
+    int fd;
+    char *buf;
+    uint32_t len;
+    struct stat st;
+    unsigned char footer[PKG_INDEX_FOOTER_SIZE], header[8];
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+
+    buf = NULL;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < PKG_INDEX_FOOTER_SIZE + 8
+            || pkg_index_pread(fd, footer, sizeof(footer), st.st_size - sizeof(footer)) != 0
+            || memcmp(footer + 4, PKG_INDEX_MAGIC, PKG_INDEX_MAGIC_SIZE) != 0) {
+        goto out;
+    }
+
+    len = pkg_index_le32(footer);
+    if (len == 0 || len > PKG_INDEX_MAX || (off_t)len + PKG_INDEX_FOOTER_SIZE + 8 > st.st_size) {
+        goto out;
+    }
+
+    /* 帧头记录的长度必须正好包含索引和尾部 */
+    if (pkg_index_pread(fd, header, sizeof(header), st.st_size - PKG_INDEX_FOOTER_SIZE - len - 8) != 0
+            || pkg_index_le32(header) != PKG_INDEX_FRAME_MAGIC
+            || pkg_index_le32(header + 4) != len + PKG_INDEX_FOOTER_SIZE) {
+        goto out;
+    }
+
+    if ((buf = (char *)malloc(len + 1)) == NULL) {
+        goto out;
+    }
+
+    if (pkg_index_pread(fd, buf, len, st.st_size - PKG_INDEX_FOOTER_SIZE - len) != 0) {
+        free(buf);
+        buf = NULL;
+        goto out;
+    }
+    buf[len] = '\0';
+
+out:
+    close(fd);
+    return buf;
+}
+
+static int pkg_index_u64(json_object *obj, const char *key, uint64_t *val)
+{
+    json_object *v;
+
+    if ((v = json_object_object_get(obj, key)) == NULL || json_object_get_type(v) != json_type_int
+            || json_object_get_int64(v) < 0) {
+        return -1;
+    }
+
+    *val = (uint64_t)json_object_get_int64(v);
+    return 0;
+}
+
+static int pkg_index_add(struct pkg_index *index, json_object *obj)
+{
+    size_t len;
+    const char *name;
+    json_object *key;
+    struct pkg_index_entry *entry;
+
+    if ((key = json_object_object_get(obj, "name")) == NULL
+            || (name = json_object_get_string(key)) == NULL
+            || (len = strlen(name)) == 0 || pkg_index_find(index, name) != NULL) {
+        return -1;
+    }
+
+    if ((entry = (struct pkg_index_entry *)malloc(sizeof(*entry) + len + 1)) == NULL) {
+        return -1;
+    }
+
+    memcpy(entry->name, name, len + 1);
+    if (pkg_index_u64(obj, "offset", &entry->offset) != 0
+            || pkg_index_u64(obj, "length", &entry->length) != 0
+            || pkg_index_u64(obj, "skip", &entry->skip) != 0
+            || pkg_index_u64(obj, "size", &entry->size) != 0 || entry->length == 0) {
+        free(entry);
+        return -1;
+    }
+
+    hash_table_add(&index->table, &entry->node, hash_table_hash(&index->table, name, len));
+    index->count++;
+    return 0;
+}
+
+struct pkg_index *pkg_index_load(const char *path)
+{
+    char *buf;
+    size_t i, n;
+    json_object *obj, *files;
+    struct pkg_index *index;
+
+    if (path == NULL || (buf = pkg_index_read(path)) == NULL) {
+        return NULL;
+    }
+
+    obj = json_tokener_parse(buf);
+    free(buf);
+    if (obj == NULL) {
+        return NULL;
+    }
+
+    index = NULL;
+    if ((files = json_object_object_get(obj, "files")) == NULL
+            || json_object_get_type(files) != json_type_array
+            || (n = json_object_array_length(files)) == 0) {
+        goto out;
+    }
+
+    if ((index = (struct pkg_index *)malloc(sizeof(*index))) == NULL) {
+        goto out;
+    }
+
+    index->count = 0;
+    for (i = 0; ((size_t)1 << i) < n; ++i) {
+        continue;
+    }
+    if (hash_table_init(&index->table, i, NULL) != 0) {
+        free(index);
+        index = NULL;
+        goto out;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (pkg_index_add(index, json_object_array_get_idx(files, i)) != 0) {
+            pkg_index_release(index);
+            index = NULL;
+            break;
+        }
+    }
+
+out:
+    json_object_put(obj);
+    return index;
+}
+
+const struct pkg_index_entry *pkg_index_find(const struct pkg_index *index, const char *name)
+{
+    uint64_t hash;
+    struct hlist_node *pos;
+    struct pkg_index_entry *entry;
+
+    if (index == NULL || name == NULL) {
+        return NULL;
+    }
+
+    hash = hash_table_hash(&index->table, name, strlen(name));
+    hash_table_for_each_possible(&index->table, entry, pos, hash, node) {
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+void pkg_index_release(struct pkg_index *index)
+{
+    size_t bkt;
+    struct hlist_node *pos, *n;
+    struct pkg_index_entry *entry;
+
+    if (index == NULL) {
+        return;
+    }
+
+    hash_table_for_each_safe(&index->table, bkt, entry, pos, n, node) {
+        hash_table_del(&index->table, &entry->node);
+        free(entry);
+    }
+    hash_table_destroy(&index->table);
+    free(index);
+}
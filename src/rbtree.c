@@ -327,6 +327,61 @@ void rb_augment_erase_end(struct rb_node *node, rb_augment_f func, void *data)
         rb_augment_path(node, func, data);
 }
 
+void rb_insert_color_cached(struct rb_node *node, struct rb_root_cached *root, int leftmost)
+{
+    if (leftmost)
+        root->rb_leftmost = node;
+    rb_insert_color(node, &root->rb_root);
+}
+
+void rb_erase_cached(struct rb_node *node, struct rb_root_cached *root)
+{
+    if (root->rb_leftmost == node)
+        root->rb_leftmost = rb_next(node);
+    rb_erase(node, &root->rb_root);
+}
+
+/*
+ * Every null link of a tree built by splitting at the midpoint is at depth
+ * floor(log2(n + 1)) or one deeper, so painting the nodes above that depth
+ * black and the ones on it (the incomplete bottom level) red gives a valid
+ * red-black tree without any rotation.
+ */
+static struct rb_node *__rb_build_sorted(struct rb_node **nodes, size_t n,
+                                         struct rb_node *parent, unsigned int depth,
+                                         unsigned int black_depth)
+{
+    size_t mid;
+    struct rb_node *node;
+
+    if (n == 0)
+        return NULL;
+
+    mid = n / 2;
+    node = nodes[mid];
+    rb_set_parent_color(node, parent, depth < black_depth ? RB_BLACK : RB_RED);
+    node->rb_left = __rb_build_sorted(nodes, mid, node, depth + 1, black_depth);
+    node->rb_right = __rb_build_sorted(nodes + mid + 1, n - mid - 1, node, depth + 1,
+                                       black_depth);
+
+    return node;
+}
+
+void rb_build_sorted(struct rb_root *root, struct rb_node **nodes, size_t n)
+{
+    unsigned int black_depth;
+
+    for (black_depth = 0; ((size_t)2 << black_depth) - 1 <= n; ++black_depth)
+        continue;
+    root->rb_node = __rb_build_sorted(nodes, n, NULL, 0, black_depth);
+}
+
+void rb_build_sorted_cached(struct rb_root_cached *root, struct rb_node **nodes, size_t n)
+{
+    rb_build_sorted(&root->rb_root, nodes, n);
+    root->rb_leftmost = n ? nodes[0] : NULL;
+}
+
 /*
  * This function returns the first node (in sort order) of the tree.
  */
@@ -0,0 +1,165 @@
+/*
+ * SHA-256 (FIPS 180-4), 纯C实现, 交叉编译到各个平台时不用依赖加密库.
+ */
+#include <string.h>
+#include "sha256.h"
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n)     (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)     (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)    (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define EP0(x)          (ROR32(x, 2) ^ ROR32(x, 13) ^ ROR32(x, 22))
+#define EP1(x)          (ROR32(x, 6) ^ ROR32(x, 11) ^ ROR32(x, 25))
+#define SIG0(x)         (ROR32(x, 7) ^ ROR32(x, 18) ^ ((x) >> 3))
+#define SIG1(x)         (ROR32(x, 17) ^ ROR32(x, 19) ^ ((x) >> 10))
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void sha256_transform(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+    int i;
+    uint32_t a, b, c, d, e, f, g, h, t1, t2, w[64];
+
+    while (nblocks--) {
+        for (i = 0; i < 16; ++i) {
+            w[i] = load_be32(data + i * 4);
+        }
+        for (; i < 64; ++i) {
+            w[i] = SIG1(w[i - 2]) + w[i - 7] + SIG0(w[i - 15]) + w[i - 16];
+        }
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        f = state[5];
+        g = state[6];
+        h = state[7];
+        for (i = 0; i < 64; ++i) {
+            t1 = h + EP1(e) + CH(e, f, g) + sha256_k[i] + w[i];
+            t2 = EP0(a) + MAJ(a, b, c);
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        data += SHA256_BLOCK_SIZE;
+    }
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->count = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+    size_t used, n;
+    const uint8_t *p;
+
+    p = (const uint8_t *)data;
+    used = (size_t)(ctx->count % SHA256_BLOCK_SIZE);
+    ctx->count += len;
+
+    if (used) {
+        n = SHA256_BLOCK_SIZE - used;
+        if (len < n) {
+            memcpy(ctx->buf + used, p, len);
+            return;
+        }
+        memcpy(ctx->buf + used, p, n);
+        sha256_transform(ctx->state, ctx->buf, 1);
+        p += n;
+        len -= n;
+    }
+
+    /* 整块直接从调用者的缓冲区计算 */
+    if (len >= SHA256_BLOCK_SIZE) {
+        n = len / SHA256_BLOCK_SIZE;
+        sha256_transform(ctx->state, p, n);
+        p += n * SHA256_BLOCK_SIZE;
+        len -= n * SHA256_BLOCK_SIZE;
+    }
+
+    if (len) {
+        memcpy(ctx->buf, p, len);
+    }
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+    int i;
+    size_t used;
+    uint64_t bits;
+
+    bits = ctx->count << 3;
+    used = (size_t)(ctx->count % SHA256_BLOCK_SIZE);
+    ctx->buf[used++] = 0x80;
+    if (used > SHA256_BLOCK_SIZE - 8) {
+        memset(ctx->buf + used, 0, SHA256_BLOCK_SIZE - used);
+        sha256_transform(ctx->state, ctx->buf, 1);
+        used = 0;
+    }
+    memset(ctx->buf + used, 0, SHA256_BLOCK_SIZE - 8 - used);
+    store_be32(ctx->buf + SHA256_BLOCK_SIZE - 8, (uint32_t)(bits >> 32));
+    store_be32(ctx->buf + SHA256_BLOCK_SIZE - 4, (uint32_t)bits);
+    sha256_transform(ctx->state, ctx->buf, 1);
+
+    for (i = 0; i < 8; ++i) {
+        store_be32(digest + i * 4, ctx->state[i]);
+    }
+
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+    struct sha256_ctx ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "common.h"
+#include "source.h"
+
+#define PKG_SOURCE_DECOMPRESS   "zstd"
+#define PKG_SOURCE_DROP_CHUNK   (8 << 20)
+
+struct pkg_source {
+    pkg_source_type_t type;
+    int fd;
+    const void *buf;
+    size_t len;
+    int stream;             /* 解压输出的读端 */
+    int input;              /* 解压进程的输入, 与它共享文件偏移 */
+    off_t dropped;          /* input中已经丢弃了页缓存的位置 */
+    pid_t decoder;          /* 解压进程 */
+    pid_t feeder;           /* 内存来源时向解压进程写数据的进程 */
+    char name[PATH_MAX];
+};
+
+static pkg_source_t *pkg_source_alloc(pkg_source_type_t type)
+{
+    pkg_source_t *source;
+
+    if ((source = (pkg_source_t *)malloc(sizeof(pkg_source_t))) == NULL) {
+        return NULL;
+    }
+
+    memset(source, 0, sizeof(pkg_source_t));
+    source->type = type;
+    source->fd = -1;
+    source->stream = -1;
+    source->input = -1;
+    source->decoder = -1;
+    source->feeder = -1;
+
+    return source;
+}
+
+pkg_source_t *pkg_source_path(const char *path)
+{
+    pkg_source_t *source;
+
+    if (path == NULL || strlen(path) >= PATH_MAX
+            || (source = pkg_source_alloc(PKG_SOURCE_PATH)) == NULL) {
+        return NULL;
+    }
+
+    strcpy(source->name, path);
+    return source;
+}
+
+pkg_source_t *pkg_source_fd(int fd)
+{
+    pkg_source_t *source;
+
+    if (fd < 0 || (source = pkg_source_alloc(PKG_SOURCE_FD)) == NULL) {
+        return NULL;
+    }
+
+    source->fd = fd;
+    snprintf(source->name, sizeof(source->name), "fd:%d", fd);
+    return source;
+}
+
+pkg_source_t *pkg_source_mem(const void *buf, size_t len)
+{
+    pkg_source_t *source;
+
+    if (buf == NULL || (source = pkg_source_alloc(PKG_SOURCE_MEM)) == NULL) {
+        return NULL;
+    }
+
+    source->buf = buf;
+    source->len = len;
+    strcpy(source->name, "memory");
+    return source;
+}
+
+pkg_source_type_t pkg_source_type(const pkg_source_t *source)
+{
+    return source->type;
+}
+
+const char *pkg_source_name(const pkg_source_t *source)
+{
+    return source ? source->name : NULL;
+}
+
+/* 子进程中把内存来源写入管道, 解压进程提前退出时被SIGPIPE结束 */
+static pid_t pkg_source_spawn_feeder(const pkg_source_t *source, int *rfd)
+{
+    pid_t pid;
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return -1;
+    }
+
+    if ((pid = fork()) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    } else if (pid == 0) {
+        close(fds[0]);
+        signal(SIGPIPE, SIG_DFL);
+        _exit(full_write(fds[1], source->buf, source->len) == (ssize_t)source->len ? 0 : 1);
+    }
+
+    close(fds[1]);
+    *rfd = fds[0];
+    return pid;
+}
+
+int pkg_source_open_stream(pkg_source_t *source)
+{
+    pid_t pid;
+    int in, fds[2];
+
+    if (source == NULL || source->stream >= 0) {
+        return -1;
+    }
+
+    switch (source->type) {
+    case PKG_SOURCE_PATH:
+        if ((in = open(source->name, O_RDONLY | O_CLOEXEC)) < 0) {
+            return -1;
+        }
+        break;
+    case PKG_SOURCE_FD:
+        in = source->fd;
+        break;
+    case PKG_SOURCE_MEM:
+        if ((source->feeder = pkg_source_spawn_feeder(source, &in)) < 0) {
+            return -1;
+        }
+        break;
+    default:
+        return -1;
+    }
+
+    /* 并行的任务各自fork, 管道不能被别的子进程继承 */
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        goto err;
+    }
+
+    if ((pid = fork()) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        goto err;
+    } else if (pid == 0) {
+        /* 不能留着读端, 否则提前关闭流时解压进程收不到SIGPIPE */
+        close(fds[0]);
+        if (dup2(in, STDIN_FILENO) < 0 || dup2(fds[1], STDOUT_FILENO) < 0) {
+            _exit(127);
+        }
+        close(fds[1]);
+        if (in != STDIN_FILENO) {
+            close(in);
+        }
+        signal(SIGPIPE, SIG_DFL);
+        execlp(PKG_SOURCE_DECOMPRESS, PKG_SOURCE_DECOMPRESS, "-dcq", (char *)NULL);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    if (source->type == PKG_SOURCE_MEM) {
+        close(in);
+    } else {
+        /* 升级包只顺序读一遍, 加大预读 */
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+        source->input = in;
+        source->dropped = lseek(in, 0, SEEK_CUR);
+    }
+    source->decoder = pid;
+    source->stream = fds[0];
+
+    return source->stream;
+err:
+    if (in != source->fd) {
+        close(in);
+    }
+    if (source->feeder > 0) {
+        kill(source->feeder, SIGKILL);
+        waitpid(source->feeder, NULL, 0);
+        source->feeder = -1;
+    }
+    return -1;
+}
+
+static int pkg_source_wait(pid_t pid)
+{
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+void pkg_source_drop_cache(pkg_source_t *source)
+{
+    off_t off;
+
+    if (source == NULL || source->input < 0 || source->dropped < 0
+            || (off = lseek(source->input, 0, SEEK_CUR)) < 0
+            || off - source->dropped < PKG_SOURCE_DROP_CHUNK) {
+        return;
+    }
+
+    file_drop_cache(source->input, source->dropped, off - source->dropped);
+    source->dropped = off;
+}
+
+int pkg_source_close_stream(pkg_source_t *source)
+{
+    int ret;
+
+    if (source == NULL || source->stream < 0) {
+        return -1;
+    }
+
+    close(source->stream);
+    source->stream = -1;
+
+    if (source->input >= 0) {
+        if (source->dropped >= 0) {
+            file_drop_cache(source->input, source->dropped, 0);
+        }
+        if (source->input != source->fd) {
+            close(source->input);
+        }
+        source->input = -1;
+    }
+
+    ret = pkg_source_wait(source->decoder);
+    source->decoder = -1;
+    if (source->feeder > 0) {
+        if (pkg_source_wait(source->feeder) != 0) {
+            ret = -1;
+        }
+        source->feeder = -1;
+    }
+
+    return ret;
+}
+
+void pkg_source_release(pkg_source_t *source)
+{
+    if (source == NULL) {
+        return;
+    }
+
+    pkg_source_close_stream(source);
+    free(source);
+}
@@ -0,0 +1,385 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "tarstream.h"
+
+/* POSIX ustar头, 占一个块 */
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+void tar_stream_init(struct tar_stream *ts, int fd)
+{
+    memset(ts, 0, sizeof(*ts));
+    ts->fd = fd;
+}
+
+static int tar_read_full(int fd, void *buf, size_t n)
+{
+    ssize_t ret;
+
+    ret = full_read(fd, buf, n);
+    return ret == (ssize_t)n ? 0 : -1;
+}
+
+static int tar_skip(int fd, uint64_t n)
+{
+    size_t len;
+    char buf[BUFF_SIZE];
+
+    while (n > 0) {
+        len = n < sizeof(buf) ? (size_t)n : sizeof(buf);
+        if (tar_read_full(fd, buf, len) != 0) {
+            return -1;
+        }
+        n -= len;
+    }
+
+    return 0;
+}
+
+/* 八进制, 或者第一个字节最高位为1时是base-256(GNU) */
+static int tar_number(const char *field, size_t len, uint64_t *val)
+{
+    size_t i;
+    uint64_t v;
+
+    v = 0;
+    if ((unsigned char)field[0] & 0x80) {
+        v = (unsigned char)field[0] & 0x7f;
+        for (i = 1; i < len; ++i) {
+            if (v >> 56) {
+                return -1;
+            }
+            v = (v << 8) | (unsigned char)field[i];
+        }
+        *val = v;
+        return 0;
+    }
+
+    for (i = 0; i < len && field[i] == ' '; ++i) {
+        continue;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+        if (v >> 61) {
+            return -1;
+        }
+        v = (v << 3) | (uint64_t)(field[i] - '0');
+    }
+
+    if (i < len && field[i] != ' ' && field[i] != '\0') {
+        return -1;
+    }
+
+    *val = v;
+    return 0;
+}
+
+static int tar_checksum_ok(const struct tar_header *hdr)
+{
+    size_t i;
+    uint64_t sum, expect;
+    const unsigned char *p;
+
+    if (tar_number(hdr->chksum, sizeof(hdr->chksum), &expect) != 0) {
+        return 0;
+    }
+
+    /* 校验和字段本身按空格计算 */
+    p = (const unsigned char *)hdr;
+    for (i = 0, sum = 0; i < TAR_BLOCK_SIZE; ++i) {
+        sum += (i >= offsetof(struct tar_header, chksum)
+            && i < offsetof(struct tar_header, chksum) + sizeof(hdr->chksum)) ? ' ' : p[i];
+    }
+
+    return sum == expect;
+}
+
+static int tar_block_zero(const char *block)
+{
+    size_t i;
+
+    for (i = 0; i < TAR_BLOCK_SIZE; ++i) {
+        if (block[i] != '\0') {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* 读取GNU长文件名或者pax头的数据, 包括补齐到块的填充 */
+static char *tar_read_meta(struct tar_stream *ts, uint64_t size)
+{
+    char *buf;
+
+    if (size == 0 || size > (1 << 20) || (buf = (char *)malloc(size + 1)) == NULL) {
+        return NULL;
+    }
+
+    if (tar_read_full(ts->fd, buf, size) != 0
+            || tar_skip(ts->fd, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE) != 0) {
+        free(buf);
+        return NULL;
+    }
+
+    buf[size] = '\0';
+    return buf;
+}
+
+/* pax记录的格式是"<len> <key>=<value>\n" */
+static int tar_parse_pax(const char *buf, size_t size, char *path, size_t n, uint64_t *psize)
+{
+    char *end;
+    size_t off, len, klen;
+    const char *rec, *eq;
+
+    for (off = 0; off < size; off += len) {
+        rec = buf + off;
+        len = strtoul(rec, &end, 10);
+        if (end == rec || *end != ' ' || len == 0 || len > size - off || rec[len - 1] != '\n') {
+            return -1;
+        }
+
+        if ((eq = memchr(end + 1, '=', rec + len - end - 1)) == NULL) {
+            return -1;
+        }
+
+        klen = eq - end - 1;
+        if (klen == 4 && memcmp(end + 1, "path", 4) == 0) {
+            if ((size_t)(rec + len - 1 - eq - 1) >= n) {
+                return -1;
+            }
+            memcpy(path, eq + 1, rec + len - 1 - eq - 1);
+            path[rec + len - 1 - eq - 1] = '\0';
+        } else if (klen == 4 && memcmp(end + 1, "size", 4) == 0) {
+            *psize = strtoull(eq + 1, NULL, 10);
+        }
+    }
+
+    return 0;
+}
+
+int tar_stream_next(struct tar_stream *ts)
+{
+    char *meta;
+    uint64_t size, pax_size;
+    const char *name;
+    char long_name[PATH_MAX];
+    union {
+        struct tar_header hdr;
+        char block[TAR_BLOCK_SIZE];
+    } u;
+
+    if (tar_skip(ts->fd, ts->remain + ts->pad) != 0) {
+        return -1;
+    }
+    ts->remain = 0;
+    ts->pad = 0;
+
+    long_name[0] = '\0';
+    pax_size = UINT64_MAX;
+    for (;;) {
+        if (tar_read_full(ts->fd, u.block, TAR_BLOCK_SIZE) != 0) {
+            return -1;
+        }
+
+        /* 归档以全0的块结束, 后面的不再读取 */
+        if (tar_block_zero(u.block)) {
+            return 0;
+        }
+
+        if (!tar_checksum_ok(&u.hdr) || tar_number(u.hdr.size, sizeof(u.hdr.size), &size) != 0) {
+            return -1;
+        }
+
+        if (u.hdr.typeflag == 'L' || u.hdr.typeflag == 'x') {
+            if ((meta = tar_read_meta(ts, size)) == NULL) {
+                return -1;
+            }
+
+            if (u.hdr.typeflag == 'L') {
+                snprintf(long_name, sizeof(long_name), "%s", meta);
+            } else if (tar_parse_pax(meta, size, long_name, sizeof(long_name), &pax_size) != 0) {
+                free(meta);
+                return -1;
+            }
+            free(meta);
+            continue;
+        }
+
+        if (u.hdr.typeflag == 'g' || u.hdr.typeflag == 'K') {
+            if (tar_skip(ts->fd, (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        break;
+    }
+
+    if (long_name[0]) {
+        snprintf(ts->name, sizeof(ts->name), "%s", long_name);
+    } else if (u.hdr.prefix[0] && memcmp(u.hdr.magic, "ustar", 5) == 0) {
+        snprintf(ts->name, sizeof(ts->name), "%.*s/%.*s",
+            (int)strnlen(u.hdr.prefix, sizeof(u.hdr.prefix)), u.hdr.prefix,
+            (int)strnlen(u.hdr.name, sizeof(u.hdr.name)), u.hdr.name);
+    } else {
+        snprintf(ts->name, sizeof(ts->name), "%.*s",
+            (int)strnlen(u.hdr.name, sizeof(u.hdr.name)), u.hdr.name);
+    }
+
+    /* "./manifest.json"和"manifest.json"是同一个文件 */
+    for (name = ts->name; name[0] == '.' && name[1] == '/'; name += 2) {
+        continue;
+    }
+    if (name != ts->name) {
+        memmove(ts->name, name, strlen(name) + 1);
+    }
+
+    if (pax_size != UINT64_MAX) {
+        size = pax_size;
+    }
+
+    switch (u.hdr.typeflag) {
+    case '0':
+    case '\0':
+    case '7':
+        ts->type = TAR_TYPE_FILE;
+        break;
+    case '5':
+        ts->type = TAR_TYPE_DIR;
+        break;
+    default:
+        ts->type = TAR_TYPE_OTHER;
+        break;
+    }
+
+    /* 链接和设备没有数据, 不管大小字段是多少 */
+    if (u.hdr.typeflag == '1' || u.hdr.typeflag == '2' || u.hdr.typeflag == '3'
+            || u.hdr.typeflag == '4' || u.hdr.typeflag == '5' || u.hdr.typeflag == '6') {
+        size = 0;
+    }
+
+    ts->size = size;
+    ts->remain = size;
+    ts->pad = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+    return 1;
+}
+
+ssize_t tar_stream_read(struct tar_stream *ts, void *buf, size_t n)
+{
+    ssize_t ret;
+
+    if (ts->remain == 0) {
+        return 0;
+    }
+
+    if (n > ts->remain) {
+        n = (size_t)ts->remain;
+    }
+
+    do {
+        ret = read(ts->fd, buf, n);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret <= 0) {
+        return -1;
+    }
+
+    ts->remain -= ret;
+    return ret;
+}
+
+static void tar_put_number(char *field, size_t len, uint64_t val)
+{
+    size_t i;
+
+    /* 能放进len - 1位时用八进制, 否则用base-256 */
+    if (val < ((uint64_t)1 << (3 * (len - 1)))) {
+        snprintf(field, len, "%0*llo", (int)len - 1, (unsigned long long)val);
+        return;
+    }
+
+    memset(field, 0, len);
+    for (i = len - 1; i > 0 && val; --i, val >>= 8) {
+        field[i] = (char)(val & 0xff);
+    }
+    field[0] = (char)0x80;
+}
+
+static void tar_fill_header(struct tar_header *hdr, const char *name, char type, uint64_t size,
+    time_t mtime)
+{
+    size_t i;
+    unsigned int sum;
+    const unsigned char *p;
+
+    memset(hdr, 0, sizeof(*hdr));
+    strncpy(hdr->name, name, sizeof(hdr->name));
+    tar_put_number(hdr->mode, sizeof(hdr->mode), 0644);
+    tar_put_number(hdr->uid, sizeof(hdr->uid), 0);
+    tar_put_number(hdr->gid, sizeof(hdr->gid), 0);
+    tar_put_number(hdr->size, sizeof(hdr->size), size);
+    tar_put_number(hdr->mtime, sizeof(hdr->mtime), mtime > 0 ? (uint64_t)mtime : 0);
+    hdr->typeflag = type;
+    memcpy(hdr->magic, "ustar ", sizeof(hdr->magic));
+    memcpy(hdr->version, " ", sizeof(hdr->version));
+    strcpy(hdr->uname, "root");
+    strcpy(hdr->gname, "root");
+
+    memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+    p = (const unsigned char *)hdr;
+    for (i = 0, sum = 0; i < TAR_BLOCK_SIZE; ++i) {
+        sum += p[i];
+    }
+    snprintf(hdr->chksum, sizeof(hdr->chksum), "%06o", sum);
+    hdr->chksum[7] = ' ';
+}
+
+ssize_t tar_write_header(void *buf, size_t n, const char *name, uint64_t size, time_t mtime)
+{
+    size_t len;
+    char *p;
+
+    if (buf == NULL || name == NULL || (len = strlen(name)) == 0 || len > TAR_NAME_MAX) {
+        return -1;
+    }
+
+    p = (char *)buf;
+    if (len > sizeof(((struct tar_header *)0)->name)) {
+        if (n < TAR_BLOCK_SIZE * 3) {
+            return -1;
+        }
+
+        tar_fill_header((struct tar_header *)p, "././@LongLink", 'L', len + 1, 0);
+        memset(p + TAR_BLOCK_SIZE, 0, TAR_BLOCK_SIZE);
+        memcpy(p + TAR_BLOCK_SIZE, name, len);
+        p += TAR_BLOCK_SIZE * 2;
+    } else if (n < TAR_BLOCK_SIZE) {
+        return -1;
+    }
+
+    tar_fill_header((struct tar_header *)p, name, '0', size, mtime);
+    return p + TAR_BLOCK_SIZE - (char *)buf;
+}
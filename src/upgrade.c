@@ -3,146 +3,1178 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "common.h"
+#include "blobstore.h"
+#include "codec.h"
+#include "configs.h"
+#include "device.h"
 #include "upgrade.h"
+#include "upgraded.h"
 #include "package.h"
+#include "source.h"
+#include "tarstream.h"
 
-static int get_device_id(uint32_t *id)
-{
-    *id = 123;
+#define UPGRADE_SCRATCH_DIR     "/var/tmp"
+#define UPGRADE_MANIFEST_MAX    (16 << 20)
+
+struct upgrade_job {
+    upgrade_job_type_t type;
+    upgrade_job_state_t state;
+    int ret;
+    int canceled;
+    int started;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    upgrade_job_ops_t ops;
+    void *arg;
+    pkg_source_t *source;       /* 非NULL时流式安装 */
+    char pkg[PATH_MAX];
+};
+
+/* 分区只有一份, 不同任务的升级阶段串行执行, 校验阶段可以并行 */
+static pthread_mutex_t upgrade_lock = PTHREAD_MUTEX_INITIALIZER;
 
+static int upgrade_bootloader(int fd)
+{
     return 0;
 }
 
-static int upgrade_bootloader(const char *pkg)
+static int upgrade_kernel(int fd)
 {
     return 0;
 }
 
-static int upgrade_kernel(const char *pkg)
+static int upgrade_rootfs(int fd)
 {
     return 0;
 }
 
-static int upgrade_rootfs(const char *pkg)
+static long elapsed_ms(const struct timespec *start)
 {
-    return 0;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long)(now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
 }
 
-static int upgrade_os(const package_t *pkg)
+/* fd是解压后的镜像, 从头开始写入分区 */
+static int upgrade_os_blob(const os_blob_t *blob, int fd)
+{
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        return -1;
+    }
+
+    switch (blob->type) {
+    case OS_BLOB_BOOTLOADER:
+        return upgrade_bootloader(fd);
+    case OS_BLOB_ROOTFS:
+        return upgrade_rootfs(fd);
+    case OS_BLOB_KERNEL:
+        return upgrade_kernel(fd);
+    default:
+        /* 不处理 */
+        return -1;
+    }
+}
+
+struct upgrade_stats {
+    size_t reused;
+    long saved_ms;
+};
+
+static int upgrade_os_match_device(const package_t *pkg)
 {
-    int ret;
-    size_t i;
     uint32_t id;
-    os_blob_t *blob;
-    os_package_t *os;
-    char tmp[256];
+
+    if (device_get_id(&id) != 0) {
+        return 0;
+    }
+
+    return os_package_match_id((os_package_t *)pkg->package, id);
+}
+
+/* 分区中已经是相同的内容时不用再写 */
+static int upgrade_os_installed(const os_blob_t *blob, struct upgrade_stats *stats)
+{
+    long cost_ms;
+    char content[80];
     const char *name;
 
-    if (pkg == NULL) {
-        return -1;
+    name = os_blob_type2name(blob->type);
+    if (os_blob_content_id(blob, content, sizeof(content)) != 0
+            || !blob_store_installed(name, content, &cost_ms)) {
+        return 0;
+    }
+
+    progress_print(NULL, "The %s file %s is already installed, skip.\n", name, blob->name);
+    stats->saved_ms += cost_ms;
+    stats->reused++;
+    return 1;
+}
+
+/* 本地仓库中有解压好的镜像时不用再解压 */
+static int upgrade_os_stored(const os_blob_t *blob, int *fd, long *decompress_ms, struct upgrade_stats *stats)
+{
+    long cost_ms;
+    char content[80];
+    char file[PATH_MAX];
+    const char *name;
+
+    if (os_blob_content_id(blob, content, sizeof(content)) != 0
+            || !blob_store_lookup(content, blob->size, file, sizeof(file), &cost_ms)
+            || (*fd = open(file, O_RDONLY | O_CLOEXEC)) < 0) {
+        return 0;
     }
 
-    if (get_device_id(&id) != 0) {
+    name = os_blob_type2name(blob->type);
+    progress_print(NULL, "Reusing %s file %s from the local store.\n", name, blob->name);
+    *decompress_ms = cost_ms;
+    stats->saved_ms += cost_ms;
+    stats->reused++;
+    return 1;
+}
+
+static int upgrade_dictionary_stored(const os_blob_t *blob)
+{
+    char content[80];
+    char file[PATH_MAX];
+
+    return os_blob_content_id(blob, content, sizeof(content)) == 0
+        && blob_store_lookup(content, blob->size, file, sizeof(file), NULL);
+}
+
+/* 字典在校验时已经放进本地仓库, 仓库中没有时(例如被清理过)重新解压 */
+static int upgrade_os_dictionary(const package_t *pkg, const os_blob_t *blob, const upgrade_job_t *job)
+{
+    int fd, ret;
+
+    if (upgrade_dictionary_stored(blob)) {
+        return 0;
+    }
+
+    progress_print(NULL, "Storing dictionary %s...", blob->name);
+    ret = -1;
+    if ((fd = upgrade_job_scratch(job, blob->name, os_blob_size_hint(blob))) >= 0) {
+        ret = extract_os_blob(pkg, blob, fd) == 0 && store_dictionary_blob(blob, fd) == 0 ? 0 : -1;
+        close(fd);
+    }
+    progress_print(NULL, ret == 0 ? " done\n" : " fail\n");
+
+    return ret;
+}
+
+/* 把解压后的镜像写入分区并关闭fd; fd不属于本地仓库时, 写入成功后按配置放进仓库 */
+static int upgrade_os_install(const os_blob_t *blob, int fd, int stored, long decompress_ms)
+{
+    int ret, have_id;
+    long cost_ms;
+    char content[80];
+    const char *name;
+    struct timespec start;
+
+    name = os_blob_type2name(blob->type);
+    have_id = os_blob_content_id(blob, content, sizeof(content)) == 0;
+
+    /* 多个分区同时写入时整行输出, 避免与其他分区的进度交错 */
+    if (have_id) {
+        blob_store_clear_installed(name);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = upgrade_os_blob(blob, fd);
+    cost_ms = decompress_ms + elapsed_ms(&start);
+
+    if (!stored && ret == 0 && have_id && system_config_bool(SYS_TUNABLE_KEEP_OBJECTS)) {
+        blob_store_put(content, fd, decompress_ms);
+    }
+    close(fd);
+
+    if (ret != 0) {
+        progress_print(NULL, "Upgrading %s... fail\n", name);
+        return ret;
+    }
+    progress_print(NULL, "Upgrading %s... done\n", name);
+
+    if (have_id) {
+        blob_store_set_installed(name, content, blob->size, cost_ms);
+    }
+
+    return 0;
+}
+
+static void upgrade_os_report(const struct upgrade_stats *stats, int ret)
+{
+    if (stats->reused) {
+        progress_print(NULL, "Reused %zu file(s), saved about %ld.%03lds.\n", stats->reused,
+            stats->saved_ms / 1000, stats->saved_ms % 1000);
+    }
+
+    if (ret == 0) {
+        progress_print(NULL, "Finish to upgrade system.\n");
+    } else {
+        progress_print(NULL, "Error ocurrs while upgrading!\n");
+    }
+}
+
+/* 检查时留下的镜像用不上了, 关闭后它占用的内存才会释放 */
+static void upgrade_os_blob_discard(os_blob_t *blob)
+{
+    if (blob->fd >= 0) {
+        close(blob->fd);
+        blob->fd = -1;
+    }
+}
+
+/*
+ * 准备要写入的镜像: 返回1时fd为解压并校验过的镜像, stored表示它属于本地仓库; 已安装的
+ * 返回0, 跳过; 解压或者校验失败返回-1, 不能写入. 检查升级包时留下的镜像直接拿过来用
+ */
+static int upgrade_os_blob_prepare(const package_t *pkg, os_blob_t *blob, const upgrade_job_t *job,
+    int *fd, int *stored, long *decompress_ms, struct upgrade_stats *stats)
+{
+    struct timespec start;
+    const char *name;
+
+    if (upgrade_os_installed(blob, stats)) {
+        upgrade_os_blob_discard(blob);
+        return 0;
+    }
+
+    if ((*stored = upgrade_os_stored(blob, fd, decompress_ms, stats))) {
+        upgrade_os_blob_discard(blob);
+        return 1;
+    }
+
+    name = os_blob_type2name(blob->type);
+    if (blob->fd >= 0) {
+        progress_print(NULL, "Using %s file %s decoded while checking.\n", name, blob->name);
+        *fd = blob->fd;
+        *decompress_ms = blob->decode_ms;
+        blob->fd = -1;
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((*fd = upgrade_job_scratch(job, blob->name, blob->size)) < 0 || extract_os_blob(pkg, blob, *fd) != 0) {
+        progress_print(NULL, "Decompressing %s file %s... fail\n", name, blob->name);
+        if (*fd >= 0) {
+            close(*fd);
+        }
         return -1;
     }
+    *decompress_ms = elapsed_ms(&start);
+    progress_print(NULL, "Decompressing %s file %s... done\n", name, blob->name);
 
-    os = (os_package_t *)pkg->package;
-    for (i = 0; i < os->napply_id; ++i) {
-        if (os->apply_id[i] == id) {
+    return 1;
+}
+
+typedef enum {
+    UPGRADE_TASK_PENDING,
+    UPGRADE_TASK_DECODING,
+    UPGRADE_TASK_DECODED,
+    UPGRADE_TASK_WRITING,
+    UPGRADE_TASK_DONE,
+} upgrade_task_state_t;
+
+struct upgrade_task {
+    os_blob_t *blob;
+    upgrade_task_state_t state;
+    int stored;
+    long decompress_ms;
+    size_t prefetched;          /* 占用预取额度的字节数 */
+    int fd;                     /* 解压后的镜像, DECODED时有效 */
+};
+
+/*
+ * 每个镜像分解压和写入两步. 默认按清单顺序写入, 前面的镜像都写完才写下一个; 清单中
+ * 给出"after"的镜像只等列出的镜像和前面同一类型的镜像(写同一个分区), 可以与其他分区
+ * 同时写. 空闲的线程优先写入, 否则按清单顺序提前解压后面的镜像, 解压好还没写的总量
+ * 不超过memory_budget; 检查时留在内存中的镜像一开始就占着额度, 交给任务时不再重复计算.
+ * 任何一个失败或者任务被取消后不再开始写入新的镜像, 等正在写的结束后返回; 没有给出
+ * "after"时正在写的只有失败的那一个, 与逐个写入时一样.
+ */
+struct upgrade_sched {
+    const package_t *pkg;
+    const upgrade_job_t *job;
+    struct upgrade_task *tasks;
+    size_t ntasks;
+    size_t prefetched;
+    size_t budget;
+    int ret;
+    struct upgrade_stats stats;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    progress_sink_t sink;       /* 调用线程的进度输出, 工作线程共用 */
+    void *sink_arg;
+    pthread_mutex_t sink_lock;
+    size_t *dropped;            /* 调用线程的页缓存计数器, 工作线程共用 */
+};
+
+/* 进度输出可能不是线程安全的, 例如守护进程分两次发给客户端, 逐条串行 */
+static void upgrade_sched_sink(void *arg, const char *text, size_t len)
+{
+    struct upgrade_sched *sched;
+
+    sched = (struct upgrade_sched *)arg;
+    pthread_mutex_lock(&sched->sink_lock);
+    sched->sink(sched->sink_arg, text, len);
+    pthread_mutex_unlock(&sched->sink_lock);
+}
+
+static int upgrade_sched_writable(const struct upgrade_sched *sched, size_t i)
+{
+    size_t j;
+    const os_blob_t *blob;
+
+    blob = sched->tasks[i].blob;
+    for (j = 0; j < blob->nafter; ++j) {
+        if (sched->tasks[blob->after[j]].state != UPGRADE_TASK_DONE) {
+            return 0;
+        }
+    }
+
+    /* 前面同一类型的镜像写同一个分区, 要等它写完, 否则后写的可能先落盘 */
+    for (j = 0; j < i; ++j) {
+        if (sched->tasks[j].state != UPGRADE_TASK_DONE
+                && (!blob->parallel || sched->tasks[j].blob->type == blob->type)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* 开始解压时还要占用的预取额度, 检查时留下的镜像已经算在task->prefetched中 */
+static size_t upgrade_task_cost(const struct upgrade_task *task)
+{
+    return task->blob->fd >= 0 ? 0 : task->blob->size;
+}
+
+/* 返回下一个可以写入或者解压的镜像, 没有就绪的返回NULL, *left表示是否还有没开始的 */
+static struct upgrade_task *upgrade_sched_next(struct upgrade_sched *sched, int *left)
+{
+    size_t i;
+    int busy;
+    struct upgrade_task *task;
+
+    *left = 0;
+    busy = 0;
+    for (i = 0; i < sched->ntasks; ++i) {
+        task = &sched->tasks[i];
+        if (task->state == UPGRADE_TASK_DECODING) {
+            busy = 1;
+        } else if (task->state == UPGRADE_TASK_DECODED) {
+            *left = 1;
+            busy = 1;
+            if (upgrade_sched_writable(sched, i)) {
+                return task;
+            }
+        }
+    }
+
+    /*
+     * 没有解压中或者等待写入的镜像时总是允许下一个开始, 否则比额度大的镜像, 或者额度被
+     * 检查时留下的后面的镜像占满时, 永远不会开始
+     */
+    for (i = 0; i < sched->ntasks; ++i) {
+        task = &sched->tasks[i];
+        if (task->state == UPGRADE_TASK_PENDING) {
+            *left = 1;
+            if (!busy || sched->prefetched + upgrade_task_cost(task) <= sched->budget) {
+                return task;
+            }
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void upgrade_sched_decode(struct upgrade_sched *sched, struct upgrade_task *task)
+{
+    int ready;
+    size_t cost;
+    struct upgrade_stats stats;
+
+    cost = upgrade_task_cost(task);
+    task->state = UPGRADE_TASK_DECODING;
+    task->prefetched += cost;
+    sched->prefetched += cost;
+    pthread_mutex_unlock(&sched->lock);
+
+    memset(&stats, 0, sizeof(stats));
+    ready = upgrade_os_blob_prepare(sched->pkg, task->blob, sched->job, &task->fd, &task->stored,
+        &task->decompress_ms, &stats);
+
+    pthread_mutex_lock(&sched->lock);
+    sched->stats.reused += stats.reused;
+    sched->stats.saved_ms += stats.saved_ms;
+    if (ready <= 0 || task->stored) {
+        sched->prefetched -= task->prefetched;
+        task->prefetched = 0;
+    }
+    if (ready < 0 && sched->ret == 0) {
+        sched->ret = -1;
+    }
+    task->state = ready > 0 ? UPGRADE_TASK_DECODED : UPGRADE_TASK_DONE;
+}
+
+static void upgrade_sched_write(struct upgrade_sched *sched, struct upgrade_task *task)
+{
+    int ret;
+
+    task->state = UPGRADE_TASK_WRITING;
+    pthread_mutex_unlock(&sched->lock);
+
+    ret = upgrade_os_install(task->blob, task->fd, task->stored, task->decompress_ms);
+
+    pthread_mutex_lock(&sched->lock);
+    sched->prefetched -= task->prefetched;
+    task->prefetched = 0;
+    task->state = UPGRADE_TASK_DONE;
+    if (ret != 0 && sched->ret == 0) {
+        sched->ret = ret;
+    }
+}
+
+static void *upgrade_sched_worker(void *arg)
+{
+    int left;
+    struct upgrade_task *task;
+    struct upgrade_sched *sched;
+
+    sched = (struct upgrade_sched *)arg;
+    page_cache_set_counter(sched->dropped);
+    if (sched->sink) {
+        progress_set_sink(upgrade_sched_sink, sched);
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    while (sched->ret == 0) {
+        if (upgrade_job_canceled(sched->job)) {
+            progress_print(NULL, "Upgrading is canceled.\n");
+            sched->ret = -1;
             break;
         }
+
+        if ((task = upgrade_sched_next(sched, &left)) == NULL) {
+            if (!left) {
+                break;
+            }
+            pthread_cond_wait(&sched->cond, &sched->lock);
+            continue;
+        }
+
+        if (task->state == UPGRADE_TASK_DECODED) {
+            upgrade_sched_write(sched, task);
+        } else {
+            upgrade_sched_decode(sched, task);
+        }
+        pthread_cond_broadcast(&sched->cond);
     }
+    /* 让等待中的线程看到失败或者全部开始 */
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
 
-    if (i >= os->napply_id) {
+    return NULL;
+}
+
+static int upgrade_os(const package_t *pkg, const upgrade_job_t *job)
+{
+    int ret;
+    size_t i, nthreads;
+    os_blob_t *blob;
+    os_package_t *os;
+    pthread_t *tids;
+    struct upgrade_task *task;
+    struct upgrade_sched sched;
+
+    if (pkg == NULL || !upgrade_os_match_device(pkg)) {
+        return -1;
+    }
+
+    memset(&sched, 0, sizeof(sched));
+    sched.pkg = pkg;
+    sched.job = job;
+    sched.budget = system_config_size(SYS_TUNABLE_MEMORY_BUDGET);
+    os = (os_package_t *)pkg->package;
+    list_for_each_entry(blob, &os->blobs, node) {
+        sched.ntasks++;
+    }
+
+    tids = NULL;
+    if ((sched.tasks = (struct upgrade_task *)calloc(sched.ntasks, sizeof(*sched.tasks))) == NULL) {
         return -1;
     }
 
     progress_print(NULL, "Starting to upgrade system...\n");
+
+    /* 字典不写分区, 先按顺序放进本地仓库, 引用它们的镜像才能解码 */
+    i = 0;
     list_for_each_entry(blob, &os->blobs, node) {
-        name = os_blob_type2name(blob->type);
-        progress_print(NULL, "Decompressing %s file %s...", name, blob->name);
-        if (decompress_package("/tmp/.up_dcm", pkg->path, blob->name) != 0) {
-            progress_print(NULL, " fail\n");
-            continue;
+        sched.tasks[i].blob = blob;
+        if (blob->fd >= 0) {
+            sched.tasks[i].prefetched = blob->kept;
+            sched.prefetched += blob->kept;
         }
-        progress_print(NULL, " done\nUpgrading %s...", name);
-        snprintf(tmp, sizeof(tmp), "/tmp/.up_dcm/%s", blob->name);
-        switch (blob->type) {
-        case OS_BLOB_BOOTLOADER:
-            ret = upgrade_bootloader(tmp);
-            break;
-        case OS_BLOB_ROOTFS:
-            ret = upgrade_rootfs(tmp);
+        if (blob->type == OS_BLOB_DICTIONARY) {
+            sched.tasks[i].state = UPGRADE_TASK_DONE;
+            if (upgrade_os_dictionary(pkg, blob, job) != 0) {
+                sched.ret = -1;
+                break;
+            }
+        }
+        i++;
+    }
+
+    /* 写入时主要在等I/O, 只有一个CPU时也要有一个线程提前解压下一个镜像 */
+    nthreads = (size_t)system_config_int(SYS_TUNABLE_THREADS);
+    if (nthreads < 2) {
+        nthreads = 2;
+    }
+    if (nthreads > sched.ntasks) {
+        nthreads = sched.ntasks;
+    }
+
+    /* 当前线程也是一个工作线程 */
+    if (sched.ret == 0 && nthreads > 1) {
+        tids = (pthread_t *)calloc(nthreads - 1, sizeof(*tids));
+    }
+
+    progress_get_sink(&sched.sink, &sched.sink_arg);
+    sched.dropped = page_cache_get_counter();
+    pthread_mutex_init(&sched.sink_lock, NULL);
+    pthread_mutex_init(&sched.lock, NULL);
+    pthread_cond_init(&sched.cond, NULL);
+    for (i = 0; tids && i < nthreads - 1; ++i) {
+        if (pthread_create(&tids[i], NULL, upgrade_sched_worker, &sched) != 0) {
             break;
-        case OS_BLOB_KERNEL:
-            ret = upgrade_kernel(tmp);
+        }
+    }
+    nthreads = i;
+
+    upgrade_sched_worker(&sched);
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    progress_set_sink(sched.sink, sched.sink_arg);
+    pthread_cond_destroy(&sched.cond);
+    pthread_mutex_destroy(&sched.lock);
+    pthread_mutex_destroy(&sched.sink_lock);
+
+    /* 失败时提前解压好的镜像不会再写了 */
+    for (i = 0; i < sched.ntasks; ++i) {
+        task = &sched.tasks[i];
+        if (task->state == UPGRADE_TASK_DECODED) {
+            close(task->fd);
+        }
+    }
+
+    ret = sched.ret;
+    upgrade_os_report(&sched.stats, ret);
+    free(tids);
+    free(sched.tasks);
+    return ret;
+}
+
+/* 读取流中的下一个文件, 跳过目录 */
+static int upgrade_stream_next(struct tar_stream *ts)
+{
+    int ret;
+
+    while ((ret = tar_stream_next(ts)) > 0 && ts->type == TAR_TYPE_DIR) {
+        continue;
+    }
+
+    return ret;
+}
+
+/* 流中的清单必须是第一个文件 */
+static package_t *upgrade_stream_manifest(struct tar_stream *ts)
+{
+    char *buf;
+    ssize_t n;
+    size_t len;
+    package_t *package;
+
+    if (upgrade_stream_next(ts) <= 0 || ts->type != TAR_TYPE_FILE
+            || strcmp(ts->name, "manifest.json") != 0) {
+        progress_print(NULL, "Package does not start with the valid information!\n");
+        return NULL;
+    }
+
+    if (ts->size > UPGRADE_MANIFEST_MAX || (buf = (char *)malloc(ts->size + 1)) == NULL) {
+        progress_print(NULL, "The package information is broken!\n");
+        return NULL;
+    }
+
+    for (len = 0; (n = tar_stream_read(ts, buf + len, ts->size - len)) > 0; len += n) {
+        continue;
+    }
+    if (n < 0) {
+        progress_print(NULL, "The package information is broken!\n");
+        free(buf);
+        return NULL;
+    }
+    buf[len] = '\0';
+
+    package = parse_package(buf);
+    free(buf);
+    return package;
+}
+
+/*
+ * 把流中的当前文件按镜像的编码解码后写到fd, 同时丢弃升级包中已经读过的部分的页缓存.
+ * 边解码边校验, 有分块哈希时遇到第一个坏块就停止, 不用等整个镜像收完; 通过后记录大小
+ */
+static int upgrade_stream_save(struct tar_stream *ts, pkg_source_t *source, os_blob_t *blob, int fd)
+{
+    char *buf;
+    ssize_t n;
+    size_t size;
+    uint64_t len;
+    blob_decoder_t *decoder;
+    os_blob_check_t check;
+    char ref[PATH_MAX];
+
+    if (os_blob_reference(blob, ref, sizeof(ref)) != 0) {
+        progress_print(NULL, " the %s %s is not in the local store", blob_ref_name(blob->ref),
+            blob->ref_content);
+        return -1;
+    }
+
+    /* 每次从流中读取io_buffer_size, 读得越多系统调用越少 */
+    size = system_config_size(SYS_TUNABLE_IO_BUFFER_SIZE);
+    if ((buf = (char *)malloc(size)) == NULL) {
+        return -1;
+    }
+
+    os_blob_check_init(&check, blob);
+    if ((decoder = blob_decoder_create(blob->codec, blob->ref, ref, fd, os_blob_check_update, &check)) == NULL) {
+        free(buf);
+        return -1;
+    }
+
+    while ((n = tar_stream_read(ts, buf, size)) > 0) {
+        if (blob_decoder_write(decoder, buf, n) != 0) {
+            n = -1;
             break;
-        default:
-            /* 不处理 */
+        }
+        pkg_source_drop_cache(source);
+    }
+
+    if (blob_decoder_close(decoder) != 0) {
+        n = -1;
+    }
+    free(buf);
+
+    if (n < 0 || os_blob_check_final(&check, fd, &len) != 0) {
+        return -1;
+    }
+    blob->size = (size_t)len;
+
+    return 0;
+}
+
+/*
+ * 流式安装: 清单之后的镜像必须按清单中的顺序排列, 每个镜像收到后立即校验并写入分区,
+ * 升级包不落盘, 同时最多只有一个解压后的镜像. 与先校验整个包的方式不同, 后面的
+ * 镜像损坏时前面的分区已经写入.
+ */
+static int upgrade_stream(upgrade_job_t *job)
+{
+    int ret, fd, upgrade, stored, image;
+    long decompress_ms;
+    package_t *package;
+    os_blob_t *blob;
+    struct tar_stream ts;
+    struct timespec start;
+    struct upgrade_stats stats;
+    const char *name;
+
+    upgrade = job->type == UPGRADE_JOB_UPGRADE;
+    memset(&stats, 0, sizeof(stats));
+    progress_print(NULL, "Read package from %s.\n", job->pkg);
+    if ((fd = pkg_source_open_stream(job->source)) < 0) {
+        progress_print(NULL, "Cannot open the package stream!\n");
+        return -1;
+    }
+
+    tar_stream_init(&ts, fd);
+    if ((package = upgrade_stream_manifest(&ts)) == NULL) {
+        pkg_source_close_stream(job->source);
+        return -1;
+    }
+    snprintf(package->path, sizeof(package->path), "%s", job->pkg);
+
+    if (package->type != PKG_OS) {
+        progress_print(NULL, "Only %s packages can be streamed!\n", package_type2name(PKG_OS));
+        ret = -1;
+        goto out;
+    }
+
+    if (upgrade) {
+        if (!upgrade_os_match_device(package)) {
+            progress_print(NULL, "The package is unavailable for this device!\n");
+            ret = -1;
+            goto out;
+        }
+        pthread_mutex_lock(&upgrade_lock);
+        progress_print(NULL, "Starting to upgrade system...\n");
+    }
+
+    ret = 0;
+    list_for_each_entry(blob, &((os_package_t *)package->package)->blobs, node) {
+        name = os_blob_type2name(blob->type);
+        if (upgrade_job_canceled(job)) {
+            progress_print(NULL, "%s is canceled.\n", upgrade ? "Upgrading" : "Checking");
             ret = -1;
             break;
         }
 
-        remove(tmp);
-        if (ret != 0) {
-            progress_print(NULL, " fail\n");
+        if (upgrade_stream_next(&ts) <= 0 || ts.type != TAR_TYPE_FILE || strcmp(ts.name, blob->name) != 0) {
+            progress_print(NULL, "The %s file %s is not the next one in the package!\n", name, blob->name);
+            ret = -1;
             break;
-        } else {
+        }
+
+        /* 跳过的镜像不读数据, 下一次tar_stream_next会丢弃它. 编码过的镜像大小由清单给出 */
+        if (blob->codec == BLOB_CODEC_RAW) {
+            blob->size = ts.size;
+        }
+
+        if (blob->type == OS_BLOB_DICTIONARY) {
+            if (upgrade_dictionary_stored(blob)) {
+                continue;
+            }
+        } else if (upgrade && upgrade_os_installed(blob, &stats)) {
+            continue;
+        }
+
+        stored = upgrade && blob->type != OS_BLOB_DICTIONARY
+            && upgrade_os_stored(blob, &image, &decompress_ms, &stats);
+        if (!stored) {
+            progress_print(NULL, "Receiving %s file %s...", name, blob->name);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            if ((image = upgrade_job_scratch(job, blob->name, os_blob_size_hint(blob))) < 0
+                    || upgrade_stream_save(&ts, job->source, blob, image) != 0) {
+                progress_print(NULL, " fail\n");
+                if (image >= 0) {
+                    close(image);
+                }
+                ret = -1;
+                break;
+            }
+            decompress_ms = elapsed_ms(&start);
             progress_print(NULL, " done\n");
         }
+
+        /* 后面的镜像可能引用字典, 只校验时也要放进本地仓库 */
+        if (blob->type == OS_BLOB_DICTIONARY) {
+            ret = store_dictionary_blob(blob, image);
+            close(image);
+            if (ret != 0) {
+                break;
+            }
+            continue;
+        }
+
+        if (!upgrade) {
+            close(image);
+            continue;
+        }
+
+        if ((ret = upgrade_os_install(blob, image, stored, decompress_ms)) != 0) {
+            break;
+        }
     }
 
+    /* 读完剩下的内容, 解压进程正常结束才说明整个流是完整的 */
     if (ret == 0) {
-        progress_print(NULL, "Finish to upgrade system.\n");
-    } else {
-        progress_print(NULL, "Error ocurrs while upgrading!\n");
+        while ((ret = tar_stream_next(&ts)) > 0) {
+            continue;
+        }
+    }
+
+    if (upgrade) {
+        upgrade_os_report(&stats, ret);
+        pthread_mutex_unlock(&upgrade_lock);
+    }
+
+out:
+    if (pkg_source_close_stream(job->source) != 0 && ret == 0) {
+        progress_print(NULL, "The package stream is broken!\n");
+        ret = -1;
+    }
+
+    if (ret == 0 && !upgrade) {
+        progress_print(NULL, "Package %s is valid.\n", job->pkg);
     }
 
+    release_package(package);
     return ret;
 }
 
-int upgrade_package(const char *pkg)
+static int upgrade_job_upgrade(upgrade_job_t *job)
 {
+    int ret;
     package_t *package;
 
-    if ((package = read_package(pkg)) == NULL) {
+    if ((package = read_package(job->pkg, job)) == NULL) {
         progress_clearline();
         progress_print(NULL, "Package is invalid, abort!\n");
         return -1;
     }
 
+    pthread_mutex_lock(&upgrade_lock);
+    ret = 0;
     switch (package->type) {
     case PKG_MULTI_OS:
         break;
     case PKG_OS:
-        upgrade_os(package);
+        ret = upgrade_os(package, job);
         break;
     case PKG_MULTI_PATCH:
         break;
     case PKG_PATCH:
         break;
     default:
-        free(package);
-        return -1;
+        ret = -1;
         break;
     }
+    pthread_mutex_unlock(&upgrade_lock);
 
+    release_package(package);
+    return ret;
+}
+
+static int upgrade_job_check(upgrade_job_t *job)
+{
+    package_t *package;
+
+    if ((package = read_package(job->pkg, job)) == NULL) {
+        progress_clearline();
+        progress_print(NULL, "Package is invalid!\n");
+        return -1;
+    }
+
+    progress_print(NULL, "Package %s is valid.\n", job->pkg);
+    release_package(package);
     return 0;
 }
 
+/* 在当前线程中执行任务 */
+static void upgrade_job_run(upgrade_job_t *job)
+{
+    int ret;
+    size_t dropped;
+    upgrade_job_state_t state;
+
+    if (job->ops.progress) {
+        progress_set_sink(job->ops.progress, job->arg);
+    }
+
+    dropped = 0;
+    page_cache_set_counter(&dropped);
+    if (job->source) {
+        ret = upgrade_stream(job);
+    } else if (job->type == UPGRADE_JOB_UPGRADE) {
+        ret = upgrade_job_upgrade(job);
+    } else {
+        ret = upgrade_job_check(job);
+    }
+
+    /*
+     * 升级时其他服务还在运行, 报告任务读写的文件用过后从页缓存中移除了多少. 系统的
+     * Cached变化主要反映其他服务, 不作为任务的指标
+     */
+    page_cache_set_counter(NULL);
+    progress_print(NULL, "Dropped %zu KiB of page cache after use.\n", dropped / 1024);
+
+    if (job->ops.finished) {
+        job->ops.finished(job, ret, job->arg);
+    }
+
+    if (job->ops.progress) {
+        progress_set_sink(NULL, NULL);
+    }
+
+    /* 取消请求到达时任务可能已经完成 */
+    if (ret == 0) {
+        state = UPGRADE_JOB_SUCCEEDED;
+    } else {
+        state = upgrade_job_canceled(job) ? UPGRADE_JOB_CANCELED : UPGRADE_JOB_FAILED;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->ret = ret;
+    job->state = state;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void *upgrade_job_thread(void *arg)
+{
+    upgrade_job_run((upgrade_job_t *)arg);
+    return NULL;
+}
+
+upgrade_job_t *upgrade_job_create(upgrade_job_type_t type, const char *pkg,
+    const upgrade_job_ops_t *ops, void *arg)
+{
+    upgrade_job_t *job;
+
+    if (pkg == NULL || strlen(pkg) >= PATH_MAX
+            || (type != UPGRADE_JOB_UPGRADE && type != UPGRADE_JOB_CHECK)) {
+        return NULL;
+    }
+
+    if ((job = (upgrade_job_t *)malloc(sizeof(upgrade_job_t))) == NULL) {
+        return NULL;
+    }
+
+    memset(job, 0, sizeof(upgrade_job_t));
+    job->type = type;
+    job->state = UPGRADE_JOB_CREATED;
+    job->ret = -1;
+    if (ops) {
+        job->ops = *ops;
+    }
+    job->arg = arg;
+    strcpy(job->pkg, pkg);
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+
+    return job;
+}
+
+upgrade_job_t *upgrade_job_create_source(upgrade_job_type_t type, pkg_source_t *source,
+    const upgrade_job_ops_t *ops, void *arg)
+{
+    upgrade_job_t *job;
+
+    if (source == NULL || (job = upgrade_job_create(type, pkg_source_name(source), ops, arg)) == NULL) {
+        return NULL;
+    }
+
+    job->source = source;
+    return job;
+}
+
+int upgrade_job_start(upgrade_job_t *job)
+{
+    int ret;
+
+    if (job == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    ret = -1;
+    if (job->state == UPGRADE_JOB_CREATED) {
+        job->state = UPGRADE_JOB_RUNNING;
+        if (pthread_create(&job->thread, NULL, upgrade_job_thread, job) == 0) {
+            job->started = 1;
+            ret = 0;
+        } else {
+            job->state = UPGRADE_JOB_CREATED;
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    return ret;
+}
+
+upgrade_job_state_t upgrade_job_poll(upgrade_job_t *job)
+{
+    upgrade_job_state_t state;
+
+    pthread_mutex_lock(&job->lock);
+    state = job->state;
+    pthread_mutex_unlock(&job->lock);
+
+    return state;
+}
+
+upgrade_job_state_t upgrade_job_wait(upgrade_job_t *job, int timeout_ms)
+{
+    struct timespec ts;
+    upgrade_job_state_t state;
+
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    while (job->state == UPGRADE_JOB_RUNNING) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        } else if (pthread_cond_timedwait(&job->cond, &job->lock, &ts) == ETIMEDOUT) {
+            break;
+        }
+    }
+    state = job->state;
+    pthread_mutex_unlock(&job->lock);
+
+    return state;
+}
+
+int upgrade_job_result(upgrade_job_t *job)
+{
+    int ret;
+
+    pthread_mutex_lock(&job->lock);
+    ret = job->state == UPGRADE_JOB_SUCCEEDED ? job->ret : -1;
+    pthread_mutex_unlock(&job->lock);
+
+    return ret;
+}
+
+int upgrade_job_cancel(upgrade_job_t *job)
+{
+    int ret;
+
+    if (job == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    ret = -1;
+    if (job->state == UPGRADE_JOB_CREATED) {
+        job->state = UPGRADE_JOB_CANCELED;
+        ret = 0;
+    } else if (job->state == UPGRADE_JOB_RUNNING) {
+        __atomic_store_n(&job->canceled, 1, __ATOMIC_RELEASE);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    return ret;
+}
+
+void upgrade_job_destroy(upgrade_job_t *job)
+{
+    if (job == NULL) {
+        return;
+    }
+
+    if (job->started) {
+        upgrade_job_cancel(job);
+        pthread_join(job->thread, NULL);
+    }
+
+    pkg_source_release(job->source);
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+int upgrade_job_scratch(const upgrade_job_t *job, const char *name, size_t size)
+{
+    if (job == NULL || name == NULL) {
+        return -1;
+    }
+
+    /* 不知道大小时放在磁盘上, 避免一个大镜像占满内存 */
+    return scratch_file(name, UPGRADE_SCRATCH_DIR,
+        size && size <= system_config_size(SYS_TUNABLE_MEMORY_BUDGET));
+}
+
+int upgrade_job_canceled(const upgrade_job_t *job)
+{
+    return job && __atomic_load_n(&job->canceled, __ATOMIC_ACQUIRE);
+}
+
+/* 同步接口, 任务在调用线程中执行, 进度输出沿用调用线程的设置 */
+static int upgrade_job_run_sync(upgrade_job_t *job)
+{
+    int ret;
+
+    if (job == NULL) {
+        return -1;
+    }
+
+    job->state = UPGRADE_JOB_RUNNING;
+    upgrade_job_run(job);
+    ret = job->ret;
+    upgrade_job_destroy(job);
+
+    return ret;
+}
+
+int upgrade_package(const char *pkg)
+{
+    return upgrade_job_run_sync(upgrade_job_create(UPGRADE_JOB_UPGRADE, pkg, NULL, NULL));
+}
+
+int check_package(const char *pkg)
+{
+    return upgrade_job_run_sync(upgrade_job_create(UPGRADE_JOB_CHECK, pkg, NULL, NULL));
+}
+
+int upgrade_package_source(pkg_source_t *source)
+{
+    upgrade_job_t *job;
+
+    if ((job = upgrade_job_create_source(UPGRADE_JOB_UPGRADE, source, NULL, NULL)) == NULL) {
+        pkg_source_release(source);
+        return -1;
+    }
+
+    return upgrade_job_run_sync(job);
+}
+
 #ifdef TEST
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s <package>\n"
+                    "       %s --stream <package|->\n"
+                    "       %s --daemon\n"
+                    "       %s --client upgrade|check <package>\n"
+                    "       %s --client status\n", prog, prog, prog, prog, prog);
+}
+
 int main(int argc, char *argv[])
 {
     if (argc < 2) {
+        usage(argv[0]);
         return -1;
     }
 
-    upgrade_package(argv[1]);
+    if (strcmp(argv[1], "--daemon") == 0) {
+        return upgraded_run(UPGRADED_SOCKET) == 0 ? 0 : 1;
+    }
 
-    return 0;
+    if (strcmp(argv[1], "--client") == 0) {
+        if (argc < 3) {
+            usage(argv[0]);
+            return -1;
+        }
+        return upgraded_client(UPGRADED_SOCKET, argv[2], argc > 3 ? argv[3] : NULL) == 0 ? 0 : 1;
+    }
+
+    /* 从标准输入或者命名管道边接收边升级 */
+    if (strcmp(argv[1], "--stream") == 0) {
+        if (argc < 3) {
+            usage(argv[0]);
+            return -1;
+        }
+        return upgrade_package_source(strcmp(argv[2], "-") == 0 ? pkg_source_fd(STDIN_FILENO)
+            : pkg_source_path(argv[2])) == 0 ? 0 : 1;
+    }
+
+    return upgrade_package(argv[1]) == 0 ? 0 : 1;
 }
 #endif
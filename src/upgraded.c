@@ -0,0 +1,417 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "list.h"
+#include "common.h"
+#include "configs.h"
+#include "device.h"
+#include "upgrade.h"
+#include "upgraded.h"
+
+#define UPGRADED_BACKLOG        16
+#define UPGRADED_REQUEST_MAX    (PATH_MAX + 16)
+#define UPGRADED_RECV_TIMEOUT   5
+
+typedef enum {
+    UPGRADED_JOB_UPGRADE,
+    UPGRADED_JOB_CHECK,
+} upgraded_job_type_t;
+
+struct upgraded_job {
+    struct list_head node;
+    unsigned long id;
+    upgraded_job_type_t type;
+    int fd;                     /* 客户端断开后置为-1, 任务照常执行 */
+    char pkg[PATH_MAX];
+};
+
+struct upgraded {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct list_head queue;
+    size_t nqueued;
+    unsigned long next_id;
+    unsigned long running;
+    int stop;
+};
+
+static volatile sig_atomic_t upgraded_stop;
+
+static int upgraded_send(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+    const char *p;
+
+    for (p = (const char *)buf; len > 0; p += n, len -= n) {
+        if ((n = send(fd, p, len, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int upgraded_sendf(int fd, const char *fmt, ...)
+{
+    int n;
+    va_list ap;
+    char buf[UPGRADED_REQUEST_MAX + 32];
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= sizeof(buf)) {
+        return -1;
+    }
+
+    return upgraded_send(fd, buf, n);
+}
+
+/* 任务线程的进度输出, 客户端断开后丢弃 */
+static void upgraded_sink(void *arg, const char *text, size_t len)
+{
+    struct upgraded_job *job;
+
+    job = (struct upgraded_job *)arg;
+    if (job->fd < 0) {
+        return;
+    }
+
+    if (upgraded_sendf(job->fd, "log %zu\n", len) < 0 || upgraded_send(job->fd, text, len) < 0) {
+        close(job->fd);
+        job->fd = -1;
+    }
+}
+
+static void *upgraded_worker(void *arg)
+{
+    int ret;
+    struct upgraded *d;
+    struct upgraded_job *job;
+
+    d = (struct upgraded *)arg;
+    pthread_mutex_lock(&d->lock);
+    for (;;) {
+        while (list_empty(&d->queue) && !d->stop) {
+            pthread_cond_wait(&d->cond, &d->lock);
+        }
+
+        if (d->stop) {
+            break;
+        }
+
+        job = list_first_entry(&d->queue, struct upgraded_job, node);
+        list_del(&job->node);
+        d->nqueued--;
+        d->running = job->id;
+        pthread_mutex_unlock(&d->lock);
+
+        progress_set_sink(upgraded_sink, job);
+        if (job->type == UPGRADED_JOB_UPGRADE) {
+            ret = upgrade_package(job->pkg);
+        } else {
+            ret = check_package(job->pkg);
+        }
+        progress_set_sink(NULL, NULL);
+
+        if (job->fd >= 0) {
+            upgraded_sendf(job->fd, "done %lu %d\n", job->id, ret);
+            close(job->fd);
+        }
+        free(job);
+
+        pthread_mutex_lock(&d->lock);
+        d->running = 0;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
+
+/* 读取一行请求, 客户端不能无限期占住accept循环 */
+static int upgraded_recv_request(int fd, char *buf, size_t size)
+{
+    ssize_t n;
+    size_t len;
+    char *eol;
+    struct timeval tv;
+
+    tv.tv_sec = UPGRADED_RECV_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    len = 0;
+    while (len < size - 1) {
+        if ((n = recv(fd, buf + len, size - 1 - len, 0)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        len += n;
+        buf[len] = '\0';
+        if ((eol = strchr(buf, '\n')) != NULL) {
+            *eol = '\0';
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void upgraded_handle(struct upgraded *d, int fd)
+{
+    const char *pkg;
+    char buf[UPGRADED_REQUEST_MAX];
+    struct upgraded_job *job;
+    upgraded_job_type_t type;
+
+    if (upgraded_recv_request(fd, buf, sizeof(buf)) < 0) {
+        close(fd);
+        return;
+    }
+
+    if (strcmp(buf, "status") == 0) {
+        pthread_mutex_lock(&d->lock);
+        upgraded_sendf(fd, "status %lu %zu\n", d->running, d->nqueued);
+        pthread_mutex_unlock(&d->lock);
+        close(fd);
+        return;
+    }
+
+    if (strncmp(buf, "upgrade ", strlen("upgrade ")) == 0) {
+        type = UPGRADED_JOB_UPGRADE;
+        pkg = buf + strlen("upgrade ");
+    } else if (strncmp(buf, "check ", strlen("check ")) == 0) {
+        type = UPGRADED_JOB_CHECK;
+        pkg = buf + strlen("check ");
+    } else {
+        upgraded_sendf(fd, "error unknown request\n");
+        close(fd);
+        return;
+    }
+
+    if (*pkg != '/' || strlen(pkg) >= sizeof(job->pkg)
+            || (job = (struct upgraded_job *)malloc(sizeof(*job))) == NULL) {
+        upgraded_sendf(fd, "error invalid package path\n");
+        close(fd);
+        return;
+    }
+
+    job->type = type;
+    job->fd = fd;
+    strcpy(job->pkg, pkg);
+
+    pthread_mutex_lock(&d->lock);
+    job->id = d->next_id++;
+    upgraded_sendf(fd, "queued %lu %zu\n", job->id, d->nqueued + (d->running != 0));
+    list_add_tail(&job->node, &d->queue);
+    d->nqueued++;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void upgraded_signal(int sig)
+{
+    upgraded_stop = 1;
+}
+
+static int upgraded_listen(const char *path)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+
+    /* 能连上说明已经有服务在运行, 否则是上次退出时留下的socket文件 */
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        progress_print(NULL, "The upgrade daemon is already running.\n");
+        close(fd);
+        return -1;
+    }
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || chmod(path, 0600) != 0
+            || listen(fd, UPGRADED_BACKLOG) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int upgraded_run(const char *path)
+{
+    int fd, cfd;
+    uint32_t id;
+    pthread_t worker;
+    struct sigaction sa;
+    struct upgraded d;
+    struct upgraded_job *job, *tmp;
+
+    if (path == NULL) {
+        return -1;
+    }
+
+    if (mkdir(UPGRADED_SOCKET_DIR, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    if ((fd = upgraded_listen(path)) < 0) {
+        return -1;
+    }
+
+    /* 预先加载, 之后的任务直接使用进程内的缓存 */
+    get_system_config();
+    device_get_id(&id);
+
+    memset(&d, 0, sizeof(d));
+    pthread_mutex_init(&d.lock, NULL);
+    pthread_cond_init(&d.cond, NULL);
+    INIT_LIST_HEAD(&d.queue);
+    d.next_id = 1;
+    if (pthread_create(&worker, NULL, upgraded_worker, &d) != 0) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    /* 不带SA_RESTART, accept会被信号打断 */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = upgraded_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    progress_print(NULL, "Upgrade daemon is listening on %s.\n", path);
+    while (!upgraded_stop) {
+        if ((cfd = accept(fd, NULL, NULL)) < 0) {
+            continue;
+        }
+        fcntl(cfd, F_SETFD, FD_CLOEXEC);
+        upgraded_handle(&d, cfd);
+    }
+
+    close(fd);
+    unlink(path);
+
+    pthread_mutex_lock(&d.lock);
+    d.stop = 1;
+    pthread_cond_signal(&d.cond);
+    list_for_each_entry_safe(job, tmp, &d.queue, node) {
+        list_del(&job->node);
+        upgraded_sendf(job->fd, "error daemon is stopping\n");
+        close(job->fd);
+        free(job);
+    }
+    pthread_mutex_unlock(&d.lock);
+
+    pthread_join(worker, NULL);
+    pthread_cond_destroy(&d.cond);
+    pthread_mutex_destroy(&d.lock);
+    progress_print(NULL, "Upgrade daemon stopped.\n");
+
+    return 0;
+}
+
+int upgraded_client(const char *path, const char *cmd, const char *pkg)
+{
+    int fd, ret;
+    FILE *fp;
+    size_t len, n;
+    unsigned long job;
+    char line[UPGRADED_REQUEST_MAX], buf[BUFF_SIZE];
+    char abspath[PATH_MAX];
+    struct sockaddr_un addr;
+
+    if (path == NULL || cmd == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    if (strcmp(cmd, "status") != 0) {
+        if (pkg == NULL || realpath(pkg, abspath) == NULL) {
+            progress_print(NULL, "Cannot find package %s.\n", pkg ? pkg : "");
+            return -1;
+        }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        progress_print(NULL, "The upgrade daemon is not running.\n");
+        close(fd);
+        return -1;
+    }
+
+    if ((strcmp(cmd, "status") == 0 ? upgraded_sendf(fd, "status\n")
+            : upgraded_sendf(fd, "%s %s\n", cmd, abspath)) < 0
+            || (fp = fdopen(fd, "r")) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    ret = -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "log %zu", &len) == 1) {
+            while (len > 0 && (n = fread(buf, 1, len < sizeof(buf) ? len : sizeof(buf), fp)) > 0) {
+                fwrite(buf, 1, n, stdout);
+                len -= n;
+            }
+            fflush(stdout);
+        } else if (sscanf(line, "queued %lu %zu", &job, &len) == 2) {
+            if (len) {
+                progress_print(NULL, "Job %lu is queued behind %zu job(s).\n", job, len);
+            }
+        } else if (sscanf(line, "done %lu %d", &job, &ret) == 2) {
+            break;
+        } else if (strncmp(line, "status ", strlen("status ")) == 0) {
+            if (sscanf(line, "status %lu %zu", &job, &len) == 2) {
+                if (job) {
+                    progress_print(NULL, "Running job %lu, %zu job(s) queued.\n", job, len);
+                } else {
+                    progress_print(NULL, "Idle.\n");
+                }
+                ret = 0;
+            }
+            break;
+        } else if (strncmp(line, "error ", strlen("error ")) == 0) {
+            progress_print(NULL, "%s", line + strlen("error "));
+            break;
+        }
+    }
+    fclose(fp);
+
+    return ret == 0 ? 0 : -1;
+}
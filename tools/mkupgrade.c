@@ -0,0 +1,883 @@
+/*
+ * mkupgrade - 由清单模板和镜像生成升级包
+ *
+ *   mkupgrade -m manifest.json -o os.pkg [-j threads] [-l level] [-c chunk_size]
+ *             [-f frame_size] image...
+ *
+ * image为"名字=路径"或者路径(名字取文件名), 与清单模板中blobs的name一一对应.
+ * 工具为每个镜像填写md5sum和merkle分块哈希(-c 0时不生成), 然后按pkgindex.h中的
+ * 布局输出: 清单在最前, 每个镜像切成frame_size大小的独立zstd帧, 最后是索引.
+ * 每一帧由一个zstd进程压缩, 默认同时运行与CPU数量相同的压缩线程.
+ *
+ * 模板中镜像的"codec"为zstd或lz4时, 先用对应的命令把镜像编码, 包中保存编码后的
+ * 文件, md5sum和分块哈希仍然针对原始镜像. zstd编码的镜像可以用"reference"引用设备
+ * 本地已有的内容, 其中"file"是引用内容在本机的路径, 只用于编码, 不写入包中的清单:
+ *
+ *   "reference": {"type": "base", "content": "merkle:...", "file": "old/rootfs.img"}
+ *
+ * "size"缺省时取file的大小.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <json-c/json.h>
+#include "codec.h"
+#include "common.h"
+#include "merkle.h"
+#include "pkgindex.h"
+#include "tarstream.h"
+
+#define MK_CHUNK_SIZE_DEFAULT   (1 << 20)
+#define MK_FRAME_SIZE_DEFAULT   (4 << 20)
+#define MK_LEVEL_DEFAULT        3
+#define MK_LZ4_LEVEL_MAX        12
+
+struct mk_image {
+    const char *name;
+    const char *path;
+    int fd;
+    uint64_t size;
+    time_t mtime;
+    blob_codec_t codec;
+    blob_ref_type_t ref;
+    char ref_file[PATH_MAX];
+    int member;                 /* 包中保存的内容, raw时就是镜像, 否则是编码后的临时文件 */
+    FILE *encoded;
+    uint64_t member_size;
+    size_t first_task;
+    size_t ntasks;
+    char md5sum[32 + 1];
+    struct merkle_tree *tree;
+    uint64_t offset;            /* 在输出中的压缩偏移 */
+    uint64_t length;
+    size_t skip;
+};
+
+typedef enum {
+    MK_TASK_MD5,                /* 计算镜像的md5sum */
+    MK_TASK_ENCODE,             /* 按codec编码镜像, 同时计算分块哈希 */
+    MK_TASK_FRAME,              /* 压缩一帧 */
+} mk_task_type_t;
+
+/* 一帧: 包中内容[start, start + len)的部分, 第一帧带tar头, 最后一帧带填充 */
+struct mk_task {
+    mk_task_type_t type;
+    struct mk_image *image;
+    uint64_t start;
+    uint64_t len;
+    FILE *out;
+};
+
+struct mk_ctx {
+    int level;
+    size_t chunk_size;
+    size_t frame_size;
+    struct mk_task *tasks;
+    size_t ntasks;
+    size_t next;
+    int failed;
+    pthread_mutex_t lock;
+};
+
+static int mk_write_all(int fd, const void *buf, size_t n)
+{
+    ssize_t ret;
+    const char *p;
+
+    for (p = (const char *)buf; n > 0; p += ret, n -= ret) {
+        if ((ret = write(fd, p, n)) < 0) {
+            if (errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int mk_pread_all(int fd, void *buf, size_t n, off_t off)
+{
+    ssize_t ret;
+    size_t done;
+
+    for (done = 0; done < n; done += ret) {
+        if ((ret = pread(fd, (char *)buf + done, n - done, off + done)) <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* 压缩命令, level超出lz4的范围时使用它的最高级别, extra附加在最后 */
+static void mk_compress_argv(blob_codec_t codec, int level, const char *const *extra, char *arg, size_t n,
+    const char *argv[10])
+{
+    int i;
+
+    i = 0;
+    if (codec == BLOB_CODEC_LZ4) {
+        argv[i++] = "lz4";
+        level = level > MK_LZ4_LEVEL_MAX ? MK_LZ4_LEVEL_MAX : level;
+    } else {
+        argv[i++] = "zstd";
+    }
+
+    argv[i++] = "-q";
+    argv[i++] = "-c";
+    if (codec != BLOB_CODEC_LZ4 && level > 19) {
+        argv[i++] = "--ultra";
+    }
+    snprintf(arg, n, "-%d", level);
+    argv[i++] = arg;
+    while (extra && *extra) {
+        argv[i++] = *extra++;
+    }
+    argv[i] = NULL;
+}
+
+/* 启动压缩进程, 输出写到out, 返回它的输入 */
+static pid_t mk_spawn_compressor(const char *const argv[], FILE *out, int *in)
+{
+    pid_t pid;
+    int fds[2];
+
+    /* 管道必须带O_CLOEXEC, 否则并行启动的其他压缩进程会拿着写端, 这一个永远等不到EOF */
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return -1;
+    }
+
+    if ((pid = fork()) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    } else if (pid == 0) {
+        if (dup2(fds[0], STDIN_FILENO) < 0 || dup2(fileno(out), STDOUT_FILENO) < 0) {
+            _exit(127);
+        }
+        execvp(argv[0], (char *const *)argv);
+        _exit(127);
+    }
+
+    close(fds[0]);
+    *in = fds[1];
+    return pid;
+}
+
+static int mk_wait(pid_t pid)
+{
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/*
+ * 把prefix、fd中[start, start + len)的内容和len_pad个0用codec压缩后写到out,
+ * tree不为NULL时同时计算这一段的分块哈希, extra是附加的压缩参数
+ */
+static int mk_compress(struct mk_ctx *ctx, blob_codec_t codec, const char *const *extra, FILE *out,
+    const void *prefix, size_t prefix_len, int fd, struct merkle_tree *tree, uint64_t start, uint64_t len,
+    size_t len_pad)
+{
+    int in, ret;
+    pid_t pid;
+    size_t n, bufsize;
+    uint64_t off;
+    char *buf;
+    char level[8];
+    const char *argv[10];
+    static const char zeros[TAR_BLOCK_SIZE];
+
+    bufsize = ctx->chunk_size ? ctx->chunk_size : MK_CHUNK_SIZE_DEFAULT;
+    if ((buf = (char *)malloc(bufsize)) == NULL) {
+        return -1;
+    }
+
+    mk_compress_argv(codec, ctx->level, extra, level, sizeof(level), argv);
+    if ((pid = mk_spawn_compressor(argv, out, &in)) < 0) {
+        free(buf);
+        return -1;
+    }
+
+    ret = 0;
+    if (prefix_len && mk_write_all(in, prefix, prefix_len) != 0) {
+        ret = -1;
+    }
+
+    for (off = start; ret == 0 && off < start + len; off += n) {
+        n = start + len - off < bufsize ? (size_t)(start + len - off) : bufsize;
+        if (mk_pread_all(fd, buf, n, (off_t)off) != 0 || mk_write_all(in, buf, n) != 0) {
+            ret = -1;
+            break;
+        }
+
+        /* 帧的大小是分块大小的整数倍, 每次读到的正好是一个完整的分块 */
+        if (tree) {
+            merkle_leaf_hash(buf, n, tree->leaves[off / ctx->chunk_size]);
+        }
+    }
+
+    if (ret == 0 && len_pad && mk_write_all(in, zeros, len_pad) != 0) {
+        ret = -1;
+    }
+
+    close(in);
+    if (mk_wait(pid) != 0) {
+        ret = -1;
+    }
+    free(buf);
+
+    return ret;
+}
+
+static int mk_md5sum(struct mk_image *image)
+{
+    char buf[33];
+
+    if (shell_command_output(buf, sizeof(buf), "md5sum '%s'", image->path) != 0 || strlen(buf) != 32) {
+        return -1;
+    }
+
+    memcpy(image->md5sum, buf, sizeof(image->md5sum));
+    return 0;
+}
+
+static int mk_encode(struct mk_ctx *ctx, struct mk_image *image)
+{
+    char patch[PATH_MAX + 16], stream_size[32];
+    const char *extra[3] = {NULL, NULL, NULL};
+
+    /* 压缩进程从管道读入, --patch-from需要预先知道输入的大小 */
+    if (image->ref == BLOB_REF_DICTIONARY) {
+        extra[0] = "-D";
+        extra[1] = image->ref_file;
+    } else if (image->ref == BLOB_REF_BASE) {
+        snprintf(patch, sizeof(patch), "--patch-from=%s", image->ref_file);
+        snprintf(stream_size, sizeof(stream_size), "--stream-size=%llu", (unsigned long long)image->size);
+        extra[0] = patch;
+        extra[1] = stream_size;
+    }
+
+    if ((image->encoded = tmpfile()) == NULL
+            || mk_compress(ctx, image->codec, extra, image->encoded, NULL, 0, image->fd, image->tree, 0,
+                image->size, 0) != 0) {
+        return -1;
+    }
+
+    image->member = fileno(image->encoded);
+    image->member_size = (uint64_t)lseek(image->member, 0, SEEK_END);
+    return 0;
+}
+
+static int mk_run_task(struct mk_ctx *ctx, struct mk_task *task)
+{
+    ssize_t hlen;
+    size_t pad;
+    struct mk_image *image;
+    char header[TAR_HEADER_MAX];
+
+    image = task->image;
+    switch (task->type) {
+    case MK_TASK_MD5:
+        return mk_md5sum(image);
+    case MK_TASK_ENCODE:
+        return mk_encode(ctx, image);
+    default:
+        break;
+    }
+
+    hlen = 0;
+    if (task->start == 0) {
+        if ((hlen = tar_write_header(header, sizeof(header), image->name, image->member_size,
+                image->mtime)) < 0) {
+            return -1;
+        }
+        image->skip = (size_t)hlen;
+    }
+
+    pad = 0;
+    if (task->start + task->len == image->member_size) {
+        pad = (TAR_BLOCK_SIZE - image->member_size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    }
+
+    /* 编码过的镜像在编码时已经计算了分块哈希 */
+    if ((task->out = tmpfile()) == NULL
+            || mk_compress(ctx, BLOB_CODEC_ZSTD, NULL, task->out, header, hlen, image->member,
+                image->codec == BLOB_CODEC_RAW ? image->tree : NULL, task->start, task->len, pad) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *mk_worker(void *arg)
+{
+    size_t i;
+    struct mk_ctx *ctx;
+
+    ctx = (struct mk_ctx *)arg;
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        if (ctx->failed || ctx->next >= ctx->ntasks) {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        i = ctx->next++;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (mk_run_task(ctx, &ctx->tasks[i]) != 0) {
+            pthread_mutex_lock(&ctx->lock);
+            ctx->failed = 1;
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* 用threads个线程执行tasks, 全部成功返回0 */
+static int mk_run_tasks(struct mk_ctx *ctx, struct mk_task *tasks, size_t ntasks, long threads)
+{
+    long i;
+    pthread_t *workers;
+
+    if ((workers = (pthread_t *)calloc(threads, sizeof(pthread_t))) == NULL) {
+        return -1;
+    }
+
+    ctx->tasks = tasks;
+    ctx->ntasks = ntasks;
+    ctx->next = 0;
+    for (i = 0; i < threads; ++i) {
+        if (pthread_create(&workers[i], NULL, mk_worker, ctx) != 0) {
+            break;
+        }
+    }
+
+    if (i == 0) {
+        ctx->failed = 1;
+    }
+
+    while (i-- > 0) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    return ctx->failed ? -1 : 0;
+}
+
+/* 模板中镜像引用的内容, 补全size并去掉只在本机有意义的file */
+static int mk_image_reference(json_object *ref, struct mk_image *image)
+{
+    const char *str;
+    struct stat st;
+    json_object *key;
+
+    if (image->codec != BLOB_CODEC_ZSTD) {
+        fprintf(stderr, "only zstd images of %s can have a reference\n", image->name);
+        return -1;
+    }
+
+    if ((key = json_object_object_get(ref, "type")) == NULL
+            || (image->ref = blob_ref_lookup(json_object_get_string(key))) == BLOB_REF_UNKNOWN
+            || image->ref == BLOB_REF_NONE) {
+        fprintf(stderr, "unknown reference type of image %s\n", image->name);
+        return -1;
+    }
+
+    if ((key = json_object_object_get(ref, "content")) == NULL || json_object_get_string_len(key) == 0) {
+        fprintf(stderr, "the reference of image %s has no content\n", image->name);
+        return -1;
+    }
+
+    if ((key = json_object_object_get(ref, "file")) == NULL || (str = json_object_get_string(key)) == NULL
+            || snprintf(image->ref_file, sizeof(image->ref_file), "%s", str) >= (int)sizeof(image->ref_file)
+            || stat(image->ref_file, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        fprintf(stderr, "cannot open the reference of image %s\n", image->name);
+        return -1;
+    }
+    json_object_object_del(ref, "file");
+
+    if (json_object_object_get(ref, "size") == NULL) {
+        json_object_object_add(ref, "size", json_object_new_int64((int64_t)st.st_size));
+    }
+
+    return 0;
+}
+
+/* 模板中镜像的编码 */
+static int mk_image_codec(json_object *manifest, struct mk_image *image)
+{
+    size_t i, n;
+    json_object *blobs, *blob, *key;
+
+    image->codec = BLOB_CODEC_RAW;
+    if ((blobs = json_object_object_get(manifest, "blobs")) == NULL
+            || json_object_get_type(blobs) != json_type_array) {
+        return 0;
+    }
+
+    for (i = 0, n = json_object_array_length(blobs); i < n; ++i) {
+        blob = json_object_array_get_idx(blobs, i);
+        if ((key = json_object_object_get(blob, "name")) == NULL
+                || strcmp(json_object_get_string(key), image->name) != 0) {
+            continue;
+        }
+
+        key = json_object_object_get(blob, "codec");
+        if ((image->codec = blob_codec_lookup(key ? json_object_get_string(key) : NULL)) == BLOB_CODEC_UNKNOWN) {
+            fprintf(stderr, "unknown codec of image %s\n", image->name);
+            return -1;
+        }
+
+        if ((key = json_object_object_get(blob, "reference")) != NULL && mk_image_reference(key, image) != 0) {
+            return -1;
+        }
+        break;
+    }
+
+    return 0;
+}
+
+static int mk_open_image(struct mk_image *image, const char *arg)
+{
+    char *eq;
+    struct stat st;
+
+    if ((eq = strchr(arg, '=')) != NULL) {
+        *eq = '\0';
+        image->name = arg;
+        image->path = eq + 1;
+    } else {
+        image->path = arg;
+        image->name = strrchr(arg, '/') ? strrchr(arg, '/') + 1 : arg;
+    }
+
+    if (image->name[0] == '\0' || strlen(image->name) > TAR_NAME_MAX
+            || strcmp(image->name, "manifest.json") == 0) {
+        fprintf(stderr, "invalid image name '%s'\n", image->name);
+        return -1;
+    }
+
+    if ((image->fd = open(image->path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(image->fd, &st) != 0
+            || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "cannot open image %s\n", image->path);
+        return -1;
+    }
+
+    image->size = (uint64_t)st.st_size;
+    image->mtime = st.st_mtime;
+    return 0;
+}
+
+static struct mk_image *mk_find_image(struct mk_image *images, size_t n, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        if (strcmp(images[i].name, name) == 0) {
+            return &images[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void mk_hex(const uint8_t *hash, char *hex)
+{
+    int i;
+
+    for (i = 0; i < MERKLE_HASH_SIZE; ++i) {
+        sprintf(hex + i * 2, "%02x", hash[i]);
+    }
+}
+
+/* 用计算出的md5sum和分块哈希填写清单模板 */
+static int mk_fill_manifest(json_object *manifest, struct mk_image *images, size_t n)
+{
+    size_t i, j, nblobs;
+    json_object *blobs, *blob, *key, *merkle, *chunks;
+    struct mk_image *image;
+    char hex[MERKLE_HASH_SIZE * 2 + 1];
+
+    if ((blobs = json_object_object_get(manifest, "blobs")) == NULL
+            || json_object_get_type(blobs) != json_type_array
+            || (nblobs = json_object_array_length(blobs)) != n) {
+        fprintf(stderr, "the manifest must list every image in \"blobs\"\n");
+        return -1;
+    }
+
+    for (i = 0; i < nblobs; ++i) {
+        blob = json_object_array_get_idx(blobs, i);
+        if ((key = json_object_object_get(blob, "name")) == NULL
+                || (image = mk_find_image(images, n, json_object_get_string(key))) == NULL) {
+            fprintf(stderr, "blob %zu of the manifest has no image\n", i);
+            return -1;
+        }
+
+        json_object_object_add(blob, "md5sum", json_object_new_string(image->md5sum));
+        if (image->tree == NULL) {
+            continue;
+        }
+
+        merkle_tree_root(image->tree, image->tree->root);
+        merkle = json_object_new_object();
+        chunks = json_object_new_array();
+        for (j = 0; j < image->tree->nchunks; ++j) {
+            mk_hex(image->tree->leaves[j], hex);
+            json_object_array_add(chunks, json_object_new_string(hex));
+        }
+        mk_hex(image->tree->root, hex);
+        json_object_object_add(merkle, "chunk size", json_object_new_int64((int64_t)image->tree->chunk_size));
+        json_object_object_add(merkle, "root", json_object_new_string(hex));
+        json_object_object_add(merkle, "chunks", chunks);
+        json_object_object_add(blob, "merkle", merkle);
+    }
+
+    return 0;
+}
+
+static int mk_copy(FILE *in, int out, uint64_t *written)
+{
+    size_t n;
+    char buf[BUFF_SIZE * 16];
+
+    rewind(in);
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (mk_write_all(out, buf, n) != 0) {
+            return -1;
+        }
+        *written += n;
+    }
+
+    return ferror(in) ? -1 : 0;
+}
+
+/* 把内存中的数据压缩成一帧追加到输出 */
+static int mk_put_frame(struct mk_ctx *ctx, int out, const void *data, size_t len, uint64_t *written)
+{
+    int ret;
+    FILE *tmp;
+
+    if ((tmp = tmpfile()) == NULL) {
+        return -1;
+    }
+
+    ret = mk_compress(ctx, BLOB_CODEC_ZSTD, NULL, tmp, data, len, -1, NULL, 0, 0, 0);
+    if (ret == 0) {
+        ret = mk_copy(tmp, out, written);
+    }
+    fclose(tmp);
+
+    return ret;
+}
+
+static void mk_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static json_object *mk_index_entry(const char *name, uint64_t offset, uint64_t length, size_t skip,
+    uint64_t size)
+{
+    json_object *obj;
+
+    obj = json_object_new_object();
+    json_object_object_add(obj, "name", json_object_new_string(name));
+    json_object_object_add(obj, "offset", json_object_new_int64((int64_t)offset));
+    json_object_object_add(obj, "length", json_object_new_int64((int64_t)length));
+    json_object_object_add(obj, "skip", json_object_new_int64((int64_t)skip));
+    json_object_object_add(obj, "size", json_object_new_int64((int64_t)size));
+    return obj;
+}
+
+static int mk_write_package(struct mk_ctx *ctx, json_object *manifest, struct mk_image *images,
+    size_t n, int out)
+{
+    size_t i, j, len, pad;
+    ssize_t hlen;
+    uint64_t written, start;
+    char *buf;
+    const char *text, *index;
+    json_object *root, *files;
+    unsigned char frame[8], footer[PKG_INDEX_FOOTER_SIZE];
+    static const char trailer[TAR_TRAILER_SIZE];
+
+    /* 清单: tar头 + 内容 + 填充, 单独一帧 */
+    text = json_object_to_json_string_ext(manifest, JSON_C_TO_STRING_PRETTY);
+    len = strlen(text);
+    pad = (TAR_BLOCK_SIZE - len % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    if ((buf = (char *)calloc(1, TAR_HEADER_MAX + len + pad)) == NULL
+            || (hlen = tar_write_header(buf, TAR_HEADER_MAX, "manifest.json", len, time(NULL))) < 0) {
+        free(buf);
+        return -1;
+    }
+    memcpy(buf + hlen, text, len);
+
+    root = json_object_new_object();
+    files = json_object_new_array();
+    json_object_object_add(root, "frame size", json_object_new_int64((int64_t)ctx->frame_size));
+    json_object_object_add(root, "files", files);
+
+    written = 0;
+    if (mk_put_frame(ctx, out, buf, hlen + len + pad, &written) != 0) {
+        free(buf);
+        json_object_put(root);
+        return -1;
+    }
+    free(buf);
+    json_object_array_add(files, mk_index_entry("manifest.json", 0, written, hlen, len));
+
+    for (i = 0; i < n; ++i) {
+        start = written;
+        for (j = 0; j < images[i].ntasks; ++j) {
+            if (mk_copy(ctx->tasks[images[i].first_task + j].out, out, &written) != 0) {
+                json_object_put(root);
+                return -1;
+            }
+        }
+        images[i].offset = start;
+        images[i].length = written - start;
+        json_object_array_add(files, mk_index_entry(images[i].name, images[i].offset,
+            images[i].length, images[i].skip, images[i].member_size));
+    }
+
+    if (mk_put_frame(ctx, out, trailer, sizeof(trailer), &written) != 0) {
+        json_object_put(root);
+        return -1;
+    }
+
+    /* 索引放在skippable帧中, 帧的最后是索引长度和PKG_INDEX_MAGIC */
+    index = json_object_to_json_string_ext(root, JSON_C_TO_STRING_PLAIN);
+    len = strlen(index);
+    mk_le32(frame, PKG_INDEX_FRAME_MAGIC);
+    mk_le32(frame + 4, (uint32_t)(len + PKG_INDEX_FOOTER_SIZE));
+    mk_le32(footer, (uint32_t)len);
+    memcpy(footer + 4, PKG_INDEX_MAGIC, PKG_INDEX_MAGIC_SIZE);
+    if (mk_write_all(out, frame, sizeof(frame)) != 0 || mk_write_all(out, index, len) != 0
+            || mk_write_all(out, footer, sizeof(footer)) != 0) {
+        json_object_put(root);
+        return -1;
+    }
+    written += sizeof(frame) + len + sizeof(footer);
+
+    printf("Wrote %llu bytes.\n", (unsigned long long)written);
+    json_object_put(root);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s -m manifest.json -o package [-j threads] [-l level]\n"
+                    "       %*s [-c chunk_size] [-f frame_size] [name=]image...\n",
+                    prog, (int)strlen(prog), "");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, out, ret;
+    long threads;
+    size_t i, j, n, ntasks;
+    uint64_t off;
+    const char *manifest_file, *output;
+    char tmp[PATH_MAX];
+    json_object *manifest;
+    struct mk_image *images;
+    struct mk_task *tasks;
+    struct mk_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.level = MK_LEVEL_DEFAULT;
+    ctx.chunk_size = MK_CHUNK_SIZE_DEFAULT;
+    ctx.frame_size = MK_FRAME_SIZE_DEFAULT;
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    manifest_file = NULL;
+    output = NULL;
+    while ((opt = getopt(argc, argv, "m:o:j:l:c:f:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            manifest_file = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'j':
+            threads = atol(optarg);
+            break;
+        case 'l':
+            ctx.level = atoi(optarg);
+            break;
+        case 'c':
+            ctx.chunk_size = (size_t)strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            ctx.frame_size = (size_t)strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (manifest_file == NULL || output == NULL || optind >= argc || ctx.frame_size == 0
+            || ctx.level < 1 || ctx.level > 22) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* 帧按分块对齐, 每个分块的哈希只在一帧中计算 */
+    if (ctx.chunk_size) {
+        ctx.frame_size = (ctx.frame_size + ctx.chunk_size - 1) / ctx.chunk_size * ctx.chunk_size;
+    }
+
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    if ((manifest = json_object_from_file(manifest_file)) == NULL) {
+        fprintf(stderr, "cannot read the manifest %s\n", manifest_file);
+        return 1;
+    }
+
+    n = argc - optind;
+    if ((images = (struct mk_image *)calloc(n, sizeof(*images))) == NULL) {
+        return 1;
+    }
+
+    for (i = 0; i < n; ++i) {
+        images[i].fd = -1;
+        if (mk_open_image(&images[i], argv[optind + i]) != 0 || mk_image_codec(manifest, &images[i]) != 0) {
+            return 1;
+        }
+
+        for (j = 0; j < i; ++j) {
+            if (strcmp(images[i].name, images[j].name) == 0) {
+                fprintf(stderr, "duplicated image %s\n", images[i].name);
+                return 1;
+            }
+        }
+
+        if (ctx.chunk_size && images[i].size) {
+            images[i].tree = merkle_tree_alloc(ctx.chunk_size,
+                (images[i].size + ctx.chunk_size - 1) / ctx.chunk_size);
+            if (images[i].tree == NULL) {
+                return 1;
+            }
+        }
+
+        images[i].member = images[i].fd;
+        images[i].member_size = images[i].size;
+    }
+
+    /* 第一步计算md5sum并编码镜像, 编码后的大小确定以后才能切分帧 */
+    if ((tasks = (struct mk_task *)calloc(n * 2, sizeof(*tasks))) == NULL) {
+        return 1;
+    }
+
+    for (i = 0, ntasks = 0; i < n; ++i) {
+        if (images[i].codec != BLOB_CODEC_RAW) {
+            tasks[ntasks].type = MK_TASK_ENCODE;
+            tasks[ntasks++].image = &images[i];
+        }
+        tasks[ntasks].type = MK_TASK_MD5;
+        tasks[ntasks++].image = &images[i];
+    }
+
+    pthread_mutex_init(&ctx.lock, NULL);
+    if (mk_run_tasks(&ctx, tasks, ntasks, threads) != 0) {
+        fprintf(stderr, "failed to encode the images\n");
+        return 1;
+    }
+    free(tasks);
+
+    for (i = 0, ntasks = 0; i < n; ++i) {
+        images[i].ntasks = images[i].member_size
+            ? (images[i].member_size + ctx.frame_size - 1) / ctx.frame_size : 1;
+        ntasks += images[i].ntasks;
+    }
+
+    if ((tasks = (struct mk_task *)calloc(ntasks, sizeof(*tasks))) == NULL) {
+        return 1;
+    }
+
+    /* 第二步压缩, 每个镜像的帧排在一起 */
+    for (i = 0, ntasks = 0; i < n; ++i) {
+        images[i].first_task = ntasks;
+        for (j = 0, off = 0; j < images[i].ntasks; ++j, off += ctx.frame_size) {
+            tasks[ntasks].type = MK_TASK_FRAME;
+            tasks[ntasks].image = &images[i];
+            tasks[ntasks].start = off;
+            tasks[ntasks].len = images[i].member_size - off < ctx.frame_size
+                ? images[i].member_size - off : ctx.frame_size;
+            ntasks++;
+        }
+    }
+
+    printf("Compressing %zu image(s) in %zu frame(s) with %ld thread(s)...\n", n, ntasks, threads);
+    if (mk_run_tasks(&ctx, tasks, ntasks, threads) != 0 || mk_fill_manifest(manifest, images, n) != 0) {
+        fprintf(stderr, "failed to build the package\n");
+        return 1;
+    }
+
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", output) >= (int)sizeof(tmp) || (out = mkstemp(tmp)) < 0) {
+        fprintf(stderr, "cannot create %s\n", output);
+        return 1;
+    }
+
+    ret = mk_write_package(&ctx, manifest, images, n, out);
+    if (ret == 0 && (fchmod(out, 0644) != 0 || fsync(out) != 0)) {
+        ret = -1;
+    }
+    close(out);
+    if (ret != 0 || rename(tmp, output) != 0) {
+        unlink(tmp);
+        fprintf(stderr, "failed to write %s\n", output);
+        return 1;
+    }
+
+    for (i = 0; i < ntasks; ++i) {
+        if (tasks[i].out) {
+            fclose(tasks[i].out);
+        }
+    }
+    for (i = 0; i < n; ++i) {
+        if (images[i].encoded) {
+            fclose(images[i].encoded);
+        }
+        close(images[i].fd);
+        free(images[i].tree);
+    }
+    free(tasks);
+    free(images);
+    json_object_put(manifest);
+
+    return 0;
+}